@@ -13,16 +13,39 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/dma-buf.h>
 #include <linux/dma-mapping.h>
 #include <linux/idr.h>
+#include <linux/iosys-map.h>
 #include <linux/mutex.h>
 #include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/user_namespace.h>
+#include <linux/scatterlist.h>
+#include <linux/version.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 #include "ai_accel.h"
 #include "../include/uapi/ai_accel.h"
@@ -39,48 +62,552 @@ static int num_engines = 4;
 module_param(num_engines, int, 0644);
 MODULE_PARM_DESC(num_engines, "Number of compute engines (default: 4)");
 
+/*
+ * Simulation timing model. A simulated job computes for
+ *   launch + model_size * batch * compute_ps_per_byte
+ * nanoseconds, +/- jitter, and spends input_size / bandwidth and
+ * output_size / bandwidth in input and output DMA. Changes take effect for
+ * the next submitted job.
+ */
+static unsigned int sim_launch_ns = 20000;
+module_param(sim_launch_ns, uint, 0644);
+MODULE_PARM_DESC(sim_launch_ns, "Simulated per-job launch overhead in ns (default: 20000)");
+
+static unsigned int sim_compute_ps_per_byte = 100;
+module_param(sim_compute_ps_per_byte, uint, 0644);
+MODULE_PARM_DESC(sim_compute_ps_per_byte,
+                 "Simulated compute time in ps per model byte per batch item (default: 100)");
+
+static unsigned int sim_dma_mbps = 12000;
+module_param(sim_dma_mbps, uint, 0644);
+MODULE_PARM_DESC(sim_dma_mbps, "Simulated DMA bandwidth in MB/s, 0 = free (default: 12000)");
+
+static unsigned int sim_jitter_pct;
+module_param(sim_jitter_pct, uint, 0644);
+MODULE_PARM_DESC(sim_jitter_pct, "Simulated job time jitter in percent (default: 0)");
+
+/*
+ * Time slices per priority class. A running job is switched out when its
+ * slice ends and another job of the same or a higher class is queued on its
+ * engine; 0 lets jobs of that class run to completion.
+ */
+static unsigned int timeslice_us_low = 50000;
+module_param(timeslice_us_low, uint, 0644);
+MODULE_PARM_DESC(timeslice_us_low, "Time slice for low priority jobs in us (default: 50000)");
+
+static unsigned int timeslice_us_normal = 10000;
+module_param(timeslice_us_normal, uint, 0644);
+MODULE_PARM_DESC(timeslice_us_normal, "Time slice for normal priority jobs in us (default: 10000)");
+
+static unsigned int timeslice_us_high = 2000;
+module_param(timeslice_us_high, uint, 0644);
+MODULE_PARM_DESC(timeslice_us_high, "Time slice for high priority jobs in us (default: 2000)");
+
+/*
+ * Simulated preemption granularity. When a higher class job arrives, the
+ * running job is switched out at its next checkpoint instead of at the end
+ * of its slice; 0 preempts only at slice and job boundaries.
+ */
+static unsigned int sim_checkpoint_us = 500;
+module_param(sim_checkpoint_us, uint, 0644);
+MODULE_PARM_DESC(sim_checkpoint_us, "Simulated preemption checkpoint interval in us (default: 500)");
+
+/*
+ * Overlap input DMA, compute and output DMA of consecutive jobs on an
+ * engine (double buffering); 0 runs one job's stages back to back.
+ */
+static int copy_overlap = 1;
+module_param(copy_overlap, int, 0644);
+MODULE_PARM_DESC(copy_overlap, "Overlap job input/output DMA with compute (default: 1)");
+
+/*
+ * COPY_IN transfer strategy by size. Host data is captured at submit: up to
+ * xfer_pack_max bytes it is packed with the job's other small copies, above
+ * that it goes through a pooled staging buffer, and above xfer_bounce_max_kb
+ * through one allocated for the job alone. A COPY_IN flagged
+ * AI_CMD_FLAG_DEFER_READ of at least xfer_pin_min_kb is instead read
+ * straight from pinned user memory when the job runs.
+ */
+static unsigned int xfer_pack_max = 4096;
+module_param(xfer_pack_max, uint, 0644);
+MODULE_PARM_DESC(xfer_pack_max, "Largest COPY_IN packed with the job's other small copies, in bytes (default: 4096)");
+
+static unsigned int xfer_bounce_max_kb = 1024;
+module_param(xfer_bounce_max_kb, uint, 0644);
+MODULE_PARM_DESC(xfer_bounce_max_kb,
+                 "Largest COPY_IN staged through the per-file pool in KB (default: 1024)");
+
+static unsigned int xfer_pin_min_kb = 1024;
+module_param(xfer_pin_min_kb, uint, 0644);
+MODULE_PARM_DESC(xfer_pin_min_kb,
+                 "Smallest deferred-read COPY_IN read from pinned user memory in KB, 0 = never (default: 1024)");
+
+/*
+ * Idle staging buffers a context keeps, in KB. A buffer that would take
+ * the pool over this is freed instead, so an open file holds at most this
+ * much host memory between submissions; 0 = never pool.
+ */
+static unsigned int staging_pool_max_kb = 4096;
+module_param(staging_pool_max_kb, uint, 0644);
+MODULE_PARM_DESC(staging_pool_max_kb,
+                 "Idle COPY_IN staging memory kept per open file in KB, 0 = none (default: 4096)");
+
+/*
+ * Dynamic batching. A queued inference request joins an earlier queued
+ * request for the same model on the same engine, so that both run in one
+ * dispatch of up to batch_max items and pay the launch overhead once. A
+ * request that could take more items waits up to batch_window_us for them
+ * before its input DMA starts; 0 only merges requests already waiting.
+ */
+static unsigned int batch_max = 32;
+module_param(batch_max, uint, 0644);
+MODULE_PARM_DESC(batch_max,
+                 "Most batch items per engine dispatch, <= 1 = no batching (default: 32)");
+
+static unsigned int batch_window_us;
+module_param(batch_window_us, uint, 0644);
+MODULE_PARM_DESC(batch_window_us,
+                 "Time a request may wait for more of its model's requests in us (default: 0)");
+
+/* Spin budget of AI_WAIT_BUSY_POLL waits, charged to the waiter's CPU time */
+static unsigned int wait_busy_poll_us = 50;
+module_param(wait_busy_poll_us, uint, 0644);
+MODULE_PARM_DESC(wait_busy_poll_us,
+                 "Busy-poll budget of AI_WAIT_BUSY_POLL waits in us, 0 = never spin (default: 50)");
+
+static unsigned int job_timeout_ms = 5000;
+module_param(job_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(job_timeout_ms, "Default job execution timeout in ms, 0 = none (default: 5000)");
+
+static unsigned int sim_hang_pct;
+module_param(sim_hang_pct, uint, 0644);
+MODULE_PARM_DESC(sim_hang_pct, "Simulated percentage of jobs that hang (default: 0)");
+
+/*
+ * Device memory quotas, in MB (0 = unlimited). Hard limits fail allocations
+ * with -EDQUOT. A context or user above its soft limit may not dip into the
+ * last mem_soft_reserve_pct percent of device memory, which is kept for
+ * tenants within their soft limits.
+ */
+static unsigned int ctx_mem_hard_mb;
+module_param(ctx_mem_hard_mb, uint, 0644);
+MODULE_PARM_DESC(ctx_mem_hard_mb, "Per-context device memory hard limit in MB (default: 0 = none)");
+
+static unsigned int ctx_mem_soft_mb;
+module_param(ctx_mem_soft_mb, uint, 0644);
+MODULE_PARM_DESC(ctx_mem_soft_mb, "Per-context device memory soft limit in MB (default: 0 = none)");
+
+static unsigned int uid_mem_hard_mb;
+module_param(uid_mem_hard_mb, uint, 0644);
+MODULE_PARM_DESC(uid_mem_hard_mb, "Per-user device memory hard limit in MB (default: 0 = none)");
+
+static unsigned int uid_mem_soft_mb;
+module_param(uid_mem_soft_mb, uint, 0644);
+MODULE_PARM_DESC(uid_mem_soft_mb, "Per-user device memory soft limit in MB (default: 0 = none)");
+
+static unsigned int mem_soft_reserve_pct = 10;
+module_param(mem_soft_reserve_pct, uint, 0644);
+MODULE_PARM_DESC(mem_soft_reserve_pct,
+                 "Device memory reserved for tenants below their soft limit, in percent (default: 10)");
+
+/*
+ * Device memory overcommit. Allocations may total up to mem_overcommit_pct
+ * percent of device memory; idle buffers and models beyond what fits are
+ * evicted to host memory in LRU order and restored when a job needs them.
+ */
+static unsigned int mem_overcommit_pct = 100;
+module_param(mem_overcommit_pct, uint, 0644);
+MODULE_PARM_DESC(mem_overcommit_pct,
+                 "Device memory that may be allocated, in percent of its size (default: 100 = no overcommit)");
+
 /* Global state */
 static dev_t ai_dev_number;
 static struct class *ai_class;
 static struct ai_device *ai_dev;
 
+/* COPY_IN strategies; AI_XFER_* is BIT() of these */
+enum ai_xfer_kind {
+    AI_XFER_KIND_INLINE,
+    AI_XFER_KIND_BOUNCE,
+    AI_XFER_KIND_PINNED,
+    AI_XFER_KIND_PACKED,
+    AI_XFER_KINDS
+};
+
 /* Device structure */
 struct ai_device {
     struct cdev cdev;
     struct device *dev;
+    struct device_dma_parameters dma_parms;
     struct mutex lock;
     
     /* Handle management */
     struct idr buffer_idr;
     struct idr model_idr;
+    struct idr job_idr;         /* fence -> struct ai_job */
     atomic_t fence_counter;
     
+    /*
+     * Retired fences that failed, so that an in-fence on one still fails
+     * its job; the oldest are dropped beyond AI_FAILED_FENCES, and the
+     * outcome of retired fences up to failed_floor is then unknown.
+     */
+    struct xarray failed_fences;
+    unsigned int num_failed;
+    u64 failed_floor;
+    
+    /* Device memory accounting, under lock */
+    u64 mem_used;
+    u64 mem_throttled;          /* Allocations refused by a soft limit */
+    struct list_head mem_users; /* Per-uid struct ai_mem_account */
+    
+    /* Residency, under lock */
+    u64 mem_resident;           /* Bytes held in device memory */
+    struct list_head mem_lru;   /* Resident struct ai_mem_obj, coldest first */
+    u64 mem_evictions;
+    u64 mem_restores;
+    u64 mem_bytes_evicted;
+    u64 mem_bytes_restored;
+    
+    /* Job scheduling */
+    spinlock_t sched_lock;      /* Protects engine queues and job state */
+    struct ai_engine *engines;
+    u32 num_engines;
+    struct workqueue_struct *exec_wq;   /* Command buffer execution */
+    wait_queue_head_t fence_wq; /* AI_IOC_WAIT_MULTI, woken by every job */
+    struct delayed_work watchdog;       /* Hung job detection */
+    u64 engine_resets;
+    u64 batch_dispatches;       /* Dispatches of more than one request */
+    u64 batch_merged;           /* Requests that joined another's dispatch */
+    ktime_t engines_start;      /* Origin of the stage occupancy figures */
+    
+    /* COPY_IN transfers and bytes per strategy */
+    atomic64_t xfer_count[AI_XFER_KINDS];
+    atomic64_t xfer_bytes[AI_XFER_KINDS];
+    
+    /* User memory pin cache statistics, all contexts */
+    atomic64_t pin_hits;
+    atomic64_t pin_misses;
+    atomic64_t pin_invalidations;
+    
+    /* Flight recorder: last AI_FLIGHT_RECORDS finished jobs, under sched_lock */
+    struct ai_job_record *flight;
+    unsigned int flight_head;
+    u64 flight_count;
+    struct dentry *debugfs;
+    
     /* Device capabilities */
     struct ai_device_caps caps;
     
     /* Statistics */
     atomic64_t total_inferences;
     atomic64_t total_bytes_processed;
+    
+    /* Mapped read-only by userspace; see ai_status_*() */
+    struct ai_device_status *status;
+};
+
+/* Device memory charged to a context or a user */
+struct ai_mem_account {
+    struct kref ref;            /* Owner + charged buffers and models */
+    kuid_t uid;
+    u64 used;
+    u64 peak;
+    struct list_head link;      /* dev->mem_users, per-uid accounts only */
+};
+
+/* Where an allocation is charged */
+struct ai_mem_charge {
+    struct ai_mem_account *ctx;
+    struct ai_mem_account *user;
+    u64 size;
+};
+
+enum ai_mem_type {
+    AI_MEM_BUFFER,
+    AI_MEM_MODEL,
+};
+
+/* Device memory object that can be evicted to host memory */
+struct ai_mem_obj {
+    struct kref ref;            /* Handle + in-flight jobs */
+    enum ai_mem_type type;
+    u64 size;
+    bool resident;
+    atomic_t pins;              /* Queued or running jobs using it */
+    struct list_head lru;       /* dev->mem_lru while resident */
+    void *host_copy;            /* Buffer contents while evicted */
 };
 
 /* Buffer tracking */
 struct ai_buffer {
-    void *cpu_addr;
+    struct ai_mem_obj obj;
+    void *cpu_addr;             /* NULL while evicted */
     dma_addr_t dma_addr;
     size_t size;
     u32 flags;
+    struct ai_mem_charge charge;
+    
+    /* Imported dma-buf; such buffers are never evicted or charged */
+    struct dma_buf *import;
+    struct dma_buf_attachment *attach;
+    struct sg_table *sgt;
+    struct iosys_map map;
+    
+    /* Registered host memory; likewise never evicted or charged */
+    struct ai_pin *user;
+    
+    /* Reservation: pending accesses of queued jobs, under sched_lock */
+    struct ai_buf_access *writer;   /* Last writer, until it signals */
+    struct list_head readers;       /* Readers since that writer */
 };
 
 /* Model tracking */
 struct ai_model {
-    void *data;
+    struct ai_mem_obj obj;
+    void *data;                 /* Host image; the device copy is modelled */
     size_t size;
     u32 flags;
+    struct ai_mem_charge charge;
 };
 
-/* Inference context */
-struct ai_inference_ctx {
+/* Flight recorder entry */
+struct ai_job_record {
     u64 fence;
+    pid_t pid;
+    u32 engine_id;
+    u32 priority;
+    s32 status;
+    u32 preemptions;
+    u64 submit_ns;
+    u64 start_ns;
+    u64 end_ns;
+    u64 duration_ns;            /* Modelled execution time */
+};
+
+/* Per-open-file context */
+struct ai_context {
+    struct ai_device *dev;
+    pid_t pid;                  /* Opening process */
+    struct ai_mem_account *mem;         /* This context's usage */
+    struct ai_mem_account *user_mem;    /* Usage of the opening uid */
+    struct mutex lock;
+    struct list_head jobs;      /* Submitted, not yet retired */
+    unsigned int num_jobs;
+    
+    /* Pinned user ranges, most recently used first */
+    struct mutex pin_lock;
+    struct list_head pins;
+    unsigned int num_pins;
+    
+    /* Completion coalescing, under dev->sched_lock */
+    u32 coalesce_jobs;          /* Wake after this many jobs, <= 1 = off */
+    u32 coalesce_us;            /* ... or this long after the first */
+    struct list_head coalesced; /* Signaled jobs whose wakeup is held back */
+    unsigned int num_coalesced;
+    struct hrtimer coalesce_timer;
+    u64 coalesce_batches;       /* Bulk wakeups */
+    u64 coalesce_held;          /* Jobs whose wakeup was held back */
+    
+    /* Idle COPY_IN staging buffers, smallest first */
+    struct mutex staging_lock;
+    struct list_head staging;
+    unsigned int num_staging;
+    u64 staging_bytes;
+    
+    /* AI_WAIT_BUSY_POLL statistics */
+    atomic64_t busy_poll_ns;    /* Time spent spinning */
+    atomic64_t busy_poll_hits;  /* Waits that completed while spinning */
+    atomic64_t busy_poll_misses;
+    
+    /* Mapped read-only by userspace, written under sched_lock */
+    struct ai_context_status *status;
+    
+    /* Submission queues by id, under lock */
+    struct idr queues;
+};
+
+/* Submission queue: its jobs run in order, each behind the previous one */
+struct ai_queue {
+    struct kref ref;            /* ctx->queues + submissions in progress */
+    struct mutex lock;          /* Held across submission: fence order is queue order */
+    u32 priority;
+    u32 engine_mask;            /* 0 = any engine */
+    struct ai_job *last;        /* Last job submitted, referenced; under sched_lock */
+};
+
+/* Pinned, DMA mapped and vmapped user memory range */
+struct ai_pin {
+    struct kref ref;            /* Context cache + buffers and ops using it */
+    struct mmu_interval_notifier notifier;
+    unsigned long seq;          /* Notifier sequence when pinned */
+    u64 start;
+    u64 size;
+    struct ai_dma_buffer *dma;
+    void *vaddr;                /* Kernel mapping of start */
+    struct list_head link;      /* ctx->pins while cached */
+};
+
+/* Host copy of COPY_IN data, recycled through its context's pool */
+struct ai_staging {
+    struct list_head link;      /* ctx->staging while idle */
+    size_t size;
+    bool pooled;                /* Returns to the pool after use */
+    u8 data[];
+};
+
+/* Scheduling ranks, lowest first; queues are indexed by rank */
+enum ai_rank {
+    AI_RANK_LOW,
+    AI_RANK_NORMAL,
+    AI_RANK_HIGH,
+    AI_RANK_COUNT
+};
+
+/* Pipeline stages of an engine */
+enum ai_stage {
+    AI_STAGE_COPY_IN,
+    AI_STAGE_COMPUTE,
+    AI_STAGE_COPY_OUT,
+    AI_STAGE_COUNT
+};
+
+/* Input or output DMA of an engine, one job at a time; also an hrtimer */
+struct ai_copy_stage {
+    struct ai_engine *eng;
+    enum ai_stage stage;
+    struct ai_job *job;         /* Transfer in progress */
+    ktime_t start;
+    struct hrtimer timer;
+};
+
+/*
+ * Compute engine; in simulate mode its execution is an hrtimer. Jobs pass
+ * through input DMA, compute and output DMA, and with copy_overlap the
+ * three stages work on different jobs at the same time.
+ */
+struct ai_engine {
+    struct ai_device *adev;
+    u32 id;
+    struct list_head queue[AI_RANK_COUNT];  /* Jobs waiting for input DMA */
+    unsigned int queued;
+    struct list_head ready[AI_RANK_COUNT];  /* Inputs loaded, or preempted */
+    unsigned int num_ready;
+    struct list_head drain;     /* Computed, waiting for output DMA */
+    unsigned int num_drain;
+    struct ai_job *active;      /* Job currently computing */
+    ktime_t slice_start;        /* When the active job was (re)started */
+    struct hrtimer timer;
+    struct ai_copy_stage copy_in;
+    struct ai_copy_stage copy_out;
+    struct hrtimer batch_timer; /* End of the first queued job's batch window */
+    u64 busy_ns[AI_STAGE_COUNT];        /* Stage occupancy, under sched_lock */
+};
+
+/* Link from a job to one of the fences it waits on */
+struct ai_job_dep {
+    struct list_head link;      /* on the signaling job's dependents */
+    struct ai_job *waiter;
+    bool order_only;            /* Queue or buffer order: the outcome does not matter */
+};
+
+/* A job's use of one buffer, for implicit synchronization */
+struct ai_buf_access {
+    struct ai_buffer *buf;
+    struct ai_job *job;
+    bool write;
+    struct ai_job_dep dep;          /* On the buffer's previous writer */
+    struct list_head link;          /* Reader: buf->readers or writer->readers */
+    struct ai_buf_access *writer;   /* Reader: the next writer, waiting for it */
+    struct list_head readers;       /* Writer: earlier readers still pending, */
+    unsigned int readers_left;      /* and their number */
+};
+
+/* Parsed command buffer operation */
+struct ai_cmd_op {
+    u32 op;
+    struct ai_buffer *buf;      /* Device buffer, if any; in job->objs */
+    u64 offset;
+    u64 size;
+    u64 value;                  /* FILL pattern, SIGNAL value */
+    struct ai_staging *staging; /* COPY_IN: host data captured at submit, */
+    const void *inline_data;    /* or in job->cmds or job->pack_area, */
+    struct ai_pin *src;         /* or pinned host source */
+    struct ai_pin *dest;        /* COPY_OUT: pinned host destination */
+    struct file *timeline;      /* TIMELINE_*: the timeline's file, referenced */
+    struct ai_job_dep tl_wait;  /* TIMELINE_WAIT: on its waits until met */
+};
+
+/*
+ * Timeline semaphore: a 64-bit value that only moves forward, signaled by
+ * jobs or the CPU and waited on at a value. It lives as long as its file,
+ * which jobs using it keep referenced.
+ */
+struct ai_timeline {
+    struct ai_device *dev;
+    u64 value;                  /* Under dev->sched_lock */
+    struct list_head waits;     /* ai_cmd_op.tl_wait of queued jobs */
+    wait_queue_head_t wq;       /* AI_IOC_TIMELINE_WAIT */
+};
+
+/* Scheduled inference job */
+struct ai_job {
+    struct kref ref;
+    struct ai_device *adev;
+    struct ai_context *ctx;
+    struct list_head ctx_link;  /* ctx->jobs */
+    struct list_head link;      /* engine->queue */
+    u64 fence;
+    u32 flags;
+    u32 priority;
+    enum ai_rank rank;
+    u32 engine_mask;            /* Engines the job may run on, 0 = any */
+    u64 duration_ns;            /* Simulated execution time, all stages */
+    u64 copy_in_ns;             /* Simulated input DMA time */
+    u64 copy_out_ns;            /* Simulated output DMA time */
+    u64 remaining_ns;           /* Simulated compute time still to run */
+    u64 run_ns;                 /* Time spent on an engine so far */
+    u64 timeout_ns;             /* Watchdog limit on run_ns, 0 = none */
+    bool hung;                  /* Simulated hang: never completes */
+    u64 bytes;                  /* Input + output bytes */
+    
+    /*
+     * Dynamic batching, inference requests only. A queued leader collects
+     * followers on its batch list; they share its dispatch and its outcome.
+     */
+    struct ai_model *model;     /* In objs */
+    u32 batch_items;            /* Items of the job and its followers, 0 = unbatchable */
+    ktime_t batch_deadline;     /* Leader: end of its batch window */
+    struct list_head batch;     /* Leader: followers, by their link */
+    
+    /* Buffers and models the job uses, referenced; pinned while queued */
+    struct ai_mem_obj **objs;
+    u32 num_objs;
+    bool objs_pinned;
+    struct ai_buf_access *access;   /* One per buffer, at most num_objs */
+    u32 num_access;
+    
+    /* In-fences; the job is held back until deps_pending drops to 0 */
+    struct ai_job_dep *deps;
+    unsigned int num_deps;
+    struct ai_job_dep queue_dep;    /* On the previous job of its queue */
+    unsigned int deps_pending;
+    bool dep_failed;
+    struct list_head dependents;
+    
+    /* Command buffer jobs; ops run from exec_wq when the engine finishes */
+    struct ai_cmd_op *ops;
+    u32 num_ops;
+    struct ai_cmd *cmds;        /* Kept while ops point at inline data */
+    
+    /* COPY_IN thresholds sampled at submit; small copies share pack_area */
+    u32 xfer_pack_max;
+    u64 xfer_bounce_max;
+    u64 xfer_pin_min;
+    struct ai_staging *pack_area;
+    size_t pack_used;
+    struct work_struct work;
+    
     struct completion done;
     s32 status;
     struct ai_profile_data profile;
@@ -90,10 +617,192 @@ struct ai_inference_ctx {
  * File operations
  */
 
+static void ai_job_retire(struct ai_context *ctx, struct ai_job *job);
+static void ai_pin_cache_flush(struct ai_context *ctx);
+static enum hrtimer_restart ai_coalesce_timer_fn(struct hrtimer *timer);
+static void ai_staging_flush(struct ai_context *ctx);
+static void ai_ctx_flush_completions(struct ai_context *ctx);
+static void ai_ctx_cancel_waits(struct ai_context *ctx);
+static void ai_queue_put(struct ai_queue *queue);
+
+/*
+ * Device memory accounting
+ *
+ * Every buffer and model is charged to the context that created it and to
+ * the uid that opened that context. Accounts are reference counted by the
+ * allocations charged to them, so usage stays attributed after the file is
+ * closed until the memory is actually freed. All counters are under
+ * dev->lock.
+ */
+
+static void ai_mem_account_release(struct kref *ref)
+    __releases(&ai_dev->lock)
+{
+    struct ai_mem_account *acct = container_of(ref, struct ai_mem_account, ref);
+    
+    list_del(&acct->link);
+    mutex_unlock(&ai_dev->lock);
+    kfree(acct);
+}
+
+static void ai_mem_account_put(struct ai_device *dev, struct ai_mem_account *acct)
+{
+    kref_put_mutex(&acct->ref, ai_mem_account_release, &dev->lock);
+}
+
+static struct ai_mem_account *ai_mem_account_alloc(kuid_t uid)
+{
+    struct ai_mem_account *acct;
+    
+    acct = kzalloc(sizeof(*acct), GFP_KERNEL);
+    if (!acct)
+        return NULL;
+    
+    kref_init(&acct->ref);
+    acct->uid = uid;
+    INIT_LIST_HEAD(&acct->link);
+    return acct;
+}
+
+/* Find or create the per-uid account of the current process */
+static struct ai_mem_account *ai_mem_user_get(struct ai_device *dev)
+{
+    kuid_t uid = current_uid();
+    struct ai_mem_account *acct, *new;
+    
+    new = ai_mem_account_alloc(uid);
+    if (!new)
+        return NULL;
+    
+    mutex_lock(&dev->lock);
+    list_for_each_entry(acct, &dev->mem_users, link) {
+        if (uid_eq(acct->uid, uid)) {
+            kref_get(&acct->ref);
+            mutex_unlock(&dev->lock);
+            kfree(new);
+            return acct;
+        }
+    }
+    list_add_tail(&new->link, &dev->mem_users);
+    mutex_unlock(&dev->lock);
+    
+    return new;
+}
+
+static bool ai_mem_over(u64 used, unsigned int limit_mb)
+{
+    return limit_mb && used > ((u64)limit_mb << 20);
+}
+
+/* Device memory that may be allocated, overcommit included */
+static u64 ai_mem_total(struct ai_device *dev)
+{
+    return div_u64(dev->caps.memory_size * max(mem_overcommit_pct, 100U), 100);
+}
+
+/* Caller holds dev->lock */
+static void ai_status_mem(struct ai_device *dev)
+{
+    struct ai_device_status *st = dev->status;
+    u64 total = ai_mem_total(dev);
+    
+    WRITE_ONCE(st->mem_total, total);
+    WRITE_ONCE(st->mem_used, dev->mem_used);
+    WRITE_ONCE(st->mem_free, total - min(dev->mem_used, total));
+}
+
+/* Charge @size bytes to @ctx and its user; caller holds dev->lock */
+static int ai_mem_charge(struct ai_context *ctx, u64 size,
+                         struct ai_mem_charge *charge)
+{
+    struct ai_device *dev = ctx->dev;
+    u64 total = ai_mem_total(dev);
+    u64 reserve;
+    
+    if (dev->mem_used + size > total)
+        return -ENOMEM;
+    
+    if (ai_mem_over(ctx->mem->used + size, ctx_mem_hard_mb) ||
+        ai_mem_over(ctx->user_mem->used + size, uid_mem_hard_mb))
+        return -EDQUOT;
+    
+    if (ai_mem_over(ctx->mem->used + size, ctx_mem_soft_mb) ||
+        ai_mem_over(ctx->user_mem->used + size, uid_mem_soft_mb)) {
+        reserve = div_u64(total * min(mem_soft_reserve_pct, 100U), 100);
+        if (dev->mem_used + size > total - reserve) {
+            dev->mem_throttled++;
+            return -EDQUOT;
+        }
+    }
+    
+    dev->mem_used += size;
+    ai_status_mem(dev);
+    ctx->mem->used += size;
+    ctx->mem->peak = max(ctx->mem->peak, ctx->mem->used);
+    ctx->user_mem->used += size;
+    ctx->user_mem->peak = max(ctx->user_mem->peak, ctx->user_mem->used);
+    
+    kref_get(&ctx->mem->ref);
+    kref_get(&ctx->user_mem->ref);
+    charge->ctx = ctx->mem;
+    charge->user = ctx->user_mem;
+    charge->size = size;
+    return 0;
+}
+
+static void ai_mem_uncharge(struct ai_device *dev, struct ai_mem_charge *charge)
+{
+    if (!charge->ctx)
+        return;
+    
+    mutex_lock(&dev->lock);
+    dev->mem_used -= charge->size;
+    ai_status_mem(dev);
+    charge->ctx->used -= charge->size;
+    charge->user->used -= charge->size;
+    mutex_unlock(&dev->lock);
+    
+    ai_mem_account_put(dev, charge->ctx);
+    ai_mem_account_put(dev, charge->user);
+    charge->ctx = NULL;
+}
+
 static int ai_open(struct inode *inode, struct file *file)
 {
     struct ai_device *dev = container_of(inode->i_cdev, struct ai_device, cdev);
-    file->private_data = dev;
+    struct ai_context *ctx;
+    
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+    
+    ctx->mem = ai_mem_account_alloc(current_uid());
+    ctx->user_mem = ai_mem_user_get(dev);
+    ctx->status = (struct ai_context_status *)get_zeroed_page(GFP_KERNEL);
+    if (!ctx->mem || !ctx->user_mem || !ctx->status) {
+        kfree(ctx->mem);
+        if (ctx->user_mem)
+            ai_mem_account_put(dev, ctx->user_mem);
+        free_page((unsigned long)ctx->status);
+        kfree(ctx);
+        return -ENOMEM;
+    }
+    ctx->status->version = AI_STATUS_VERSION;
+    ctx->status->num_slots = AI_STATUS_FENCE_SLOTS;
+    
+    ctx->dev = dev;
+    ctx->pid = task_tgid_nr(current);
+    mutex_init(&ctx->lock);
+    INIT_LIST_HEAD(&ctx->jobs);
+    mutex_init(&ctx->pin_lock);
+    INIT_LIST_HEAD(&ctx->pins);
+    mutex_init(&ctx->staging_lock);
+    INIT_LIST_HEAD(&ctx->staging);
+    INIT_LIST_HEAD(&ctx->coalesced);
+    idr_init(&ctx->queues);
+    hrtimer_init(&ctx->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    ctx->coalesce_timer.function = ai_coalesce_timer_fn;
+    file->private_data = ctx;
     
     pr_debug("ai_accel: device opened\n");
     return 0;
@@ -101,6 +810,47 @@ static int ai_open(struct inode *inode, struct file *file)
 
 static int ai_release(struct inode *inode, struct file *file)
 {
+    struct ai_context *ctx = file->private_data;
+    struct ai_device *dev = ctx->dev;
+    struct ai_job *job, *tmp;
+    struct ai_queue *queue;
+    unsigned long flags;
+    int id;
+    
+    /* Nobody is left to benefit from batched wakeups */
+    spin_lock_irqsave(&dev->sched_lock, flags);
+    ctx->coalesce_jobs = 0;
+    ai_ctx_flush_completions(ctx);
+    spin_unlock_irqrestore(&dev->sched_lock, flags);
+    ai_ctx_cancel_waits(ctx);
+    
+    /* Outstanding jobs reference the context, let them drain first */
+    mutex_lock(&ctx->lock);
+    list_for_each_entry_safe(job, tmp, &ctx->jobs, ctx_link) {
+        wait_for_completion(&job->done);
+        ai_job_retire(ctx, job);
+    }
+    mutex_unlock(&ctx->lock);
+    hrtimer_cancel(&ctx->coalesce_timer);
+    
+    idr_for_each_entry(&ctx->queues, queue, id)
+        ai_queue_put(queue);
+    idr_destroy(&ctx->queues);
+    
+    /* Buffers registered from cached ranges keep their pins */
+    ai_pin_cache_flush(ctx);
+    ai_staging_flush(ctx);
+    
+    /* Memory still allocated keeps the accounts alive */
+    ai_mem_account_put(ctx->dev, ctx->mem);
+    ai_mem_account_put(ctx->dev, ctx->user_mem);
+    
+    mutex_destroy(&ctx->staging_lock);
+    mutex_destroy(&ctx->pin_lock);
+    mutex_destroy(&ctx->lock);
+    free_page((unsigned long)ctx->status);
+    kfree(ctx);
+    
     pr_debug("ai_accel: device closed\n");
     return 0;
 }
@@ -120,220 +870,3330 @@ static ssize_t ai_write(struct file *file, const char __user *buf,
 }
 
 /*
- * IOCTL handlers
+ * IOCTL handlers
+ */
+
+static int ai_ioctl_get_caps(struct ai_device *dev, void __user *arg)
+{
+    if (copy_to_user(arg, &dev->caps, sizeof(dev->caps)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ * Device memory residency
+ *
+ * Buffers and models are resident objects on dev->mem_lru, least recently
+ * used first. When a new allocation or a restore does not fit, unpinned
+ * objects are evicted from the head of the list: a buffer's contents move to
+ * a host copy and its device memory is freed, a model simply loses its
+ * device copy since the host image is kept anyway. Jobs pin everything they
+ * use at submit, restoring it first if needed, until they signal. All of
+ * this is under dev->lock.
+ */
+
+static void *ai_devmem_alloc(struct ai_device *dev, size_t size,
+                             dma_addr_t *dma_addr)
+{
+    void *cpu_addr;
+    
+    if (simulate) {
+        /* Simulation: allocate regular memory, mappable for dma-buf */
+        cpu_addr = vmalloc_user(size);
+        *dma_addr = (dma_addr_t)(unsigned long)cpu_addr;
+    } else {
+        /* Real: allocate DMA coherent memory */
+        cpu_addr = dma_alloc_coherent(dev->dev, size, dma_addr, GFP_KERNEL);
+    }
+    
+    return cpu_addr;
+}
+
+static void ai_devmem_free(struct ai_device *dev, size_t size, void *cpu_addr,
+                           dma_addr_t dma_addr)
+{
+    if (simulate)
+        vfree(cpu_addr);
+    else
+        dma_free_coherent(dev->dev, size, cpu_addr, dma_addr);
+}
+
+static void ai_mem_obj_init(struct ai_mem_obj *obj, enum ai_mem_type type,
+                            u64 size)
+{
+    kref_init(&obj->ref);
+    obj->type = type;
+    obj->size = size;
+    atomic_set(&obj->pins, 0);
+    INIT_LIST_HEAD(&obj->lru);
+}
+
+/* Caller holds dev->lock */
+static void ai_mem_obj_make_resident(struct ai_device *dev, struct ai_mem_obj *obj)
+{
+    obj->resident = true;
+    dev->mem_resident += obj->size;
+    list_add_tail(&obj->lru, &dev->mem_lru);
+}
+
+/* Caller holds dev->lock */
+static void ai_mem_obj_drop_resident(struct ai_device *dev, struct ai_mem_obj *obj)
+{
+    if (!obj->resident)
+        return;
+    obj->resident = false;
+    dev->mem_resident -= obj->size;
+    list_del_init(&obj->lru);
+}
+
+/* Caller holds dev->lock */
+static int ai_mem_obj_evict(struct ai_device *dev, struct ai_mem_obj *obj)
+{
+    if (obj->type == AI_MEM_BUFFER) {
+        struct ai_buffer *buf = container_of(obj, struct ai_buffer, obj);
+        
+        obj->host_copy = kvmalloc(obj->size, GFP_KERNEL);
+        if (!obj->host_copy)
+            return -ENOMEM;
+        memcpy(obj->host_copy, buf->cpu_addr, obj->size);
+        ai_devmem_free(dev, buf->size, buf->cpu_addr, buf->dma_addr);
+        buf->cpu_addr = NULL;
+    }
+    
+    ai_mem_obj_drop_resident(dev, obj);
+    dev->mem_evictions++;
+    dev->mem_bytes_evicted += obj->size;
+    return 0;
+}
+
+/*
+ * Caller holds dev->lock. Evict idle objects until @size more bytes fit in
+ * device memory; bytes moved are added to @moved.
+ */
+static int ai_mem_make_room(struct ai_device *dev, u64 size, u64 *moved)
+{
+    struct ai_mem_obj *obj, *tmp;
+    
+    if (size > dev->caps.memory_size)
+        return -ENOMEM;
+    
+    list_for_each_entry_safe(obj, tmp, &dev->mem_lru, lru) {
+        if (dev->mem_resident + size <= dev->caps.memory_size)
+            break;
+        if (atomic_read(&obj->pins))
+            continue;
+        if (!ai_mem_obj_evict(dev, obj))
+            *moved += obj->size;
+    }
+    
+    return dev->mem_resident + size <= dev->caps.memory_size ? 0 : -ENOMEM;
+}
+
+/* Caller holds dev->lock */
+static int ai_mem_obj_restore(struct ai_device *dev, struct ai_mem_obj *obj,
+                              u64 *moved)
+{
+    int ret;
+    
+    ret = ai_mem_make_room(dev, obj->size, moved);
+    if (ret)
+        return ret;
+    
+    if (obj->type == AI_MEM_BUFFER) {
+        struct ai_buffer *buf = container_of(obj, struct ai_buffer, obj);
+        
+        buf->cpu_addr = ai_devmem_alloc(dev, buf->size, &buf->dma_addr);
+        if (!buf->cpu_addr)
+            return -ENOMEM;
+        memcpy(buf->cpu_addr, obj->host_copy, obj->size);
+        kvfree(obj->host_copy);
+        obj->host_copy = NULL;
+    }
+    
+    ai_mem_obj_make_resident(dev, obj);
+    dev->mem_restores++;
+    dev->mem_bytes_restored += obj->size;
+    *moved += obj->size;
+    return 0;
+}
+
+/* Caller holds dev->lock; make @obj resident and keep it there until unpinned */
+static int ai_mem_obj_pin(struct ai_device *dev, struct ai_mem_obj *obj,
+                          u64 *moved)
+{
+    int ret;
+    
+    if (obj->resident) {
+        /* Imported buffers are resident but not on the LRU */
+        if (!list_empty(&obj->lru))
+            list_move_tail(&obj->lru, &dev->mem_lru);
+    } else {
+        ret = ai_mem_obj_restore(dev, obj, moved);
+        if (ret)
+            return ret;
+    }
+    
+    atomic_inc(&obj->pins);
+    return 0;
+}
+
+static void ai_buffer_unimport(struct ai_buffer *buf);
+static void ai_buffer_unregister(struct ai_buffer *buf);
+
+static void ai_buffer_destroy(struct ai_buffer *buf)
+{
+    if (buf->import || buf->user) {
+        if (buf->import)
+            ai_buffer_unimport(buf);
+        else
+            ai_buffer_unregister(buf);
+        kfree(buf);
+        return;
+    }
+    
+    mutex_lock(&ai_dev->lock);
+    ai_mem_obj_drop_resident(ai_dev, &buf->obj);
+    mutex_unlock(&ai_dev->lock);
+    
+    if (buf->cpu_addr)
+        ai_devmem_free(ai_dev, buf->size, buf->cpu_addr, buf->dma_addr);
+    kvfree(buf->obj.host_copy);
+    ai_mem_uncharge(ai_dev, &buf->charge);
+    kfree(buf);
+}
+
+static void ai_model_destroy(struct ai_model *model)
+{
+    mutex_lock(&ai_dev->lock);
+    ai_mem_obj_drop_resident(ai_dev, &model->obj);
+    mutex_unlock(&ai_dev->lock);
+    
+    vfree(model->data);
+    ai_mem_uncharge(ai_dev, &model->charge);
+    kfree(model);
+}
+
+static void ai_mem_obj_release(struct kref *ref)
+{
+    struct ai_mem_obj *obj = container_of(ref, struct ai_mem_obj, ref);
+    
+    if (obj->type == AI_MEM_BUFFER)
+        ai_buffer_destroy(container_of(obj, struct ai_buffer, obj));
+    else
+        ai_model_destroy(container_of(obj, struct ai_model, obj));
+}
+
+static void ai_mem_obj_put(struct ai_mem_obj *obj)
+{
+    kref_put(&obj->ref, ai_mem_obj_release);
+}
+
+static void ai_buffer_put(struct ai_buffer *buf)
+{
+    ai_mem_obj_put(&buf->obj);
+}
+
+static void ai_model_put(struct ai_model *model)
+{
+    ai_mem_obj_put(&model->obj);
+}
+
+static int ai_ioctl_alloc(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_alloc_request req;
+    struct ai_buffer *buf;
+    u64 moved = 0;
+    int handle;
+    int ret;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.size == 0 || req.size > dev->caps.max_alloc_size)
+        return -EINVAL;
+    
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    
+    ai_mem_obj_init(&buf->obj, AI_MEM_BUFFER, req.size);
+    INIT_LIST_HEAD(&buf->readers);
+    buf->size = req.size;
+    buf->flags = req.flags;
+    
+    mutex_lock(&dev->lock);
+    ret = ai_mem_charge(ctx, req.size, &buf->charge);
+    if (!ret)
+        ret = ai_mem_make_room(dev, req.size, &moved);
+    if (!ret) {
+        buf->cpu_addr = ai_devmem_alloc(dev, req.size, &buf->dma_addr);
+        if (buf->cpu_addr)
+            ai_mem_obj_make_resident(dev, &buf->obj);
+        else
+            ret = -ENOMEM;
+    }
+    mutex_unlock(&dev->lock);
+    
+    if (ret) {
+        ai_buffer_put(buf);
+        return ret;
+    }
+    
+    mutex_lock(&dev->lock);
+    handle = idr_alloc(&dev->buffer_idr, buf, 1, 0, GFP_KERNEL);
+    mutex_unlock(&dev->lock);
+    
+    if (handle < 0) {
+        ai_buffer_put(buf);
+        return handle;
+    }
+    
+    req.handle = handle;
+    req.dma_addr = buf->dma_addr;
+    
+    if (copy_to_user(arg, &req, sizeof(req))) {
+        mutex_lock(&dev->lock);
+        idr_remove(&dev->buffer_idr, handle);
+        mutex_unlock(&dev->lock);
+        ai_buffer_put(buf);
+        return -EFAULT;
+    }
+    
+    pr_debug("ai_accel: allocated buffer handle=%d size=%llu evicted=%llu\n",
+             handle, req.size, moved);
+    return 0;
+}
+
+static int ai_ioctl_free(struct ai_device *dev, void __user *arg)
+{
+    struct ai_free_request req;
+    struct ai_buffer *buf;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    mutex_lock(&dev->lock);
+    buf = idr_find(&dev->buffer_idr, req.handle);
+    if (buf) {
+        idr_remove(&dev->buffer_idr, req.handle);
+    }
+    mutex_unlock(&dev->lock);
+    
+    if (!buf)
+        return -EINVAL;
+    
+    /* Jobs still using the buffer hold their own reference */
+    ai_buffer_put(buf);
+    
+    pr_debug("ai_accel: freed buffer handle=%llu\n", req.handle);
+    return 0;
+}
+
+static int ai_ioctl_load_model(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_load_model_request req;
+    struct ai_model *model;
+    u64 moved = 0;
+    int handle;
+    int ret;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.model_size == 0 || req.model_size > dev->caps.max_alloc_size)
+        return -EINVAL;
+    
+    model = kzalloc(sizeof(*model), GFP_KERNEL);
+    if (!model)
+        return -ENOMEM;
+    
+    ai_mem_obj_init(&model->obj, AI_MEM_MODEL, req.model_size);
+    model->size = req.model_size;
+    model->flags = req.flags;
+    
+    mutex_lock(&dev->lock);
+    ret = ai_mem_charge(ctx, req.model_size, &model->charge);
+    mutex_unlock(&dev->lock);
+    if (ret) {
+        kfree(model);
+        return ret;
+    }
+    
+    model->data = vmalloc(req.model_size);
+    
+    if (!model->data) {
+        ai_model_put(model);
+        return -ENOMEM;
+    }
+    
+    if (copy_from_user(model->data, (void __user *)req.model_data, req.model_size)) {
+        ai_model_put(model);
+        return -EFAULT;
+    }
+    
+    /* Upload to the device, making room if needed */
+    mutex_lock(&dev->lock);
+    ret = ai_mem_make_room(dev, req.model_size, &moved);
+    if (!ret)
+        ai_mem_obj_make_resident(dev, &model->obj);
+    mutex_unlock(&dev->lock);
+    
+    if (ret) {
+        ai_model_put(model);
+        return ret;
+    }
+    
+    mutex_lock(&dev->lock);
+    handle = idr_alloc(&dev->model_idr, model, 1, 0, GFP_KERNEL);
+    mutex_unlock(&dev->lock);
+    
+    if (handle < 0) {
+        ai_model_put(model);
+        return handle;
+    }
+    
+    req.model_handle = handle;
+    
+    if (copy_to_user(arg, &req, sizeof(req))) {
+        mutex_lock(&dev->lock);
+        idr_remove(&dev->model_idr, handle);
+        mutex_unlock(&dev->lock);
+        ai_model_put(model);
+        return -EFAULT;
+    }
+    
+    pr_debug("ai_accel: loaded model handle=%d size=%llu evicted=%llu\n",
+             handle, req.model_size, moved);
+    return 0;
+}
+
+static int ai_ioctl_unload_model(struct ai_device *dev, void __user *arg)
+{
+    struct ai_unload_model_request req;
+    struct ai_model *model;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    mutex_lock(&dev->lock);
+    model = idr_remove(&dev->model_idr, req.model_handle);
+    mutex_unlock(&dev->lock);
+    
+    if (!model)
+        return -EINVAL;
+    
+    /* Jobs still using the model hold their own reference */
+    ai_model_put(model);
+    
+    pr_debug("ai_accel: unloaded model handle=%llu\n", req.model_handle);
+    return 0;
+}
+
+/*
+ * dma-buf sharing
+ *
+ * Exported buffers stay pinned in device memory for as long as the dma-buf
+ * exists; the dma-buf holds a reference on the buffer, so freeing the handle
+ * does not pull the memory from under other importers. Importing one of our
+ * own dma-bufs yields another handle to the same buffer. Foreign dma-bufs
+ * are mapped for the device and vmapped for the CPU paths (command buffer
+ * ops, simulation).
+ */
+
+/* Describe a device buffer's pages for dma-buf importers */
+static int ai_buffer_sgtable(struct ai_buffer *buf, struct sg_table *sgt)
+{
+    unsigned int nr = PAGE_ALIGN(buf->size) >> PAGE_SHIFT;
+    struct page **pages;
+    unsigned int i;
+    int ret;
+    
+    if (!simulate)
+        return dma_get_sgtable(ai_dev->dev, sgt, buf->cpu_addr,
+                               buf->dma_addr, buf->size);
+    
+    pages = kvmalloc_array(nr, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+    for (i = 0; i < nr; i++)
+        pages[i] = vmalloc_to_page(buf->cpu_addr + ((size_t)i << PAGE_SHIFT));
+    
+    ret = sg_alloc_table_from_pages(sgt, pages, nr, 0,
+                                    (unsigned long)nr << PAGE_SHIFT, GFP_KERNEL);
+    kvfree(pages);
+    return ret;
+}
+
+static struct sg_table *ai_dmabuf_map(struct dma_buf_attachment *attach,
+                                      enum dma_data_direction dir)
+{
+    struct ai_buffer *buf = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    int ret;
+    
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    
+    ret = ai_buffer_sgtable(buf, sgt);
+    if (ret) {
+        kfree(sgt);
+        return ERR_PTR(ret);
+    }
+    
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (ret) {
+        sg_free_table(sgt);
+        kfree(sgt);
+        return ERR_PTR(ret);
+    }
+    
+    return sgt;
+}
+
+static void ai_dmabuf_unmap(struct dma_buf_attachment *attach,
+                            struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void ai_dmabuf_release(struct dma_buf *dmabuf)
+{
+    struct ai_buffer *buf = dmabuf->priv;
+    
+    atomic_dec(&buf->obj.pins);
+    ai_buffer_put(buf);
+}
+
+static int ai_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct ai_buffer *buf = dmabuf->priv;
+    
+    if (simulate)
+        return remap_vmalloc_range(vma, buf->cpu_addr, vma->vm_pgoff);
+    return dma_mmap_coherent(ai_dev->dev, vma, buf->cpu_addr, buf->dma_addr,
+                             buf->size);
+}
+
+static int ai_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+    struct ai_buffer *buf = dmabuf->priv;
+    
+    iosys_map_set_vaddr(map, buf->cpu_addr);
+    return 0;
+}
+
+static const struct dma_buf_ops ai_dmabuf_ops = {
+    .map_dma_buf    = ai_dmabuf_map,
+    .unmap_dma_buf  = ai_dmabuf_unmap,
+    .release        = ai_dmabuf_release,
+    .mmap           = ai_dmabuf_mmap,
+    .vmap           = ai_dmabuf_vmap,
+};
+
+static int ai_ioctl_export(struct ai_device *dev, void __user *arg)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct ai_export_request req;
+    struct dma_buf *dmabuf;
+    struct ai_buffer *buf;
+    u64 moved = 0;
+    int ret;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.flags & ~AI_EXPORT_CLOEXEC)
+        return -EINVAL;
+    
+    /* Bring the buffer back if it was evicted and keep it resident */
+    mutex_lock(&dev->lock);
+    buf = idr_find(&dev->buffer_idr, req.handle);
+    if (!buf || buf->import || buf->user)
+        ret = -EINVAL;
+    else
+        ret = ai_mem_obj_pin(dev, &buf->obj, &moved);
+    if (!ret)
+        kref_get(&buf->obj.ref);
+    mutex_unlock(&dev->lock);
+    
+    if (ret)
+        return ret;
+    
+    exp_info.ops = &ai_dmabuf_ops;
+    exp_info.size = PAGE_ALIGN(buf->size);
+    exp_info.flags = O_RDWR;
+    exp_info.priv = buf;
+    
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        atomic_dec(&buf->obj.pins);
+        ai_buffer_put(buf);
+        return PTR_ERR(dmabuf);
+    }
+    
+    /* From here on the dma-buf owns the pin and the reference */
+    ret = dma_buf_fd(dmabuf, (req.flags & AI_EXPORT_CLOEXEC) ? O_CLOEXEC : 0);
+    if (ret < 0) {
+        dma_buf_put(dmabuf);
+        return ret;
+    }
+    
+    req.fd = ret;
+    if (copy_to_user(arg, &req, sizeof(req)))
+        return -EFAULT;
+    
+    pr_debug("ai_accel: exported buffer handle=%llu fd=%d\n", req.handle, req.fd);
+    return 0;
+}
+
+static struct ai_buffer *ai_buffer_import(struct ai_device *dev,
+                                          struct dma_buf *dmabuf)
+{
+    struct ai_buffer *buf;
+    int ret;
+    
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return ERR_PTR(-ENOMEM);
+    
+    ai_mem_obj_init(&buf->obj, AI_MEM_BUFFER, dmabuf->size);
+    INIT_LIST_HEAD(&buf->readers);
+    buf->obj.resident = true;
+    buf->size = dmabuf->size;
+    
+    /* The simulated device has no DMA of its own, only map for real hardware */
+    if (!simulate) {
+        buf->attach = dma_buf_attach(dmabuf, dev->dev);
+        if (IS_ERR(buf->attach)) {
+            ret = PTR_ERR(buf->attach);
+            goto err_free;
+        }
+        
+        buf->sgt = dma_buf_map_attachment_unlocked(buf->attach,
+                                                   DMA_BIDIRECTIONAL);
+        if (IS_ERR(buf->sgt)) {
+            ret = PTR_ERR(buf->sgt);
+            goto err_detach;
+        }
+        /* The engine walks sgt; dma_addr is only the first segment */
+        buf->dma_addr = sg_dma_address(buf->sgt->sgl);
+    }
+    
+    ret = dma_buf_vmap_unlocked(dmabuf, &buf->map);
+    if (ret)
+        goto err_unmap;
+    if (buf->map.is_iomem) {
+        ret = -EOPNOTSUPP;
+        goto err_vunmap;
+    }
+    
+    buf->cpu_addr = buf->map.vaddr;
+    if (simulate)
+        buf->dma_addr = (dma_addr_t)(unsigned long)buf->cpu_addr;
+    buf->import = dmabuf;
+    return buf;
+
+err_vunmap:
+    dma_buf_vunmap_unlocked(dmabuf, &buf->map);
+err_unmap:
+    if (buf->sgt)
+        dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt,
+                                          DMA_BIDIRECTIONAL);
+err_detach:
+    if (buf->attach)
+        dma_buf_detach(dmabuf, buf->attach);
+err_free:
+    kfree(buf);
+    return ERR_PTR(ret);
+}
+
+static void ai_buffer_unimport(struct ai_buffer *buf)
+{
+    dma_buf_vunmap_unlocked(buf->import, &buf->map);
+    if (buf->attach) {
+        dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt,
+                                          DMA_BIDIRECTIONAL);
+        dma_buf_detach(buf->import, buf->attach);
+    }
+    dma_buf_put(buf->import);
+}
+
+static int ai_ioctl_import(struct ai_device *dev, void __user *arg)
+{
+    struct ai_import_request req;
+    struct dma_buf *dmabuf;
+    struct ai_buffer *buf;
+    int handle;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.flags)
+        return -EINVAL;
+    
+    dmabuf = dma_buf_get(req.fd);
+    if (IS_ERR(dmabuf))
+        return PTR_ERR(dmabuf);
+    
+    if (dmabuf->ops == &ai_dmabuf_ops) {
+        /* One of ours: share the buffer itself */
+        buf = dmabuf->priv;
+        kref_get(&buf->obj.ref);
+        dma_buf_put(dmabuf);
+    } else {
+        /* On success the buffer keeps the dma-buf reference */
+        buf = ai_buffer_import(dev, dmabuf);
+        if (IS_ERR(buf)) {
+            dma_buf_put(dmabuf);
+            return PTR_ERR(buf);
+        }
+    }
+    
+    mutex_lock(&dev->lock);
+    handle = idr_alloc(&dev->buffer_idr, buf, 1, 0, GFP_KERNEL);
+    mutex_unlock(&dev->lock);
+    
+    if (handle < 0) {
+        ai_buffer_put(buf);
+        return handle;
+    }
+    
+    req.handle = handle;
+    req.size = buf->size;
+    
+    if (copy_to_user(arg, &req, sizeof(req))) {
+        mutex_lock(&dev->lock);
+        idr_remove(&dev->buffer_idr, handle);
+        mutex_unlock(&dev->lock);
+        ai_buffer_put(buf);
+        return -EFAULT;
+    }
+    
+    pr_debug("ai_accel: imported dma-buf fd=%d handle=%d size=%llu\n",
+             req.fd, handle, req.size);
+    return 0;
+}
+
+/*
+ * User memory pin cache
+ *
+ * Pinning and DMA mapping user memory costs more than moving mid-sized
+ * tensors, and applications keep handing in the same staging ranges. Each
+ * context therefore caches its pinned ranges, keyed by start and size. An
+ * interval notifier on every range tells when the process unmaps or remaps
+ * it; the stale entry is dropped at its next lookup and the range pinned
+ * afresh. Users of a dropped entry keep their pages until they let go.
+ */
+
+static bool ai_pin_invalidate(struct mmu_interval_notifier *mni,
+                              const struct mmu_notifier_range *range,
+                              unsigned long cur_seq)
+{
+    mmu_interval_set_seq(mni, cur_seq);
+    atomic64_inc(&ai_dev->pin_invalidations);
+    return true;
+}
+
+static const struct mmu_interval_notifier_ops ai_pin_notifier_ops = {
+    .invalidate = ai_pin_invalidate,
+};
+
+static void ai_pin_release(struct kref *ref)
+{
+    struct ai_pin *pin = container_of(ref, struct ai_pin, ref);
+    
+    mmu_interval_notifier_remove(&pin->notifier);
+    vunmap(pin->vaddr - offset_in_page(pin->start));
+    ai_dma_unmap_user_buffer(ai_dev->dev, pin->dma);
+    kfree(pin);
+}
+
+static void ai_pin_put(struct ai_pin *pin)
+{
+    kref_put(&pin->ref, ai_pin_release);
+}
+
+static bool ai_pin_stale(struct ai_pin *pin)
+{
+    return pin->notifier.mm != current->mm ||
+           mmu_interval_check_retry(&pin->notifier, pin->seq);
+}
+
+static struct ai_pin *ai_pin_create(struct ai_device *dev, u64 start, u64 size,
+                                    enum dma_data_direction dir, bool longterm)
+{
+    struct ai_pin *pin;
+    int ret;
+    
+    pin = kzalloc(sizeof(*pin), GFP_KERNEL);
+    if (!pin)
+        return ERR_PTR(-ENOMEM);
+    
+    kref_init(&pin->ref);
+    INIT_LIST_HEAD(&pin->link);
+    pin->start = start;
+    pin->size = size;
+    
+    /* Watch before pinning so no change to the range goes unnoticed */
+    ret = mmu_interval_notifier_insert(&pin->notifier, current->mm,
+                                       start & PAGE_MASK,
+                                       PAGE_ALIGN(offset_in_page(start) + size),
+                                       &ai_pin_notifier_ops);
+    if (ret)
+        goto err_free;
+    pin->seq = mmu_interval_read_begin(&pin->notifier);
+    
+    pin->dma = ai_dma_map_user_buffer(dev->dev, u64_to_user_ptr(start), size,
+                                      dir, longterm);
+    if (IS_ERR(pin->dma)) {
+        ret = PTR_ERR(pin->dma);
+        goto err_remove;
+    }
+    
+    pin->vaddr = vmap(pin->dma->pages, pin->dma->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!pin->vaddr) {
+        ret = -ENOMEM;
+        goto err_unmap;
+    }
+    pin->vaddr += offset_in_page(start);
+    
+    return pin;
+
+err_unmap:
+    ai_dma_unmap_user_buffer(dev->dev, pin->dma);
+err_remove:
+    mmu_interval_notifier_remove(&pin->notifier);
+err_free:
+    kfree(pin);
+    return ERR_PTR(ret);
+}
+
+/* Caller holds ctx->pin_lock */
+static void ai_pin_evict(struct ai_context *ctx, struct ai_pin *pin)
+{
+    list_del_init(&pin->link);
+    ctx->num_pins--;
+    ai_pin_put(pin);
+}
+
+/*
+ * Get the current process's range [start, start + size) pinned, DMA mapped
+ * and vmapped, from the context's cache if possible. DMA_BIDIRECTIONAL
+ * entries serve read-only users too.
+ */
+static struct ai_pin *ai_pin_get(struct ai_context *ctx, u64 start, u64 size,
+                                 enum dma_data_direction dir)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_pin *pin, *tmp;
+    
+    mutex_lock(&ctx->pin_lock);
+    list_for_each_entry_safe(pin, tmp, &ctx->pins, link) {
+        if (pin->start != start || pin->size != size)
+            continue;
+        if (ai_pin_stale(pin)) {
+            ai_pin_evict(ctx, pin);
+            continue;
+        }
+        if (pin->dma->dir != dir && pin->dma->dir != DMA_BIDIRECTIONAL)
+            continue;
+        
+        list_move(&pin->link, &ctx->pins);
+        kref_get(&pin->ref);
+        mutex_unlock(&ctx->pin_lock);
+        atomic64_inc(&dev->pin_hits);
+        return pin;
+    }
+    mutex_unlock(&ctx->pin_lock);
+    
+    atomic64_inc(&dev->pin_misses);
+    pin = ai_pin_create(dev, start, size, dir, true);
+    if (IS_ERR(pin))
+        return pin;
+    
+    /* The cache keeps its own reference; drop the coldest beyond the limit */
+    mutex_lock(&ctx->pin_lock);
+    kref_get(&pin->ref);
+    list_add(&pin->link, &ctx->pins);
+    ctx->num_pins++;
+    while (ctx->num_pins > AI_PIN_CACHE_ENTRIES)
+        ai_pin_evict(ctx, list_last_entry(&ctx->pins, struct ai_pin, link));
+    mutex_unlock(&ctx->pin_lock);
+    
+    return pin;
+}
+
+static void ai_pin_cache_flush(struct ai_context *ctx)
+{
+    struct ai_pin *pin, *tmp;
+    
+    mutex_lock(&ctx->pin_lock);
+    list_for_each_entry_safe(pin, tmp, &ctx->pins, link)
+        ai_pin_evict(ctx, pin);
+    mutex_unlock(&ctx->pin_lock);
+}
+
+/*
+ * Registered host memory
+ *
+ * A user virtual range can be registered as a buffer handle so that inputs
+ * and outputs living in application memory need no copy into a separately
+ * allocated buffer. The range comes from the pin cache and stays pinned and
+ * DMA mapped for the life of the handle.
+ */
+
+static int ai_ioctl_register_userptr(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_userptr_request req;
+    enum dma_data_direction dir;
+    struct ai_buffer *buf;
+    struct ai_pin *pin;
+    int handle;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.flags & ~AI_USERPTR_READ_ONLY)
+        return -EINVAL;
+    if (req.size == 0 || req.size > dev->caps.max_alloc_size)
+        return -EINVAL;
+    
+    dir = (req.flags & AI_USERPTR_READ_ONLY) ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL;
+    pin = ai_pin_get(ctx, req.user_ptr, req.size, dir);
+    if (IS_ERR(pin))
+        return PTR_ERR(pin);
+    
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf) {
+        ai_pin_put(pin);
+        return -ENOMEM;
+    }
+    
+    ai_mem_obj_init(&buf->obj, AI_MEM_BUFFER, req.size);
+    INIT_LIST_HEAD(&buf->readers);
+    buf->obj.resident = true;
+    buf->size = req.size;
+    buf->cpu_addr = pin->vaddr;
+    buf->dma_addr = simulate ? (dma_addr_t)(unsigned long)buf->cpu_addr :
+                               pin->dma->dma_addr;
+    buf->user = pin;
+    
+    mutex_lock(&dev->lock);
+    handle = idr_alloc(&dev->buffer_idr, buf, 1, 0, GFP_KERNEL);
+    mutex_unlock(&dev->lock);
+    
+    if (handle < 0) {
+        ai_buffer_put(buf);
+        return handle;
+    }
+    
+    req.handle = handle;
+    
+    if (copy_to_user(arg, &req, sizeof(req))) {
+        mutex_lock(&dev->lock);
+        idr_remove(&dev->buffer_idr, handle);
+        mutex_unlock(&dev->lock);
+        ai_buffer_put(buf);
+        return -EFAULT;
+    }
+    
+    pr_debug("ai_accel: registered host memory handle=%d size=%llu segments=%d\n",
+             handle, req.size, pin->dma->sgt->nents);
+    return 0;
+}
+
+/* Read-only registered memory may not be a destination */
+static bool ai_buffer_writable(const struct ai_buffer *buf)
+{
+    return !buf->user || buf->user->dma->dir != DMA_TO_DEVICE;
+}
+
+static void ai_buffer_unregister(struct ai_buffer *buf)
+{
+    ai_pin_put(buf->user);
+}
+
+/*
+ * Job scheduling
+ *
+ * Submitted jobs are queued on the least loaded engine and computed one at a
+ * time per engine. Around compute each engine has an input and an output DMA
+ * stage, which with copy_overlap work on the next and the previous job while
+ * the current one computes. In simulate mode every stage is modelled by an
+ * hrtimer armed for the job's simulated time in it; the output stage's
+ * expiry signals the job, so the submitting thread never sleeps on the
+ * device's behalf.
+ */
+
+static u64 ai_sim_compute_ns(u64 model_size, u32 batch)
+{
+    return div_u64(model_size * (batch ? batch : 1) * sim_compute_ps_per_byte,
+                   1000);
+}
+
+static u64 ai_sim_dma_ns(u64 bytes)
+{
+    return sim_dma_mbps ? div_u64(bytes * 1000, sim_dma_mbps) : 0;
+}
+
+static u64 ai_sim_jitter(u64 ns)
+{
+    u64 span;
+    
+    if (!sim_jitter_pct)
+        return ns;
+    
+    /* Uniform in [ns - span, ns + span] */
+    span = div_u64(ns * min(sim_jitter_pct, 100U), 100);
+    return ns - span + mul_u64_u32_shr(2 * span, get_random_u32(), 32);
+}
+
+static u64 ai_sim_job_ns(const struct ai_model *model,
+                         const struct ai_inference_request *req)
+{
+    u64 ns;
+    
+    ns = sim_launch_ns;
+    ns += ai_sim_compute_ns(model->size, req->batch_size);
+    
+    return ai_sim_jitter(ns);
+}
+
+static void ai_cmd_ops_free(struct ai_cmd_op *ops, u32 num_ops)
+{
+    u32 i;
+    
+    for (i = 0; i < num_ops; i++) {
+        struct ai_cmd_op *op = &ops[i];
+        
+        kvfree(op->staging);    /* Never ran; the context may be gone */
+        if (op->src)
+            ai_pin_put(op->src);
+        if (op->dest)
+            ai_pin_put(op->dest);
+        if (op->timeline)
+            fput(op->timeline);
+    }
+    kfree(ops);
+}
+
+static void ai_job_unpin_objs(struct ai_job *job)
+{
+    u32 i;
+    
+    if (!job->objs_pinned)
+        return;
+    for (i = 0; i < job->num_objs; i++)
+        atomic_dec(&job->objs[i]->pins);
+    job->objs_pinned = false;
+}
+
+static void ai_job_release(struct kref *ref)
+{
+    struct ai_job *job = container_of(ref, struct ai_job, ref);
+    u32 i;
+    
+    /* Jobs that never got queued are still pinned */
+    ai_job_unpin_objs(job);
+    ai_cmd_ops_free(job->ops, job->num_ops);
+    kfree(job->cmds);
+    kvfree(job->pack_area);
+    for (i = 0; i < job->num_objs; i++)
+        ai_mem_obj_put(job->objs[i]);
+    kfree(job->objs);
+    kfree(job->access);
+    kfree(job->deps);
+    kfree(job);
+}
+
+static void ai_job_put(struct ai_job *job)
+{
+    kref_put(&job->ref, ai_job_release);
+}
+
+static void __ai_job_queue(struct ai_device *adev, struct ai_job *job);
+
+/* Caller holds sched_lock */
+static void ai_flight_record(struct ai_device *adev, const struct ai_job *job)
+{
+    struct ai_job_record *rec = &adev->flight[adev->flight_head];
+    
+    rec->fence = job->fence;
+    rec->pid = job->ctx->pid;
+    rec->engine_id = job->profile.engine_id;
+    rec->priority = job->priority;
+    rec->status = job->status;
+    rec->preemptions = job->profile.preemptions;
+    rec->submit_ns = job->profile.submit_ns;
+    rec->start_ns = job->profile.start_ns;
+    rec->end_ns = job->profile.end_ns;
+    rec->duration_ns = job->duration_ns;
+    
+    adev->flight_head = (adev->flight_head + 1) % AI_FLIGHT_RECORDS;
+    adev->flight_count++;
+}
+
+/*
+ * Completion coalescing
+ *
+ * A context may ask for its waiters to be woken in bulk: once coalesce_jobs
+ * of its jobs have signaled, or coalesce_us after the first of them. Only
+ * the wakeup is held back. Job status, in-fence dependents and statistics
+ * are updated when the job signals.
+ */
+
+/*
+ * Caller holds sched_lock. Raise the job's completion; a woken owner may
+ * retire and free it, so nothing of it is touched afterwards.
+ */
+static void ai_job_complete(struct ai_job *job)
+{
+    struct ai_device *adev = job->adev;
+    
+    complete_all(&job->done);
+    if (wq_has_sleeper(&adev->fence_wq))
+        wake_up_all(&adev->fence_wq);
+}
+
+/*
+ * Caller holds sched_lock. Wake everything held back on @ctx; the context
+ * is not touched once the last job is woken, as its owner may be closing.
+ */
+static void ai_ctx_flush_completions(struct ai_context *ctx)
+{
+    struct ai_job *job, *tmp;
+    LIST_HEAD(batch);
+    
+    if (!ctx->num_coalesced)
+        return;
+    
+    list_splice_init(&ctx->coalesced, &batch);
+    ctx->num_coalesced = 0;
+    ctx->coalesce_batches++;
+    
+    list_for_each_entry_safe(job, tmp, &batch, link) {
+        list_del_init(&job->link);
+        ai_job_complete(job);
+    }
+}
+
+static enum hrtimer_restart ai_coalesce_timer_fn(struct hrtimer *timer)
+{
+    struct ai_context *ctx = container_of(timer, struct ai_context,
+                                          coalesce_timer);
+    struct ai_device *adev = ctx->dev;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    ai_ctx_flush_completions(ctx);
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    
+    return HRTIMER_NORESTART;
+}
+
+/* Caller holds sched_lock; wake the job's waiters now or with its batch */
+static void ai_job_wake(struct ai_job *job)
+{
+    struct ai_context *ctx = job->ctx;
+    
+    if (ctx->coalesce_jobs <= 1) {
+        ai_job_complete(job);
+        return;
+    }
+    
+    list_add_tail(&job->link, &ctx->coalesced);
+    ctx->coalesce_held++;
+    if (++ctx->num_coalesced >= ctx->coalesce_jobs) {
+        /* A timer already waiting for sched_lock finds nothing to do */
+        hrtimer_try_to_cancel(&ctx->coalesce_timer);
+        ai_ctx_flush_completions(ctx);
+    } else if (ctx->num_coalesced == 1) {
+        hrtimer_start(&ctx->coalesce_timer,
+                      ns_to_ktime((u64)ctx->coalesce_us * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL_SOFT);
+    }
+}
+
+/* Caller holds sched_lock; jobs assigned to @eng that have not finished */
+static unsigned int ai_engine_load(const struct ai_engine *eng)
+{
+    return eng->queued + eng->num_ready + eng->num_drain +
+           !!eng->copy_in.job + !!eng->active + !!eng->copy_out.job;
+}
+
+/*
+ * Publish a finished job on the status pages; caller holds sched_lock, which
+ * serializes the writers. Its fence slot is cleared first so that a reader
+ * never pairs the old fence with the new status.
+ */
+static void ai_status_signal(struct ai_job *job, s32 status)
+{
+    struct ai_device_status *st = job->adev->status;
+    struct ai_context_status *cst = job->ctx->status;
+    struct ai_fence_slot *slot = &cst->fences[job->fence % AI_STATUS_FENCE_SLOTS];
+    struct ai_engine_status *es;
+    struct ai_engine *eng;
+    
+    WRITE_ONCE(slot->fence, 0);
+    smp_wmb();
+    WRITE_ONCE(slot->status, status);
+    smp_wmb();
+    WRITE_ONCE(slot->fence, job->fence);
+    WRITE_ONCE(cst->completed, cst->completed + 1);
+    
+    /* A job failed by its dependencies never reached an engine */
+    if (!job->dep_failed) {
+        eng = &job->adev->engines[job->profile.engine_id];
+        es = &st->engines[eng->id];
+        WRITE_ONCE(es->last_fence, job->fence);
+        WRITE_ONCE(es->completed, es->completed + 1);
+        WRITE_ONCE(es->depth, ai_engine_load(eng));
+    }
+    
+    WRITE_ONCE(st->completed_jobs, st->completed_jobs + 1);
+    if (status != AI_STATUS_SUCCESS)
+        WRITE_ONCE(st->failed_jobs, st->failed_jobs + 1);
+    if (status == AI_STATUS_TIMEOUT)
+        WRITE_ONCE(st->timed_out_jobs, st->timed_out_jobs + 1);
+    WRITE_ONCE(st->total_inferences,
+               atomic64_read(&job->adev->total_inferences));
+    WRITE_ONCE(st->total_bytes_processed,
+               atomic64_read(&job->adev->total_bytes_processed));
+}
+
+/*
+ * Buffer reservations
+ *
+ * Each buffer remembers its last pending writer and the pending readers
+ * queued since. A job that reads a buffer waits for that writer; a job
+ * that writes one waits for the writer and for every one of those readers.
+ * The waits are order_only: a failed writer leaves its buffer's contents
+ * undefined but does not fail the jobs behind it. All of it is under
+ * sched_lock, and a signaled job detaches before its dependents run.
+ */
+
+/* Caller holds sched_lock; order the job behind the buffers' earlier users */
+static void ai_job_resv_attach(struct ai_job *job)
+{
+    u32 i;
+    
+    if (job->flags & AI_INFER_NO_IMPLICIT_SYNC)
+        return;
+    
+    for (i = 0; i < job->num_access; i++) {
+        struct ai_buf_access *acc = &job->access[i];
+        struct ai_buffer *buf = acc->buf;
+        struct ai_buf_access *r, *tmp;
+        
+        if (buf->writer) {
+            acc->dep.waiter = job;
+            acc->dep.order_only = true;
+            list_add_tail(&acc->dep.link, &buf->writer->job->dependents);
+            job->deps_pending++;
+        }
+        
+        if (!acc->write) {
+            list_add_tail(&acc->link, &buf->readers);
+            continue;
+        }
+        
+        /* The readers now hold this writer back instead of the next one */
+        list_for_each_entry_safe(r, tmp, &buf->readers, link) {
+            list_move_tail(&r->link, &acc->readers);
+            r->writer = acc;
+            acc->readers_left++;
+        }
+        if (acc->readers_left)
+            job->deps_pending++;
+        buf->writer = acc;
+    }
+}
+
+/* Caller holds sched_lock; the job no longer holds its buffers' users back */
+static void ai_job_resv_detach(struct ai_job *job)
+{
+    struct ai_device *adev = job->adev;
+    u32 i;
+    
+    for (i = 0; i < job->num_access; i++) {
+        struct ai_buf_access *acc = &job->access[i];
+        struct ai_buf_access *w = acc->writer;
+        
+        if (acc->write) {
+            if (acc->buf->writer == acc)
+                acc->buf->writer = NULL;
+            continue;
+        }
+        
+        list_del_init(&acc->link);
+        acc->writer = NULL;
+        if (w && --w->readers_left == 0 && --w->job->deps_pending == 0)
+            __ai_job_queue(adev, w->job);
+    }
+}
+
+/* Caller holds sched_lock */
+static void ai_job_signal(struct ai_job *job, s32 status)
+{
+    struct ai_device *adev = job->adev;
+    struct ai_job_dep *dep, *tmp;
+    struct ai_job *f, *ftmp;
+    
+    job->status = status;
+    job->profile.end_ns = ktime_get_ns();
+    ai_flight_record(adev, job);
+    
+    /* Its memory may be evicted again */
+    ai_job_unpin_objs(job);
+    
+    if (status == AI_STATUS_SUCCESS) {
+        atomic64_inc(&adev->total_inferences);
+        atomic64_add(job->bytes, &adev->total_bytes_processed);
+    }
+    ai_status_signal(job, status);
+    ai_job_resv_detach(job);
+    
+    /* Requests batched into the job ran, or failed, with it */
+    list_for_each_entry_safe(f, ftmp, &job->batch, link) {
+        list_del_init(&f->link);
+        f->profile.start_ns = job->profile.start_ns;
+        f->profile.engine_id = job->profile.engine_id;
+        f->profile.preemptions = job->profile.preemptions;
+        f->profile.batch_size = job->profile.batch_size;
+        f->run_ns = job->run_ns;
+        ai_job_signal(f, status);
+    }
+    
+    /* Release jobs that were waiting on this fence; never held back */
+    list_for_each_entry_safe(dep, tmp, &job->dependents, link) {
+        struct ai_job *waiter = dep->waiter;
+        
+        list_del_init(&dep->link);
+        if (status != AI_STATUS_SUCCESS && !dep->order_only)
+            waiter->dep_failed = true;
+        if (--waiter->deps_pending == 0)
+            __ai_job_queue(adev, waiter);
+    }
+    
+    /* Last: a woken owner may retire and free the job */
+    ai_job_wake(job);
+}
+
+static enum ai_rank ai_prio_rank(u32 priority)
+{
+    switch (priority) {
+    case AI_PRIORITY_LOW:
+        return AI_RANK_LOW;
+    case AI_PRIORITY_HIGH:
+        return AI_RANK_HIGH;
+    default:
+        return AI_RANK_NORMAL;
+    }
+}
+
+static u64 ai_timeslice_ns(enum ai_rank rank)
+{
+    switch (rank) {
+    case AI_RANK_LOW:
+        return (u64)timeslice_us_low * NSEC_PER_USEC;
+    case AI_RANK_HIGH:
+        return (u64)timeslice_us_high * NSEC_PER_USEC;
+    default:
+        return (u64)timeslice_us_normal * NSEC_PER_USEC;
+    }
+}
+
+/* Caller holds sched_lock; arm the engine for the job's next slice */
+static void ai_engine_run(struct ai_engine *eng, struct ai_job *job)
+{
+    u64 slice = ai_timeslice_ns(job->rank);
+    u64 quantum = job->remaining_ns;
+    
+    if (slice && quantum > slice)
+        quantum = slice;
+    
+    eng->slice_start = ktime_get();
+    
+    /* A hung job never raises its completion; only the watchdog ends it */
+    if (job->hung)
+        return;
+    
+    /*
+     * Real hardware would have its doorbell rung here and complete from
+     * the interrupt handler; both modes share the timer-driven completion.
+     */
+    hrtimer_start(&eng->timer, ns_to_ktime(quantum), HRTIMER_MODE_REL_SOFT);
+}
+
+/* Caller holds sched_lock; the job waits for its inputs to be loaded */
+static void ai_engine_enqueue(struct ai_engine *eng, struct ai_job *job)
+{
+    list_add_tail(&job->link, &eng->queue[job->rank]);
+    eng->queued++;
+    WRITE_ONCE(eng->adev->status->engines[eng->id].depth, ai_engine_load(eng));
+}
+
+/* Caller holds sched_lock; the job's inputs are on the device */
+static void ai_engine_make_ready(struct ai_engine *eng, struct ai_job *job)
+{
+    list_add_tail(&job->link, &eng->ready[job->rank]);
+    eng->num_ready++;
+}
+
+/* Highest rank with a job on one of the per-rank @lists, or -1 */
+static int ai_engine_top_rank(const struct list_head *lists)
+{
+    int rank;
+    
+    for (rank = AI_RANK_COUNT - 1; rank >= 0; rank--)
+        if (!list_empty(&lists[rank]))
+            break;
+    return rank;
+}
+
+/* Caller holds sched_lock; is anything ready that may displace @job? */
+static bool ai_engine_should_switch(struct ai_engine *eng, struct ai_job *job)
+{
+    return ai_engine_top_rank(eng->ready) >= (int)job->rank;
+}
+
+/*
+ * Caller holds sched_lock. A higher class job became ready behind the
+ * active one: in simulate mode, pull the engine timer in to the active
+ * job's next checkpoint so the switch happens within sim_checkpoint_us.
+ */
+static void ai_engine_preempt(struct ai_engine *eng, struct ai_job *job)
+{
+    u64 cp = (u64)sim_checkpoint_us * NSEC_PER_USEC;
+    u64 elapsed, until;
+    
+    if (!simulate || !cp || !eng->active || job->rank <= eng->active->rank)
+        return;
+    
+    /* Already finishing, or hung and unable to reach a checkpoint */
+    if (!eng->active->remaining_ns || eng->active->hung)
+        return;
+    
+    elapsed = ktime_to_ns(ktime_sub(ktime_get(), eng->slice_start));
+    until = (div64_u64(elapsed, cp) + 1) * cp - elapsed;
+    
+    if (until < ktime_to_ns(hrtimer_get_remaining(&eng->timer)))
+        hrtimer_start(&eng->timer, ns_to_ktime(until), HRTIMER_MODE_REL_SOFT);
+}
+
+/* Caller holds sched_lock; returns false if @job has nothing to transfer */
+static bool ai_copy_start(struct ai_copy_stage *st, struct ai_job *job, u64 ns)
+{
+    if (!ns)
+        return false;
+    
+    st->job = job;
+    st->start = ktime_get();
+    hrtimer_start(&st->timer, ns_to_ktime(ns), HRTIMER_MODE_REL_SOFT);
+    return true;
+}
+
+/* Caller holds sched_lock; start writing back the oldest computed job */
+static void ai_engine_kick_copy_out(struct ai_engine *eng)
+{
+    struct ai_job *job;
+    
+    while (!eng->copy_out.job && eng->num_drain) {
+        job = list_first_entry(&eng->drain, struct ai_job, link);
+        list_del_init(&job->link);
+        eng->num_drain--;
+        
+        if (ai_copy_start(&eng->copy_out, job, job->copy_out_ns))
+            break;
+        ai_job_signal(job, AI_STATUS_SUCCESS);
+    }
+}
+
+/* Caller holds sched_lock; run the best ready job if compute is idle */
+static void ai_engine_kick_compute(struct ai_engine *eng)
+{
+    struct ai_job *job;
+    int rank;
+    
+    if (eng->active || !eng->num_ready)
+        return;
+    if (!copy_overlap && (eng->copy_in.job || eng->copy_out.job))
+        return;
+    
+    /* Highest class first, FIFO within a class */
+    rank = ai_engine_top_rank(eng->ready);
+    job = list_first_entry(&eng->ready[rank], struct ai_job, link);
+    list_del_init(&job->link);
+    eng->num_ready--;
+    eng->active = job;
+    
+    if (!job->run_ns && simulate && sim_hang_pct && job->remaining_ns &&
+        get_random_u32() % 100 < sim_hang_pct)
+        job->hung = true;
+    
+    ai_engine_run(eng, job);
+    
+    if (job->timeout_ns)
+        queue_delayed_work(system_wq, &eng->adev->watchdog,
+                           msecs_to_jiffies(AI_WATCHDOG_PERIOD_MS));
+}
+
+/* Most batch items one dispatch may take */
+static u32 ai_batch_limit(const struct ai_device *adev)
+{
+    return min(batch_max, adev->caps.max_batch_size);
+}
+
+/* Caller holds sched_lock; may more requests join @job before it loads? */
+static bool ai_batch_hold(struct ai_engine *eng, struct ai_job *job)
+{
+    if (!job->batch_items || job->batch_items >= ai_batch_limit(eng->adev) ||
+        !ktime_before(ktime_get(), job->batch_deadline))
+        return false;
+    
+    hrtimer_start(&eng->batch_timer, job->batch_deadline, HRTIMER_MODE_ABS_SOFT);
+    return true;
+}
+
+/*
+ * Caller holds sched_lock. Start loading the inputs of the next queued job:
+ * one job ahead of compute, plus any job that outranks everything already
+ * loaded. Returns true if the job had nothing to load and is ready at once.
+ */
+static bool ai_engine_kick_copy_in(struct ai_engine *eng)
+{
+    struct ai_job *job;
+    int rank;
+    
+    if (eng->copy_in.job || !eng->queued)
+        return false;
+    if (!copy_overlap && (eng->active || eng->copy_out.job))
+        return false;
+    
+    rank = ai_engine_top_rank(eng->queue);
+    if (eng->num_ready && rank <= ai_engine_top_rank(eng->ready))
+        return false;
+    
+    job = list_first_entry(&eng->queue[rank], struct ai_job, link);
+    if (ai_batch_hold(eng, job))
+        return false;
+    list_del_init(&job->link);
+    eng->queued--;
+    if (job->profile.batch_size > 1)
+        eng->adev->batch_dispatches++;
+    job->profile.start_ns = ktime_get_ns();
+    job->profile.engine_id = eng->id;
+    
+    if (ai_copy_start(&eng->copy_in, job, job->copy_in_ns))
+        return false;
+    
+    ai_engine_make_ready(eng, job);
+    ai_engine_preempt(eng, job);
+    return true;
+}
+
+/* Caller holds sched_lock; move jobs along the engine's pipeline */
+static void ai_engine_kick(struct ai_engine *eng)
+{
+    ai_engine_kick_copy_out(eng);
+    ai_engine_kick_compute(eng);
+    while (ai_engine_kick_copy_in(eng))
+        ai_engine_kick_compute(eng);
+}
+
+/*
+ * Pass the engine's computed job on to output DMA and start the next one.
+ * The watchdog may have reset the engine in the meantime, in which case
+ * @job is already done.
+ */
+static void ai_engine_complete(struct ai_engine *eng, struct ai_job *job)
+{
+    struct ai_device *adev = eng->adev;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    if (eng->active == job) {
+        eng->active = NULL;
+        list_add_tail(&job->link, &eng->drain);
+        eng->num_drain++;
+        ai_engine_kick(eng);
+    }
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+}
+
+static enum hrtimer_restart ai_engine_timer_fn(struct hrtimer *timer)
+{
+    struct ai_engine *eng = container_of(timer, struct ai_engine, timer);
+    struct ai_device *adev = eng->adev;
+    struct ai_job *job;
+    unsigned long flags;
+    u64 ran;
+    
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    job = eng->active;
+    if (!job)
+        goto out_unlock;
+    
+    /* Slice over or checkpoint reached: switch or keep running */
+    ran = ktime_to_ns(ktime_sub(ktime_get(), eng->slice_start));
+    job->run_ns += ran;
+    job->remaining_ns -= min(ran, job->remaining_ns);
+    eng->busy_ns[AI_STAGE_COMPUTE] += ran;
+    if (job->remaining_ns) {
+        if (ai_engine_should_switch(eng, job)) {
+            eng->active = NULL;
+            job->profile.preemptions++;
+            ai_engine_make_ready(eng, job);
+            ai_engine_kick(eng);
+        } else {
+            ai_engine_run(eng, job);
+        }
+        goto out_unlock;
+    }
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    
+    /* Command buffer side effects may sleep; finish them from the workqueue */
+    if (job->num_ops) {
+        queue_work(adev->exec_wq, &job->work);
+        return HRTIMER_NORESTART;
+    }
+    
+    ai_engine_complete(eng, job);
+    return HRTIMER_NORESTART;
+
+out_unlock:
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+/* Input or output DMA of a job finished */
+static enum hrtimer_restart ai_copy_timer_fn(struct hrtimer *timer)
+{
+    struct ai_copy_stage *st = container_of(timer, struct ai_copy_stage, timer);
+    struct ai_engine *eng = st->eng;
+    struct ai_device *adev = eng->adev;
+    struct ai_job *job;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    job = st->job;
+    if (job) {
+        st->job = NULL;
+        eng->busy_ns[st->stage] += ktime_to_ns(ktime_sub(ktime_get(),
+                                                         st->start));
+        if (st->stage == AI_STAGE_COPY_IN) {
+            ai_engine_make_ready(eng, job);
+            ai_engine_preempt(eng, job);
+        } else {
+            ai_job_signal(job, AI_STATUS_SUCCESS);
+        }
+        ai_engine_kick(eng);
+    }
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    
+    return HRTIMER_NORESTART;
+}
+
+/* A held job's batch window closed */
+static enum hrtimer_restart ai_batch_timer_fn(struct hrtimer *timer)
+{
+    struct ai_engine *eng = container_of(timer, struct ai_engine, batch_timer);
+    unsigned long flags;
+    
+    spin_lock_irqsave(&eng->adev->sched_lock, flags);
+    ai_engine_kick(eng);
+    spin_unlock_irqrestore(&eng->adev->sched_lock, flags);
+    
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Watchdog
+ *
+ * While any engine is busy, scan the active jobs every AI_WATCHDOG_PERIOD_MS.
+ * A job that has been on its engine longer than its timeout is cancelled with
+ * AI_STATUS_TIMEOUT, the engine is reset and its queue dispatched again, so a
+ * hung job costs one request rather than the engine.
+ */
+
+/* Caller holds sched_lock */
+static void ai_engine_reset(struct ai_engine *eng)
+{
+    struct ai_device *adev = eng->adev;
+    struct ai_job *job = eng->active;
+    
+    dev_warn(adev->dev, "engine %u: job %llu timed out after %llu ms, resetting\n",
+             eng->id, job->fence, div_u64(job->run_ns, NSEC_PER_MSEC));
+    
+    /*
+     * The timer callback may already be waiting for sched_lock; it copes
+     * with finding a different (or no) active job.
+     */
+    hrtimer_try_to_cancel(&eng->timer);
+    eng->active = NULL;
+    adev->engine_resets++;
+    
+    /* Real hardware would reset the engine through its control registers */
+    
+    ai_job_signal(job, AI_STATUS_TIMEOUT);
+    ai_engine_kick(eng);
+}
+
+static void ai_watchdog_work(struct work_struct *work)
+{
+    struct ai_device *adev = container_of(to_delayed_work(work),
+                                          struct ai_device, watchdog);
+    ktime_t now = ktime_get();
+    bool busy = false;
+    unsigned long flags;
+    u64 ran;
+    u32 i;
+    
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    for (i = 0; i < adev->num_engines; i++) {
+        struct ai_engine *eng = &adev->engines[i];
+        struct ai_job *job = eng->active;
+        
+        /* Jobs without remaining time are already completing */
+        if (!job || !job->timeout_ns || !job->remaining_ns)
+            continue;
+        
+        ran = ktime_to_ns(ktime_sub(now, eng->slice_start));
+        if (job->run_ns + ran > job->timeout_ns) {
+            job->run_ns += ran;
+            eng->busy_ns[AI_STAGE_COMPUTE] += ran;
+            ai_engine_reset(eng);
+        }
+        busy |= eng->active != NULL;
+    }
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    
+    if (busy)
+        queue_delayed_work(system_wq, &adev->watchdog,
+                           msecs_to_jiffies(AI_WATCHDOG_PERIOD_MS));
+}
+
+/* Caller holds sched_lock; @mask is validated to contain an engine */
+static struct ai_engine *ai_pick_engine(struct ai_device *adev, u32 mask)
+{
+    struct ai_engine *best = &adev->engines[0];
+    unsigned int load, best_load = UINT_MAX;
+    u32 i;
+    
+    for (i = 0; i < adev->num_engines; i++) {
+        struct ai_engine *eng = &adev->engines[i];
+        
+        if (mask && !(mask & BIT(i)))
+            continue;
+        load = ai_engine_load(eng);
+        if (load < best_load) {
+            best = eng;
+            best_load = load;
+        }
+    }
+    
+    return best;
+}
+
+/*
+ * Caller holds sched_lock. Add @job to a queued request of the same model
+ * and class whose input DMA has not started, if one has room; returns that
+ * request's engine, or NULL if the job is to be dispatched by itself.
+ */
+static struct ai_engine *ai_batch_join(struct ai_device *adev,
+                                       struct ai_job *job)
+{
+    u32 max = ai_batch_limit(adev);
+    struct ai_job *lead;
+    u64 launch;
+    u32 i;
+    
+    if (!job->batch_items || job->batch_items >= max)
+        return NULL;
+    
+    for (i = 0; i < adev->num_engines; i++) {
+        struct ai_engine *eng = &adev->engines[i];
+        
+        if (job->engine_mask && !(job->engine_mask & BIT(i)))
+            continue;
+        list_for_each_entry(lead, &eng->queue[job->rank], link) {
+            if (lead->model != job->model ||
+                lead->batch_items + job->batch_items > max)
+                continue;
+            
+            /* One launch for the lot; transfers stay per request */
+            launch = simulate ? min_t(u64, sim_launch_ns, job->remaining_ns) : 0;
+            lead->remaining_ns += job->remaining_ns - launch;
+            lead->copy_in_ns += job->copy_in_ns;
+            lead->copy_out_ns += job->copy_out_ns;
+            if (lead->timeout_ns && job->timeout_ns)
+                lead->timeout_ns += job->remaining_ns;
+            else
+                lead->timeout_ns = 0;
+            lead->batch_items += job->batch_items;
+            lead->profile.batch_size++;
+            list_add_tail(&job->link, &lead->batch);
+            adev->batch_merged++;
+            return eng;
+        }
+    }
+    return NULL;
+}
+
+/* Caller holds sched_lock; all of the job's in-fences have signaled */
+static void __ai_job_queue(struct ai_device *adev, struct ai_job *job)
+{
+    struct ai_engine *eng;
+    
+    /* A failed dependency fails the job without running it */
+    if (job->dep_failed) {
+        job->profile.start_ns = ktime_get_ns();
+        ai_job_signal(job, AI_STATUS_ERROR);
+        return;
+    }
+    
+    eng = ai_batch_join(adev, job);
+    if (eng) {
+        ai_engine_kick(eng);
+        return;
+    }
+    
+    eng = ai_pick_engine(adev, job->engine_mask);
+    if (job->batch_items)
+        job->batch_deadline = ktime_add_us(ktime_get(), batch_window_us);
+    ai_engine_enqueue(eng, job);
+    ai_engine_kick(eng);
+}
+
+/*
+ * Queue a job behind its in-fences, the previous job of @queue and the
+ * earlier users of its buffers. Fences that are still pending get a
+ * dependency link back to the job; the last one to signal queues it.
+ */
+static void ai_job_queue(struct ai_device *adev, struct ai_job *job,
+                         struct ai_job **in, unsigned int num_in,
+                         struct ai_queue *queue)
+{
+    struct ai_job *prev = NULL;
+    unsigned long flags;
+    unsigned int i;
+    
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    if (queue) {
+        prev = queue->last;
+        if (prev && prev->status == AI_STATUS_PENDING) {
+            job->queue_dep.waiter = job;
+            job->queue_dep.order_only = true;
+            list_add_tail(&job->queue_dep.link, &prev->dependents);
+            job->deps_pending++;
+        }
+        kref_get(&job->ref);
+        queue->last = job;
+    }
+    for (i = 0; i < num_in; i++) {
+        struct ai_job *fence = in[i];
+        
+        /* Signaled, though its waiters may not be woken yet */
+        if (fence->status != AI_STATUS_PENDING) {
+            if (fence->status != AI_STATUS_SUCCESS)
+                job->dep_failed = true;
+            continue;
+        }
+        job->deps[i].waiter = job;
+        list_add_tail(&job->deps[i].link, &fence->dependents);
+        job->deps_pending++;
+    }
+    for (i = 0; i < job->num_ops; i++) {
+        struct ai_cmd_op *op = &job->ops[i];
+        struct ai_timeline *tl;
+        
+        if (op->op != AI_CMD_TIMELINE_WAIT)
+            continue;
+        tl = op->timeline->private_data;
+        if (tl->value >= op->value)
+            continue;
+        op->tl_wait.waiter = job;
+        list_add_tail(&op->tl_wait.link, &tl->waits);
+        job->deps_pending++;
+    }
+    ai_job_resv_attach(job);
+    if (job->deps_pending == 0)
+        __ai_job_queue(adev, job);
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    
+    /* Releasing a job takes process context, not sched_lock */
+    if (prev)
+        ai_job_put(prev);
+}
+
+/*
+ * Timeline semaphores
+ *
+ * Each timeline is an anonymous file, so it is shared between processes
+ * like any other fd. A command buffer's TIMELINE_WAITs hold the whole job
+ * back as in-fences do, and its TIMELINE_SIGNALs advance the timeline when
+ * the job's ops run. All timeline state is under sched_lock.
+ */
+
+static int ai_timeline_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations ai_timeline_fops = {
+    .owner          = THIS_MODULE,
+    .release        = ai_timeline_release,
+};
+
+/* Reference the timeline behind @fd */
+static struct file *ai_timeline_fget(int fd)
+{
+    struct file *file = fget(fd);
+    
+    if (!file)
+        return ERR_PTR(-EBADF);
+    if (file->f_op != &ai_timeline_fops) {
+        fput(file);
+        return ERR_PTR(-EINVAL);
+    }
+    return file;
+}
+
+/* Caller holds sched_lock; queue the jobs and wake the CPU waiters now met */
+static void ai_timeline_advance(struct ai_timeline *tl, u64 value)
+{
+    struct ai_job_dep *dep, *tmp;
+    
+    if (value <= tl->value)
+        return;
+    WRITE_ONCE(tl->value, value);
+    
+    list_for_each_entry_safe(dep, tmp, &tl->waits, link) {
+        struct ai_cmd_op *op = container_of(dep, struct ai_cmd_op, tl_wait);
+        
+        if (op->value > value)
+            continue;
+        list_del_init(&dep->link);
+        if (--dep->waiter->deps_pending == 0)
+            __ai_job_queue(tl->dev, dep->waiter);
+    }
+    wake_up_all(&tl->wq);
+}
+
+/*
+ * Caller holds sched_lock. Unhook a held-back job from everything it waits
+ * on: timelines, in-fences, the previous job of its queue and the earlier
+ * users of its buffers. Readers that held a write back return to their
+ * buffer, so writers queued from now on wait for them; one already queued
+ * behind the job no longer does.
+ */
+static void ai_job_detach_waits(struct ai_job *job)
+{
+    struct ai_buf_access *r, *tmp;
+    u32 i;
+    
+    for (i = 0; i < job->num_ops; i++)
+        if (job->ops[i].op == AI_CMD_TIMELINE_WAIT)
+            list_del_init(&job->ops[i].tl_wait.link);
+    for (i = 0; i < job->num_deps; i++)
+        list_del_init(&job->deps[i].link);
+    list_del_init(&job->queue_dep.link);
+    
+    for (i = 0; i < job->num_access; i++) {
+        struct ai_buf_access *acc = &job->access[i];
+        
+        list_del_init(&acc->dep.link);
+        list_for_each_entry_safe(r, tmp, &acc->readers, link) {
+            list_move_tail(&r->link, &acc->buf->readers);
+            r->writer = NULL;
+        }
+        acc->readers_left = 0;
+    }
+    job->deps_pending = 0;
+}
+
+/*
+ * What a held-back job waits for may belong to another context, or be a
+ * timeline that never reaches its value, so a closing context fails such
+ * jobs rather than wait for them forever. Jobs already queued on an engine
+ * finish, at the latest, when the watchdog fires.
+ */
+static void ai_ctx_cancel_waits(struct ai_context *ctx)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_job *job;
+    unsigned long flags;
+    
+    mutex_lock(&ctx->lock);
+    spin_lock_irqsave(&dev->sched_lock, flags);
+    list_for_each_entry(job, &ctx->jobs, ctx_link) {
+        /* May have been queued by the failure of an earlier one */
+        if (!job->deps_pending)
+            continue;
+        ai_job_detach_waits(job);
+        job->dep_failed = true;
+        __ai_job_queue(dev, job);
+    }
+    spin_unlock_irqrestore(&dev->sched_lock, flags);
+    mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Look up the jobs behind a submission's in-fences. Retired fences have
+ * already signaled and are skipped, but @failed is set if one of them
+ * failed; returns the number of referenced jobs placed in @in.
+ */
+static int ai_job_lookup_in_fences(struct ai_device *dev, u64 user_fences,
+                                   u32 count, struct ai_job **in, bool *failed)
+{
+    u64 fences[AI_MAX_IN_FENCES];
+    u64 last = atomic_read(&dev->fence_counter);
+    unsigned int i;
+    int n = 0;
+    
+    *failed = false;
+    
+    if (count > AI_MAX_IN_FENCES)
+        return -EINVAL;
+    if (!count)
+        return 0;
+    
+    if (copy_from_user(fences, u64_to_user_ptr(user_fences),
+                       count * sizeof(fences[0])))
+        return -EFAULT;
+    
+    for (i = 0; i < count; i++)
+        if (fences[i] == 0 || fences[i] > last)
+            return -EINVAL;
+    
+    mutex_lock(&dev->lock);
+    for (i = 0; i < count; i++) {
+        struct ai_job *job = idr_find(&dev->job_idr, fences[i]);
+        
+        s32 status;
+        
+        if (job) {
+            kref_get(&job->ref);
+            in[n++] = job;
+            continue;
+        }
+        status = ai_fence_retired_status(dev, fences[i]);
+        if (status == AI_STATUS_INVALID)
+            break;
+        if (status != AI_STATUS_SUCCESS)
+            *failed = true;
+    }
+    mutex_unlock(&dev->lock);
+    
+    /* Retired so long ago that its outcome is no longer known */
+    if (i < count) {
+        while (n)
+            ai_job_put(in[--n]);
+        return -ENOENT;
+    }
+    return n;
+}
+
+static void ai_cmdbuf_work(struct work_struct *work);
+
+static struct ai_job *ai_job_alloc(struct ai_context *ctx, u32 flags,
+                                   u32 priority, u32 timeout_ms,
+                                   unsigned int num_in, unsigned int max_objs)
+{
+    struct ai_job *job;
+    unsigned int i;
+    
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    if (!job)
+        return NULL;
+    
+    if (num_in) {
+        job->deps = kcalloc(num_in, sizeof(*job->deps), GFP_KERNEL);
+        if (!job->deps)
+            goto err_free;
+        job->num_deps = num_in;
+        for (i = 0; i < num_in; i++)
+            INIT_LIST_HEAD(&job->deps[i].link);
+    }
+    
+    job->objs = kcalloc(max_objs, sizeof(*job->objs), GFP_KERNEL);
+    job->access = kcalloc(max_objs, sizeof(*job->access), GFP_KERNEL);
+    if (!job->objs || !job->access)
+        goto err_free;
+    
+    kref_init(&job->ref);
+    init_completion(&job->done);
+    INIT_LIST_HEAD(&job->link);
+    INIT_LIST_HEAD(&job->ctx_link);
+    INIT_LIST_HEAD(&job->dependents);
+    INIT_LIST_HEAD(&job->batch);
+    INIT_LIST_HEAD(&job->queue_dep.link);
+    INIT_WORK(&job->work, ai_cmdbuf_work);
+    job->adev = ctx->dev;
+    job->ctx = ctx;
+    job->flags = flags;
+    job->priority = priority;
+    job->rank = ai_prio_rank(priority);
+    job->timeout_ns = (u64)(timeout_ms ? timeout_ms : job_timeout_ms) *
+                      NSEC_PER_MSEC;
+    job->status = AI_STATUS_PENDING;
+    job->profile.submit_ns = ktime_get_ns();
+    job->profile.batch_size = 1;
+    
+    return job;
+
+err_free:
+    kfree(job->access);
+    kfree(job->objs);
+    kfree(job->deps);
+    kfree(job);
+    return NULL;
+}
+
+/* Caller holds dev->lock; the job takes its own reference on @obj */
+static void ai_job_add_obj(struct ai_job *job, struct ai_mem_obj *obj)
+{
+    u32 i;
+    
+    for (i = 0; i < job->num_objs; i++)
+        if (job->objs[i] == obj)
+            return;
+    
+    kref_get(&obj->ref);
+    job->objs[job->num_objs++] = obj;
+}
+
+/* Record that @job reads or writes @buf; the buffer is already in its objs */
+static void ai_job_add_access(struct ai_job *job, struct ai_buffer *buf,
+                              bool write)
+{
+    struct ai_buf_access *acc;
+    u32 i;
+    
+    for (i = 0; i < job->num_access; i++) {
+        if (job->access[i].buf == buf) {
+            job->access[i].write |= write;
+            return;
+        }
+    }
+    
+    acc = &job->access[job->num_access++];
+    acc->buf = buf;
+    acc->job = job;
+    acc->write = write;
+    INIT_LIST_HEAD(&acc->dep.link);
+    INIT_LIST_HEAD(&acc->link);
+    INIT_LIST_HEAD(&acc->readers);
+}
+
+/*
+ * Caller holds dev->lock. Bring everything the job uses into device memory
+ * and pin it until the job signals; the transfers add to the job's time.
+ */
+static int ai_job_pin_objs(struct ai_device *dev, struct ai_job *job)
+{
+    u64 moved = 0;
+    u32 i;
+    int ret;
+    
+    for (i = 0; i < job->num_objs; i++) {
+        ret = ai_mem_obj_pin(dev, job->objs[i], &moved);
+        if (ret) {
+            while (i--)
+                atomic_dec(&job->objs[i]->pins);
+            return ret;
+        }
+    }
+    job->objs_pinned = true;
+    
+    if (simulate && moved) {
+        job->duration_ns += ai_sim_dma_ns(moved);
+        job->copy_in_ns += ai_sim_dma_ns(moved);
+    }
+    return 0;
+}
+
+static void ai_ctx_trim(struct ai_context *ctx);
+
+/*
+ * Submission queues
+ *
+ * A queue orders its jobs by making each one depend on the one submitted
+ * before it, outcome aside, and gives them its priority and engines. Jobs
+ * without a queue, and jobs of different queues, are not ordered.
+ */
+
+static void ai_queue_release(struct kref *ref)
+{
+    struct ai_queue *queue = container_of(ref, struct ai_queue, ref);
+    
+    if (queue->last)
+        ai_job_put(queue->last);
+    mutex_destroy(&queue->lock);
+    kfree(queue);
+}
+
+static void ai_queue_put(struct ai_queue *queue)
+{
+    kref_put(&queue->ref, ai_queue_release);
+}
+
+static struct ai_queue *ai_queue_get(struct ai_context *ctx, u32 id)
+{
+    struct ai_queue *queue;
+    
+    mutex_lock(&ctx->lock);
+    queue = idr_find(&ctx->queues, id);
+    if (queue)
+        kref_get(&queue->ref);
+    mutex_unlock(&ctx->lock);
+    return queue;
+}
+
+/*
+ * Give a fully built job its fence, attach it to the context and queue it
+ * behind its in-fences and, if @queue_id is set, the rest of that queue. On
+ * success the caller keeps its own reference; on failure that reference is
+ * dropped.
+ */
+static int ai_job_publish(struct ai_context *ctx, struct ai_job *job,
+                          struct ai_job **in, unsigned int num_in, u32 queue_id)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_queue *queue = NULL;
+    int fence;
+    int ret;
+    
+    if (queue_id) {
+        queue = ai_queue_get(ctx, queue_id);
+        if (!queue) {
+            ai_job_put(job);
+            return -ENOENT;
+        }
+        job->priority = queue->priority;
+        job->rank = ai_prio_rank(queue->priority);
+        job->engine_mask = queue->engine_mask;
+        mutex_lock(&queue->lock);
+    }
+    
+    /* Generate fence */
+    fence = atomic_inc_return(&dev->fence_counter);
+    
+    mutex_lock(&dev->lock);
+    ret = idr_alloc(&dev->job_idr, job, fence, fence + 1, GFP_KERNEL);
+    mutex_unlock(&dev->lock);
+    if (ret < 0) {
+        if (queue) {
+            mutex_unlock(&queue->lock);
+            ai_queue_put(queue);
+        }
+        ai_job_put(job);
+        return ret;
+    }
+    job->fence = fence;
+    job->profile.fence = fence;
+    
+    mutex_lock(&ctx->lock);
+    list_add_tail(&job->ctx_link, &ctx->jobs);
+    ctx->num_jobs++;
+    WRITE_ONCE(ctx->status->submitted, ctx->status->submitted + 1);
+    ai_ctx_trim(ctx);
+    mutex_unlock(&ctx->lock);
+    
+    /* Another thread may wait on and retire the fence before we return */
+    kref_get(&job->ref);
+    ai_job_queue(dev, job, in, num_in, queue);
+    
+    if (queue) {
+        mutex_unlock(&queue->lock);
+        ai_queue_put(queue);
+    }
+    return 0;
+}
+
+/* Block a synchronous submitter until its job has signaled */
+static int ai_job_wait_sync(struct ai_job *job)
+{
+    if (job->flags & AI_INFER_ASYNC)
+        return 0;
+    if (wait_for_completion_interruptible(&job->done))
+        return -EINTR;
+    if (job->status == AI_STATUS_TIMEOUT)
+        return -ETIMEDOUT;
+    return job->status == AI_STATUS_SUCCESS ? 0 : -EIO;
+}
+
+/* Caller holds dev->lock; remember how the retired job of @fence failed */
+static void ai_fence_record_failure(struct ai_device *dev, u64 fence,
+                                    s32 status)
+{
+    unsigned long oldest = 0;
+    
+    if (dev->num_failed >= AI_FAILED_FENCES &&
+        xa_find(&dev->failed_fences, &oldest, ULONG_MAX, XA_PRESENT)) {
+        xa_erase(&dev->failed_fences, oldest);
+        dev->num_failed--;
+        dev->failed_floor = max_t(u64, dev->failed_floor, oldest);
+    }
+    
+    /* Without memory for the record, forget every outcome up to it */
+    if (xa_err(xa_store(&dev->failed_fences, fence, xa_mk_value(-status),
+                        GFP_KERNEL))) {
+        dev->failed_floor = max(dev->failed_floor, fence);
+        return;
+    }
+    dev->num_failed++;
+}
+
+/*
+ * Caller holds dev->lock. The AI_STATUS_* a retired fence finished with, or
+ * AI_STATUS_INVALID if it was retired too long ago to tell.
+ */
+static s32 ai_fence_retired_status(struct ai_device *dev, u64 fence)
+{
+    void *entry = xa_load(&dev->failed_fences, fence);
+    
+    if (entry)
+        return -(s32)xa_to_value(entry);
+    return fence <= dev->failed_floor ? AI_STATUS_INVALID : AI_STATUS_SUCCESS;
+}
+
+/* Caller holds ctx->lock; drops the context's reference */
+static void ai_job_retire(struct ai_context *ctx, struct ai_job *job)
+{
+    struct ai_device *dev = ctx->dev;
+    
+    list_del_init(&job->ctx_link);
+    ctx->num_jobs--;
+    
+    mutex_lock(&dev->lock);
+    idr_remove(&dev->job_idr, job->fence);
+    if (job->status != AI_STATUS_SUCCESS)
+        ai_fence_record_failure(dev, job->fence, job->status);
+    mutex_unlock(&dev->lock);
+    
+    ai_job_put(job);
+}
+
+/*
+ * Caller holds ctx->lock. Completed jobs stay waitable until retired; once a
+ * context has more than AI_MAX_PENDING of them, retire the oldest.
+ */
+static void ai_ctx_trim(struct ai_context *ctx)
+{
+    struct ai_job *job, *tmp;
+    
+    list_for_each_entry_safe(job, tmp, &ctx->jobs, ctx_link) {
+        if (ctx->num_jobs <= AI_MAX_PENDING)
+            break;
+        if (completion_done(&job->done))
+            ai_job_retire(ctx, job);
+    }
+}
+
+/*
+ * @usize is the size of the caller's struct ai_inference_request, from the
+ * ioctl number: fields it does not have read as 0 and are not written back,
+ * and a newer caller's extra fields must be 0.
+ */
+static int ai_ioctl_submit(struct ai_context *ctx, void __user *arg,
+                           size_t usize)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_inference_request req = {};
+    struct ai_job *in[AI_MAX_IN_FENCES];
+    struct ai_buffer *input, *output;
+    struct ai_model *model;
+    struct ai_job *job;
+    size_t ksize = min(usize, sizeof(req));
+    bool in_failed;
+    int num_in, i;
+    int ret;
+    
+    if (usize < AI_INFERENCE_REQUEST_SIZE_V0)
+        return -EINVAL;
+    if (copy_from_user(&req, arg, ksize))
+        return -EFAULT;
+    if (usize > sizeof(req)) {
+        ret = check_zeroed_user(arg + sizeof(req), usize - sizeof(req));
+        if (ret <= 0)
+            return ret ? ret : -E2BIG;
+    }
+    
+    if (req.reserved[0] || req.reserved[1])
+        return -EINVAL;
+    if (req.batch_size > dev->caps.max_batch_size ||
+        req.priority >= AI_PRIORITY_COUNT)
+        return -EINVAL;
+    
+    num_in = ai_job_lookup_in_fences(dev, req.in_fences, req.num_in_fences,
+                                     in, &in_failed);
+    if (num_in < 0)
+        return num_in;
+    
+    ret = -ENOMEM;
+    job = ai_job_alloc(ctx, req.flags, req.priority, req.timeout_ms, num_in, 3);
+    if (!job)
+        goto out_put_in;
+    job->dep_failed = in_failed;
+    
+    /* Validate handles and make them resident */
+    mutex_lock(&dev->lock);
+    model = idr_find(&dev->model_idr, req.model_handle);
+    input = idr_find(&dev->buffer_idr, req.input_handle);
+    output = idr_find(&dev->buffer_idr, req.output_handle);
+    if (!model || !input || !output || !ai_buffer_writable(output)) {
+        mutex_unlock(&dev->lock);
+        ret = -EINVAL;
+        goto out_put_job;
+    }
+    ai_job_add_obj(job, &model->obj);
+    ai_job_add_obj(job, &input->obj);
+    ai_job_add_obj(job, &output->obj);
+    ai_job_add_access(job, input, false);
+    ai_job_add_access(job, output, true);
+    if (simulate) {
+        job->remaining_ns = ai_sim_job_ns(model, &req);
+        job->copy_in_ns = ai_sim_dma_ns(req.input_size);
+        job->copy_out_ns = ai_sim_dma_ns(req.output_size);
+    }
+    job->duration_ns = job->copy_in_ns + job->remaining_ns + job->copy_out_ns;
+    job->model = model;
+    job->batch_items = max(req.batch_size, 1U);
+    ret = ai_job_pin_objs(dev, job);
+    mutex_unlock(&dev->lock);
+    if (ret)
+        goto out_put_job;
+    
+    job->bytes = (u64)req.input_size + req.output_size;
+    job->profile.memory_read = req.input_size;
+    job->profile.memory_write = req.output_size;
+    
+    ret = ai_job_publish(ctx, job, in, num_in, req.queue);
+    if (ret)
+        goto out_put_in;
+    
+    req.fence = job->fence;
+    ret = 0;
+    if (copy_to_user(arg, &req, ksize))
+        ret = -EFAULT;
+    
+    if (!ret)
+        ret = ai_job_wait_sync(job);
+    
+    pr_debug("ai_accel: inference submitted fence=%llu deps=%d modelled=%lluns\n",
+             job->fence, num_in, job->duration_ns);
+out_put_job:
+    ai_job_put(job);
+out_put_in:
+    for (i = 0; i < num_in; i++)
+        ai_job_put(in[i]);
+    return ret;
+}
+
+/*
+ * Command buffers
+ *
+ * The ops of a command buffer are validated and their host memory captured
+ * (COPY_IN) or pinned (COPY_OUT) at submit time. The whole buffer is then
+ * scheduled as one job: the engine is busy for the sum of the modelled op
+ * times, after which exec_wq applies the data side effects in order and
+ * signals the job's fence.
+ *
+ * COPY_IN data is captured into staging buffers from a per-context pool
+ * that keeps its buffers between submissions, so steady traffic allocates
+ * and faults in nothing. Small copies can skip staging altogether and
+ * carry their data inline in the command stream.
+ */
+
+/* Take a staging buffer of at least @size bytes, from the pool if possible */
+static struct ai_staging *ai_staging_get(struct ai_context *ctx, size_t size)
+{
+    struct ai_staging *st;
+    
+    mutex_lock(&ctx->staging_lock);
+    list_for_each_entry(st, &ctx->staging, link) {
+        if (st->size >= size) {
+            list_del(&st->link);
+            ctx->num_staging--;
+            ctx->staging_bytes -= st->size;
+            mutex_unlock(&ctx->staging_lock);
+            return st;
+        }
+    }
+    mutex_unlock(&ctx->staging_lock);
+    
+    /* Round up so that slowly growing requests still find a fit */
+    size = roundup_pow_of_two(max_t(size_t, size, PAGE_SIZE));
+    st = kvmalloc(struct_size(st, data, size), GFP_KERNEL);
+    if (st) {
+        st->size = size;
+        st->pooled = true;
+    }
+    return st;
+}
+
+/* A staging buffer of exactly @size bytes that is freed after use */
+static struct ai_staging *ai_staging_alloc(size_t size)
+{
+    struct ai_staging *st;
+    
+    st = kvmalloc(struct_size(st, data, size), GFP_KERNEL);
+    if (st) {
+        st->size = size;
+        st->pooled = false;
+    }
+    return st;
+}
+
+/*
+ * Return @st to the pool, smallest first. A full pool trades its smallest
+ * buffers for a larger one, so it grows towards the sizes in use, but never
+ * past AI_STAGING_POOL_MAX buffers or staging_pool_max_kb bytes.
+ */
+static void ai_staging_put(struct ai_context *ctx, struct ai_staging *st)
+{
+    u64 max_bytes = (u64)READ_ONCE(staging_pool_max_kb) << 10;
+    struct ai_staging *pos, *tmp;
+    LIST_HEAD(victims);
+    
+    if (!st->pooled || st->size > max_bytes) {
+        kvfree(st);
+        return;
+    }
+    
+    mutex_lock(&ctx->staging_lock);
+    while (ctx->num_staging >= AI_STAGING_POOL_MAX ||
+           ctx->staging_bytes + st->size > max_bytes) {
+        pos = list_first_entry(&ctx->staging, struct ai_staging, link);
+        if (pos->size >= st->size) {
+            list_add(&st->link, &victims);
+            goto out;
+        }
+        list_move(&pos->link, &victims);
+        ctx->num_staging--;
+        ctx->staging_bytes -= pos->size;
+    }
+    
+    list_for_each_entry(pos, &ctx->staging, link)
+        if (pos->size >= st->size)
+            break;
+    list_add_tail(&st->link, &pos->link);
+    ctx->num_staging++;
+    ctx->staging_bytes += st->size;
+out:
+    mutex_unlock(&ctx->staging_lock);
+    
+    list_for_each_entry_safe(pos, tmp, &victims, link)
+        kvfree(pos);
+}
+
+static void ai_staging_flush(struct ai_context *ctx)
+{
+    struct ai_staging *st, *tmp;
+    
+    mutex_lock(&ctx->staging_lock);
+    list_for_each_entry_safe(st, tmp, &ctx->staging, link)
+        kvfree(st);
+    INIT_LIST_HEAD(&ctx->staging);
+    ctx->num_staging = 0;
+    ctx->staging_bytes = 0;
+    mutex_unlock(&ctx->staging_lock);
+}
+
+/* Check that [offset, offset + size) lies within @buf */
+static bool ai_buffer_range_ok(const struct ai_buffer *buf, u64 offset, u64 size)
+{
+    return size <= buf->size && offset <= buf->size - size;
+}
+
+/* Entries after @cmd taken up by its inline data */
+static u64 ai_cmd_inline_slots(const struct ai_cmd *cmd)
+{
+    if (!(cmd->flags & AI_CMD_FLAG_INLINE))
+        return 0;
+    return DIV_ROUND_UP_ULL(cmd->copy.size, sizeof(*cmd));
+}
+
+/*
+ * Check the flags of @cmd, which is followed by @left more entries. Once this
+ * passes, ai_cmd_inline_slots(@cmd) <= @left.
+ */
+static int ai_cmd_check_flags(const struct ai_cmd *cmd, u32 left)
+{
+    if (cmd->flags & ~(AI_CMD_FLAG_INLINE | AI_CMD_FLAG_DEFER_READ))
+        return -EINVAL;
+    if ((cmd->flags & AI_CMD_FLAG_DEFER_READ) &&
+        (cmd->op != AI_CMD_COPY_IN || (cmd->flags & AI_CMD_FLAG_INLINE)))
+        return -EINVAL;
+    if (!(cmd->flags & AI_CMD_FLAG_INLINE))
+        return 0;
+    if (cmd->op != AI_CMD_COPY_IN || cmd->copy.size > AI_CMD_INLINE_MAX)
+        return -EINVAL;
+    if (ai_cmd_inline_slots(cmd) > left)
+        return -EINVAL;
+    return 0;
+}
+
+/* @cmd is followed by @left more entries */
+static int ai_cmd_parse_one(struct ai_device *dev, const struct ai_cmd *cmd,
+                            u32 left, struct ai_cmd_op *op, struct ai_job *job)
+{
+    struct ai_buffer *input, *output;
+    struct ai_model *model;
+    u64 handle, offset, size;
+    void __user *uptr;
+    int xfer, ret;
+    
+    ret = ai_cmd_check_flags(cmd, left);
+    if (ret)
+        return ret;
+    
+    op->op = cmd->op;
+    
+    switch (cmd->op) {
+    case AI_CMD_COPY_IN:
+    case AI_CMD_COPY_OUT:
+        handle = cmd->copy.handle;
+        offset = cmd->copy.offset;
+        size = cmd->copy.size;
+        break;
+    case AI_CMD_FILL:
+        handle = cmd->fill.handle;
+        offset = cmd->fill.offset;
+        size = cmd->fill.size;
+        op->value = cmd->fill.pattern & 0xff;
+        break;
+    case AI_CMD_SIGNAL:
+        if (!IS_ALIGNED(cmd->signal.offset, sizeof(u64)))
+            return -EINVAL;
+        handle = cmd->signal.handle;
+        offset = cmd->signal.offset;
+        size = sizeof(u64);
+        op->value = cmd->signal.value;
+        break;
+    case AI_CMD_RUN:
+        if (cmd->run.batch_size > dev->caps.max_batch_size)
+            return -EINVAL;
+        mutex_lock(&dev->lock);
+        model = idr_find(&dev->model_idr, cmd->run.model_handle);
+        input = idr_find(&dev->buffer_idr, cmd->run.input_handle);
+        output = idr_find(&dev->buffer_idr, cmd->run.output_handle);
+        if (!model || !input || !output || !ai_buffer_writable(output)) {
+            mutex_unlock(&dev->lock);
+            return -EINVAL;
+        }
+        ai_job_add_obj(job, &model->obj);
+        ai_job_add_obj(job, &input->obj);
+        ai_job_add_obj(job, &output->obj);
+        ai_job_add_access(job, input, false);
+        ai_job_add_access(job, output, true);
+        job->duration_ns += ai_sim_compute_ns(model->size, cmd->run.batch_size);
+        mutex_unlock(&dev->lock);
+        return 0;
+    case AI_CMD_BARRIER:
+        /* Ops already execute in order on a single engine */
+        return 0;
+    case AI_CMD_TIMELINE_WAIT:
+    case AI_CMD_TIMELINE_SIGNAL:
+        op->timeline = ai_timeline_fget(cmd->timeline.fd);
+        if (IS_ERR(op->timeline)) {
+            ret = PTR_ERR(op->timeline);
+            op->timeline = NULL;
+            return ret;
+        }
+        op->value = cmd->timeline.value;
+        INIT_LIST_HEAD(&op->tl_wait.link);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+    
+    if (size == 0)
+        return -EINVAL;
+    
+    mutex_lock(&dev->lock);
+    op->buf = idr_find(&dev->buffer_idr, handle);
+    if (op->buf)
+        ai_job_add_obj(job, &op->buf->obj);
+    mutex_unlock(&dev->lock);
+    if (!op->buf)
+        return -EINVAL;
+    if (!ai_buffer_range_ok(op->buf, offset, size))
+        return -EINVAL;
+    if (cmd->op != AI_CMD_COPY_OUT && !ai_buffer_writable(op->buf))
+        return -EINVAL;
+    ai_job_add_access(job, op->buf, cmd->op != AI_CMD_COPY_OUT);
+    op->offset = offset;
+    op->size = size;
+    
+    switch (cmd->op) {
+    case AI_CMD_COPY_IN:
+        uptr = u64_to_user_ptr(cmd->copy.user_ptr);
+        if (cmd->flags & AI_CMD_FLAG_INLINE) {
+            op->inline_data = cmd + 1;
+            xfer = AI_XFER_KIND_INLINE;
+        } else if (size <= job->xfer_pack_max && job->pack_area &&
+                   size <= job->pack_area->size - job->pack_used) {
+            void *dst = job->pack_area->data + job->pack_used;
+            
+            if (copy_from_user(dst, uptr, size))
+                return -EFAULT;
+            op->inline_data = dst;
+            job->pack_used += ALIGN(size, sizeof(u64));
+            xfer = AI_XFER_KIND_PACKED;
+        } else if ((cmd->flags & AI_CMD_FLAG_DEFER_READ) &&
+                   job->xfer_pin_min && size >= job->xfer_pin_min) {
+            /*
+             * Read when the job runs, as the caller allowed. The pin only
+             * lasts as long as the job, so it is neither long-term nor
+             * cached.
+             */
+            op->src = ai_pin_create(dev, cmd->copy.user_ptr, size,
+                                    DMA_TO_DEVICE, false);
+            if (IS_ERR(op->src)) {
+                op->src = NULL;
+                return -EFAULT;
+            }
+            xfer = AI_XFER_KIND_PINNED;
+        } else {
+            /* Too large to keep around; allocated for this copy alone */
+            if (size > job->xfer_bounce_max)
+                op->staging = ai_staging_alloc(size);
+            else
+                op->staging = ai_staging_get(job->ctx, size);
+            if (!op->staging)
+                return -ENOMEM;
+            if (copy_from_user(op->staging->data, uptr, size))
+                return -EFAULT;
+            xfer = AI_XFER_KIND_BOUNCE;
+        }
+        job->profile.xfer_strategies |= BIT(xfer);
+        atomic64_inc(&dev->xfer_count[xfer]);
+        atomic64_add(size, &dev->xfer_bytes[xfer]);
+        job->profile.memory_read += size;
+        break;
+    case AI_CMD_COPY_OUT:
+        op->dest = ai_pin_get(job->ctx, cmd->copy.user_ptr, size,
+                              DMA_BIDIRECTIONAL);
+        if (IS_ERR(op->dest)) {
+            op->dest = NULL;
+            return -EFAULT;
+        }
+        job->profile.memory_write += size;
+        break;
+    default:
+        break;
+    }
+    
+    if (cmd->op != AI_CMD_SIGNAL) {
+        job->duration_ns += ai_sim_dma_ns(size);
+        job->bytes += size;
+    }
+    
+    return 0;
+}
+
+static int ai_cmdbuf_parse(struct ai_device *dev, struct ai_job *job,
+                           const struct ai_cmdbuf_request *req)
+{
+    size_t pack_size = 0;
+    struct ai_cmd *cmds;
+    u32 i;
+    int ret = 0;
+    
+    cmds = memdup_user(u64_to_user_ptr(req->cmds),
+                       req->num_cmds * sizeof(*cmds));
+    if (IS_ERR(cmds))
+        return PTR_ERR(cmds);
+    
+    job->ops = kcalloc(req->num_cmds, sizeof(*job->ops), GFP_KERNEL);
+    if (!job->ops) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    /* One staging buffer holds all the small copies */
+    job->xfer_pack_max = READ_ONCE(xfer_pack_max);
+    job->xfer_bounce_max = (u64)READ_ONCE(xfer_bounce_max_kb) << 10;
+    job->xfer_pin_min = (u64)READ_ONCE(xfer_pin_min_kb) << 10;
+    for (i = 0; i < req->num_cmds; i++) {
+        /* Validate before skipping inline data, so i stays in bounds */
+        ret = ai_cmd_check_flags(&cmds[i], req->num_cmds - i - 1);
+        if (ret)
+            goto out;
+        if (cmds[i].op == AI_CMD_COPY_IN &&
+            !(cmds[i].flags & AI_CMD_FLAG_INLINE) &&
+            cmds[i].copy.size <= job->xfer_pack_max)
+            pack_size += ALIGN(cmds[i].copy.size, sizeof(u64));
+        i += ai_cmd_inline_slots(&cmds[i]);
+    }
+    if (pack_size) {
+        job->pack_area = ai_staging_get(job->ctx, pack_size);
+        if (!job->pack_area) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    
+    /* num_ops covers every op that may hold references */
+    for (i = 0; i < req->num_cmds; i++) {
+        struct ai_cmd_op *op = &job->ops[job->num_ops++];
+        
+        ret = ai_cmd_parse_one(dev, &cmds[i], req->num_cmds - i - 1, op, job);
+        if (ret)
+            goto out;
+        if (cmds[i].flags & AI_CMD_FLAG_INLINE)
+            job->cmds = cmds;
+        i += ai_cmd_inline_slots(&cmds[i]);
+    }
+    
+    job->duration_ns = simulate ?
+        ai_sim_jitter(sim_launch_ns + job->duration_ns) : 0;
+    job->remaining_ns = job->duration_ns;
+    
+    mutex_lock(&dev->lock);
+    ret = ai_job_pin_objs(dev, job);
+    mutex_unlock(&dev->lock);
+
+out:
+    /* The job frees the commands if it carries their inline data */
+    if (job->cmds != cmds)
+        kfree(cmds);
+    return ret;
+}
+
+/*
+ * Apply the data side effects of a command buffer. Real hardware would
+ * consume a translated command stream; the simulation uses the CPU.
+ */
+static void ai_cmdbuf_work(struct work_struct *work)
+{
+    struct ai_job *job = container_of(work, struct ai_job, work);
+    struct ai_device *adev = job->adev;
+    unsigned long flags;
+    u32 i;
+    
+    for (i = 0; i < job->num_ops; i++) {
+        struct ai_cmd_op *op = &job->ops[i];
+        u8 *dev_mem = op->buf ? (u8 *)op->buf->cpu_addr + op->offset : NULL;
+        
+        switch (op->op) {
+        case AI_CMD_COPY_IN:
+            if (op->staging) {
+                memcpy(dev_mem, op->staging->data, op->size);
+                ai_staging_put(job->ctx, op->staging);
+                op->staging = NULL;
+            } else if (op->src) {
+                memcpy(dev_mem, op->src->vaddr, op->size);
+            } else {
+                memcpy(dev_mem, op->inline_data, op->size);
+            }
+            break;
+        case AI_CMD_COPY_OUT:
+            memcpy(op->dest->vaddr, dev_mem, op->size);
+            break;
+        case AI_CMD_FILL:
+            memset(dev_mem, op->value, op->size);
+            break;
+        case AI_CMD_SIGNAL:
+            /* Everything before the signal must be visible first */
+            smp_wmb();
+            WRITE_ONCE(*(u64 *)dev_mem, op->value);
+            break;
+        case AI_CMD_TIMELINE_SIGNAL:
+            spin_lock_irqsave(&adev->sched_lock, flags);
+            ai_timeline_advance(op->timeline->private_data, op->value);
+            spin_unlock_irqrestore(&adev->sched_lock, flags);
+            break;
+        default:
+            /* RUN and BARRIER are covered by the engine time */
+            break;
+        }
+    }
+    
+    if (job->pack_area) {
+        ai_staging_put(job->ctx, job->pack_area);
+        job->pack_area = NULL;
+    }
+    
+    ai_engine_complete(&adev->engines[job->profile.engine_id], job);
+}
+
+static int ai_ioctl_submit_cmdbuf(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_cmdbuf_request req;
+    struct ai_job *in[AI_MAX_IN_FENCES];
+    struct ai_job *job;
+    bool in_failed;
+    int num_in, i;
+    int ret;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.num_cmds == 0 || req.num_cmds > AI_MAX_CMDS ||
+        req.priority >= AI_PRIORITY_COUNT)
+        return -EINVAL;
+    
+    num_in = ai_job_lookup_in_fences(dev, req.in_fences, req.num_in_fences,
+                                     in, &in_failed);
+    if (num_in < 0)
+        return num_in;
+    
+    ret = -ENOMEM;
+    job = ai_job_alloc(ctx, req.flags, req.priority, req.timeout_ms, num_in,
+                       req.num_cmds * 3);
+    if (!job)
+        goto out_put_in;
+    job->dep_failed = in_failed;
+    
+    ret = ai_cmdbuf_parse(dev, job, &req);
+    if (ret) {
+        ai_job_put(job);
+        goto out_put_in;
+    }
+    
+    ret = ai_job_publish(ctx, job, in, num_in, req.queue);
+    if (ret)
+        goto out_put_in;
+    
+    req.fence = job->fence;
+    ret = 0;
+    if (copy_to_user(arg, &req, sizeof(req)))
+        ret = -EFAULT;
+    
+    if (!ret)
+        ret = ai_job_wait_sync(job);
+    
+    pr_debug("ai_accel: command buffer submitted fence=%llu ops=%u modelled=%lluns\n",
+             job->fence, job->num_ops, job->duration_ns);
+    ai_job_put(job);
+
+out_put_in:
+    for (i = 0; i < num_in; i++)
+        ai_job_put(in[i]);
+    return ret;
+}
+
+/*
+ * Spin on @job for up to @budget_ns, giving up early for signals or when
+ * the CPU is wanted elsewhere. The spin runs in the waiter's context, so it
+ * shows up as its system time. Returns the time spent.
  */
-
-static int ai_ioctl_get_caps(struct ai_device *dev, void __user *arg)
+static u64 ai_job_busy_poll(struct ai_context *ctx, struct ai_job *job,
+                            u64 budget_ns)
 {
-    if (copy_to_user(arg, &dev->caps, sizeof(dev->caps)))
-        return -EFAULT;
-    return 0;
+    u64 start = ktime_get_ns();
+    u64 now = start;
+    bool done;
+    
+    while (!(done = completion_done(&job->done)) &&
+           now - start < budget_ns &&
+           !signal_pending(current) && !need_resched()) {
+        cpu_relax();
+        now = ktime_get_ns();
+    }
+    
+    atomic64_add(now - start, &ctx->busy_poll_ns);
+    atomic64_inc(done ? &ctx->busy_poll_hits : &ctx->busy_poll_misses);
+    return now - start;
 }
 
-static int ai_ioctl_alloc(struct ai_device *dev, void __user *arg)
+static int ai_ioctl_wait(struct ai_context *ctx, void __user *arg)
 {
-    struct ai_alloc_request req;
-    struct ai_buffer *buf;
-    int handle;
+    struct ai_device *dev = ctx->dev;
+    struct ai_wait_request req;
+    struct ai_job *job;
+    unsigned long timeout;
+    u64 timeout_ns, spent;
+    long ret;
     
     if (copy_from_user(&req, arg, sizeof(req)))
         return -EFAULT;
     
-    if (req.size == 0 || req.size > dev->caps.max_alloc_size)
+    if (req.fence == 0 || req.fence > (u64)atomic_read(&dev->fence_counter) ||
+        req.flags & ~AI_WAIT_BUSY_POLL)
         return -EINVAL;
     
-    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
-    if (!buf)
-        return -ENOMEM;
+    mutex_lock(&dev->lock);
+    job = idr_find(&dev->job_idr, req.fence);
+    if (job)
+        kref_get(&job->ref);
+    else
+        req.status = ai_fence_retired_status(dev, req.fence);
+    mutex_unlock(&dev->lock);
     
-    buf->size = req.size;
-    buf->flags = req.flags;
+    /* Already retired */
+    if (!job)
+        goto out;
     
-    if (simulate) {
-        /* Simulation: allocate regular memory */
-        buf->cpu_addr = vzalloc(req.size);
-        buf->dma_addr = (dma_addr_t)(unsigned long)buf->cpu_addr;
+    /* Short jobs finish sooner than a sleep and wakeup take */
+    timeout_ns = req.timeout_ns;
+    if (timeout_ns && (req.flags & AI_WAIT_BUSY_POLL) && wait_busy_poll_us) {
+        spent = ai_job_busy_poll(ctx, job,
+                                 min_t(u64, timeout_ns,
+                                       (u64)wait_busy_poll_us * NSEC_PER_USEC));
+        timeout_ns -= min(spent, timeout_ns);
+    }
+    
+    /* timeout_ns == 0 polls without sleeping */
+    timeout = min_t(u64, nsecs_to_jiffies64(timeout_ns), MAX_SCHEDULE_TIMEOUT);
+    if (timeout_ns)
+        ret = wait_for_completion_interruptible_timeout(&job->done,
+                                                        timeout ? timeout : 1);
+    else
+        ret = completion_done(&job->done);
+    
+    if (ret < 0) {
+        ai_job_put(job);
+        return ret;
+    }
+    
+    if (ret == 0) {
+        req.status = AI_STATUS_PENDING;
     } else {
-        /* Real: allocate DMA coherent memory */
-        buf->cpu_addr = dma_alloc_coherent(dev->dev, req.size,
-                                           &buf->dma_addr, GFP_KERNEL);
+        req.status = job->status;
+        /* The waiter has observed the result, the owner can let it go */
+        if (job->ctx == ctx) {
+            mutex_lock(&ctx->lock);
+            if (!list_empty(&job->ctx_link))
+                ai_job_retire(ctx, job);
+            mutex_unlock(&ctx->lock);
+        }
     }
+    ai_job_put(job);
     
-    if (!buf->cpu_addr) {
-        kfree(buf);
-        return -ENOMEM;
+out:
+    if (copy_to_user(arg, &req, sizeof(req)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Fences that are no longer pending; a NULL job was already retired */
+static u32 ai_jobs_done(struct ai_job **jobs, u32 count)
+{
+    u32 i, done = 0;
+    
+    for (i = 0; i < count; i++)
+        done += !jobs[i] || completion_done(&jobs[i]->done);
+    return done;
+}
+
+static int ai_ioctl_wait_multi(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_wait_multi_request req;
+    struct ai_job **jobs = NULL;
+    u64 *fences, last;
+    s32 *status = NULL;
+    unsigned long timeout;
+    u32 i, want;
+    long ret = 0;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    
+    if (req.num_fences == 0 || req.num_fences > AI_MAX_WAIT_FENCES ||
+        req.flags & ~AI_WAIT_ALL)
+        return -EINVAL;
+    
+    fences = memdup_user(u64_to_user_ptr(req.fences),
+                         req.num_fences * sizeof(*fences));
+    if (IS_ERR(fences))
+        return PTR_ERR(fences);
+    
+    jobs = kcalloc(req.num_fences, sizeof(*jobs), GFP_KERNEL);
+    status = kcalloc(req.num_fences, sizeof(*status), GFP_KERNEL);
+    if (!jobs || !status) {
+        ret = -ENOMEM;
+        goto out;
     }
     
+    last = atomic_read(&dev->fence_counter);
     mutex_lock(&dev->lock);
-    handle = idr_alloc(&dev->buffer_idr, buf, 1, 0, GFP_KERNEL);
-    mutex_unlock(&dev->lock);
-    
-    if (handle < 0) {
-        if (simulate)
-            vfree(buf->cpu_addr);
+    for (i = 0; i < req.num_fences; i++) {
+        if (fences[i] == 0 || fences[i] > last) {
+            ret = -EINVAL;
+            break;
+        }
+        jobs[i] = idr_find(&dev->job_idr, fences[i]);
+        if (jobs[i])
+            kref_get(&jobs[i]->ref);
         else
-            dma_free_coherent(dev->dev, buf->size, buf->cpu_addr, buf->dma_addr);
-        kfree(buf);
-        return handle;
+            status[i] = ai_fence_retired_status(dev, fences[i]);
     }
+    mutex_unlock(&dev->lock);
+    if (ret)
+        goto out;
     
-    req.handle = handle;
-    req.dma_addr = buf->dma_addr;
+    /* Every completion wakes fence_wq; the condition picks out ours */
+    want = (req.flags & AI_WAIT_ALL) ? req.num_fences : 1;
+    timeout = min_t(u64, nsecs_to_jiffies64(req.timeout_ns), MAX_SCHEDULE_TIMEOUT);
+    if (req.timeout_ns) {
+        ret = wait_event_interruptible_timeout(dev->fence_wq,
+                                               ai_jobs_done(jobs, req.num_fences) >= want,
+                                               timeout ? timeout : 1);
+        if (ret < 0)
+            goto out;
+        ret = 0;
+    }
     
-    if (copy_to_user(arg, &req, sizeof(req))) {
-        mutex_lock(&dev->lock);
-        idr_remove(&dev->buffer_idr, handle);
-        mutex_unlock(&dev->lock);
-        if (simulate)
-            vfree(buf->cpu_addr);
-        else
-            dma_free_coherent(dev->dev, buf->size, buf->cpu_addr, buf->dma_addr);
-        kfree(buf);
-        return -EFAULT;
+    req.num_signaled = 0;
+    req.first_signaled = req.num_fences;
+    mutex_lock(&ctx->lock);
+    for (i = 0; i < req.num_fences; i++) {
+        struct ai_job *job = jobs[i];
+        
+        if (job && !completion_done(&job->done)) {
+            status[i] = AI_STATUS_PENDING;
+            continue;
+        }
+        
+        if (job)
+            status[i] = job->status;
+        req.num_signaled++;
+        req.first_signaled = min(req.first_signaled, i);
+        /* As with AI_IOC_WAIT, an observed result lets the owner retire it */
+        if (job && job->ctx == ctx && !list_empty(&job->ctx_link))
+            ai_job_retire(ctx, job);
     }
+    mutex_unlock(&ctx->lock);
     
-    pr_debug("ai_accel: allocated buffer handle=%d size=%llu\n", handle, req.size);
-    return 0;
+    if (copy_to_user(u64_to_user_ptr(req.statuses), status,
+                     req.num_fences * sizeof(*status)) ||
+        copy_to_user(arg, &req, sizeof(req)))
+        ret = -EFAULT;
+    
+out:
+    if (jobs) {
+        for (i = 0; i < req.num_fences; i++)
+            if (jobs[i])
+                ai_job_put(jobs[i]);
+    }
+    kfree(status);
+    kfree(jobs);
+    kfree(fences);
+    return ret;
 }
 
-static int ai_ioctl_free(struct ai_device *dev, void __user *arg)
+static int ai_ioctl_timeline_create(struct ai_device *dev, void __user *arg)
 {
-    struct ai_free_request req;
-    struct ai_buffer *buf;
+    struct ai_timeline_request req;
+    struct ai_timeline *tl;
+    int fd;
     
     if (copy_from_user(&req, arg, sizeof(req)))
         return -EFAULT;
+    if (req.flags & ~AI_TIMELINE_CLOEXEC)
+        return -EINVAL;
     
-    mutex_lock(&dev->lock);
-    buf = idr_find(&dev->buffer_idr, req.handle);
-    if (buf) {
-        idr_remove(&dev->buffer_idr, req.handle);
+    tl = kzalloc(sizeof(*tl), GFP_KERNEL);
+    if (!tl)
+        return -ENOMEM;
+    tl->dev = dev;
+    tl->value = req.value;
+    INIT_LIST_HEAD(&tl->waits);
+    init_waitqueue_head(&tl->wq);
+    
+    fd = anon_inode_getfd("ai_timeline", &ai_timeline_fops, tl,
+                          O_RDWR | ((req.flags & AI_TIMELINE_CLOEXEC) ? O_CLOEXEC : 0));
+    if (fd < 0) {
+        kfree(tl);
+        return fd;
     }
-    mutex_unlock(&dev->lock);
     
-    if (!buf)
+    req.fd = fd;
+    if (copy_to_user(arg, &req, sizeof(req)))
+        return -EFAULT;
+    return 0;
+}
+
+static int ai_ioctl_timeline_signal(struct ai_device *dev, void __user *arg)
+{
+    struct ai_timeline_request req;
+    struct ai_timeline *tl;
+    struct file *file;
+    unsigned long flags;
+    int ret = 0;
+    
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.flags)
         return -EINVAL;
     
-    if (simulate)
-        vfree(buf->cpu_addr);
+    file = ai_timeline_fget(req.fd);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+    tl = file->private_data;
+    
+    /* The value only moves forward */
+    spin_lock_irqsave(&dev->sched_lock, flags);
+    if (req.value <= tl->value)
+        ret = -EINVAL;
     else
-        dma_free_coherent(dev->dev, buf->size, buf->cpu_addr, buf->dma_addr);
-    kfree(buf);
+        ai_timeline_advance(tl, req.value);
+    spin_unlock_irqrestore(&dev->sched_lock, flags);
     
-    pr_debug("ai_accel: freed buffer handle=%llu\n", req.handle);
-    return 0;
+    fput(file);
+    return ret;
 }
 
-static int ai_ioctl_load_model(struct ai_device *dev, void __user *arg)
+static int ai_ioctl_timeline_wait(struct ai_device *dev, void __user *arg)
 {
-    struct ai_load_model_request req;
-    struct ai_model *model;
-    int handle;
+    struct ai_timeline_request req;
+    struct ai_timeline *tl;
+    struct file *file;
+    unsigned long timeout;
+    long ret = 0;
     
     if (copy_from_user(&req, arg, sizeof(req)))
         return -EFAULT;
-    
-    if (req.model_size == 0 || req.model_size > dev->caps.max_alloc_size)
+    if (req.flags)
         return -EINVAL;
     
-    model = kzalloc(sizeof(*model), GFP_KERNEL);
-    if (!model)
-        return -ENOMEM;
+    file = ai_timeline_fget(req.fd);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+    tl = file->private_data;
     
-    model->size = req.model_size;
-    model->flags = req.flags;
-    model->data = vmalloc(req.model_size);
+    /* timeout_ns == 0 just reads the value */
+    timeout = min_t(u64, nsecs_to_jiffies64(req.timeout_ns), MAX_SCHEDULE_TIMEOUT);
+    if (req.timeout_ns)
+        ret = wait_event_interruptible_timeout(tl->wq,
+                                               READ_ONCE(tl->value) >= req.value,
+                                               timeout ? timeout : 1);
     
-    if (!model->data) {
-        kfree(model);
-        return -ENOMEM;
-    }
+    req.value = READ_ONCE(tl->value);
+    fput(file);
+    if (ret < 0)
+        return ret;
     
-    if (copy_from_user(model->data, (void __user *)req.model_data, req.model_size)) {
-        vfree(model->data);
-        kfree(model);
+    if (copy_to_user(arg, &req, sizeof(req)))
         return -EFAULT;
-    }
+    return 0;
+}
+
+static int ai_ioctl_create_queue(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_device *dev = ctx->dev;
+    struct ai_queue_request req;
+    struct ai_queue *queue;
+    int id;
     
-    mutex_lock(&dev->lock);
-    handle = idr_alloc(&dev->model_idr, model, 1, 0, GFP_KERNEL);
-    mutex_unlock(&dev->lock);
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
     
-    if (handle < 0) {
-        vfree(model->data);
-        kfree(model);
-        return handle;
+    if (req.flags || req.priority >= AI_PRIORITY_COUNT ||
+        req.engine_mask & ~GENMASK(dev->num_engines - 1, 0))
+        return -EINVAL;
+    
+    queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+    if (!queue)
+        return -ENOMEM;
+    kref_init(&queue->ref);
+    mutex_init(&queue->lock);
+    queue->priority = req.priority;
+    queue->engine_mask = req.engine_mask;
+    
+    mutex_lock(&ctx->lock);
+    id = idr_alloc(&ctx->queues, queue, 1, AI_MAX_QUEUES + 1, GFP_KERNEL);
+    mutex_unlock(&ctx->lock);
+    if (id < 0) {
+        ai_queue_put(queue);
+        return id;
     }
     
-    req.model_handle = handle;
+    req.queue = id;
+    if (copy_to_user(arg, &req, sizeof(req)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Jobs already submitted to the queue are not affected */
+static int ai_ioctl_destroy_queue(struct ai_context *ctx, void __user *arg)
+{
+    struct ai_queue_request req;
+    struct ai_queue *queue;
     
-    if (copy_to_user(arg, &req, sizeof(req))) {
-        mutex_lock(&dev->lock);
-        idr_remove(&dev->model_idr, handle);
-        mutex_unlock(&dev->lock);
-        vfree(model->data);
-        kfree(model);
+    if (copy_from_user(&req, arg, sizeof(req)))
         return -EFAULT;
-    }
     
-    pr_debug("ai_accel: loaded model handle=%d size=%llu\n", handle, req.model_size);
+    mutex_lock(&ctx->lock);
+    queue = idr_remove(&ctx->queues, req.queue);
+    mutex_unlock(&ctx->lock);
+    if (!queue)
+        return -ENOENT;
+    
+    ai_queue_put(queue);
     return 0;
 }
 
-static int ai_ioctl_submit(struct ai_device *dev, void __user *arg)
+static int ai_ioctl_set_coalesce(struct ai_context *ctx, void __user *arg)
 {
-    struct ai_inference_request req;
-    u64 fence;
-    ktime_t start, end;
+    struct ai_device *dev = ctx->dev;
+    struct ai_coalesce_request req;
+    unsigned long flags;
     
     if (copy_from_user(&req, arg, sizeof(req)))
         return -EFAULT;
     
-    /* Validate handles */
-    mutex_lock(&dev->lock);
-    if (!idr_find(&dev->model_idr, req.model_handle) ||
-        !idr_find(&dev->buffer_idr, req.input_handle) ||
-        !idr_find(&dev->buffer_idr, req.output_handle)) {
-        mutex_unlock(&dev->lock);
+    /* Without a time bound a quiet context would never be woken */
+    if (req.max_jobs > AI_MAX_PENDING || req.max_usecs > AI_COALESCE_MAX_US ||
+        (req.max_jobs > 1 && !req.max_usecs))
         return -EINVAL;
-    }
-    mutex_unlock(&dev->lock);
     
-    /* Generate fence */
-    fence = atomic_inc_return(&dev->fence_counter);
+    spin_lock_irqsave(&dev->sched_lock, flags);
+    ctx->coalesce_jobs = req.max_jobs;
+    ctx->coalesce_us = req.max_usecs;
+    /* Jobs held back under the old setting are woken now */
+    ai_ctx_flush_completions(ctx);
+    spin_unlock_irqrestore(&dev->sched_lock, flags);
     
-    /* Simulate inference (in real driver, this would be async) */
-    start = ktime_get();
+    return 0;
+}
+
+/* Profile of a job that has not been retired yet */
+static int ai_ioctl_get_profile(struct ai_device *dev, void __user *arg)
+{
+    struct ai_profile_data prof;
+    struct ai_job *job;
+    unsigned long flags;
     
-    if (simulate) {
-        /* Simulate some processing time */
-        usleep_range(100, 200);
-    } else {
-        /* Real implementation would:
-         * 1. Build command buffer
-         * 2. Submit to hardware
-         * 3. Wait for completion (or return for async)
-         */
-    }
+    if (copy_from_user(&prof, arg, sizeof(prof)))
+        return -EFAULT;
     
-    end = ktime_get();
+    mutex_lock(&dev->lock);
+    job = idr_find(&dev->job_idr, prof.fence);
+    if (job)
+        kref_get(&job->ref);
+    mutex_unlock(&dev->lock);
     
-    atomic64_inc(&dev->total_inferences);
-    atomic64_add(req.input_size + req.output_size, &dev->total_bytes_processed);
+    if (!job)
+        return -ENOENT;
     
-    req.fence = fence;
+    spin_lock_irqsave(&dev->sched_lock, flags);
+    prof = job->profile;
+    spin_unlock_irqrestore(&dev->sched_lock, flags);
+    ai_job_put(job);
     
-    if (copy_to_user(arg, &req, sizeof(req)))
+    if (copy_to_user(arg, &prof, sizeof(prof)))
         return -EFAULT;
-    
-    pr_debug("ai_accel: inference submitted fence=%llu duration=%lldns\n",
-             fence, ktime_to_ns(ktime_sub(end, start)));
     return 0;
 }
 
 static long ai_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-    struct ai_device *dev = file->private_data;
+    struct ai_context *ctx = file->private_data;
+    struct ai_device *dev = ctx->dev;
     void __user *uarg = (void __user *)arg;
     
     if (_IOC_TYPE(cmd) != AI_IOC_MAGIC)
@@ -341,27 +4201,117 @@ static long ai_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
     if (_IOC_NR(cmd) > AI_IOC_MAXNR)
         return -ENOTTY;
     
+    /* Any size of struct ai_inference_request an application was built with */
+    if (_IOC_NR(cmd) == _IOC_NR(AI_IOC_SUBMIT) &&
+        _IOC_DIR(cmd) == (_IOC_READ | _IOC_WRITE))
+        return ai_ioctl_submit(ctx, uarg, _IOC_SIZE(cmd));
+    
     switch (cmd) {
     case AI_IOC_GET_CAPS:
         return ai_ioctl_get_caps(dev, uarg);
     case AI_IOC_ALLOC:
-        return ai_ioctl_alloc(dev, uarg);
+        return ai_ioctl_alloc(ctx, uarg);
     case AI_IOC_FREE:
         return ai_ioctl_free(dev, uarg);
     case AI_IOC_LOAD_MODEL:
-        return ai_ioctl_load_model(dev, uarg);
-    case AI_IOC_SUBMIT:
-        return ai_ioctl_submit(dev, uarg);
+        return ai_ioctl_load_model(ctx, uarg);
+    case AI_IOC_UNLOAD_MODEL:
+        return ai_ioctl_unload_model(dev, uarg);
+    case AI_IOC_WAIT:
+        return ai_ioctl_wait(ctx, uarg);
+    case AI_IOC_GET_PROFILE:
+        return ai_ioctl_get_profile(dev, uarg);
+    case AI_IOC_SUBMIT_CMDBUF:
+        return ai_ioctl_submit_cmdbuf(ctx, uarg);
+    case AI_IOC_EXPORT_BUFFER:
+        return ai_ioctl_export(dev, uarg);
+    case AI_IOC_IMPORT_BUFFER:
+        return ai_ioctl_import(dev, uarg);
+    case AI_IOC_REGISTER_USERPTR:
+        return ai_ioctl_register_userptr(ctx, uarg);
+    case AI_IOC_SET_COALESCE:
+        return ai_ioctl_set_coalesce(ctx, uarg);
+    case AI_IOC_WAIT_MULTI:
+        return ai_ioctl_wait_multi(ctx, uarg);
+    case AI_IOC_TIMELINE_CREATE:
+        return ai_ioctl_timeline_create(dev, uarg);
+    case AI_IOC_TIMELINE_SIGNAL:
+        return ai_ioctl_timeline_signal(dev, uarg);
+    case AI_IOC_TIMELINE_WAIT:
+        return ai_ioctl_timeline_wait(dev, uarg);
+    case AI_IOC_CREATE_QUEUE:
+        return ai_ioctl_create_queue(ctx, uarg);
+    case AI_IOC_DESTROY_QUEUE:
+        return ai_ioctl_destroy_queue(ctx, uarg);
     default:
         return -ENOTTY;
     }
 }
 
+/* Map the device or the context status page, read-only */
 static int ai_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    /* Allow mapping device memory/buffers to userspace */
-    /* Implementation depends on actual use case */
-    return -ENOSYS;
+    struct ai_context *ctx = file->private_data;
+    u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+    void *page;
+    
+    if (offset == AI_MMAP_DEVICE_STATUS)
+        page = ctx->dev->status;
+    else if (offset == AI_MMAP_CONTEXT_STATUS)
+        page = ctx->status;
+    else
+        return -EINVAL;
+    
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    
+    /* The mapping holds the file, so the context page outlives it */
+    return remap_pfn_range(vma, vma->vm_start, PHYS_PFN(virt_to_phys(page)),
+                           PAGE_SIZE, vma->vm_page_prot);
+}
+
+static void ai_show_fdinfo(struct seq_file *m, struct file *file)
+{
+    struct ai_context *ctx = file->private_data;
+    struct ai_device *dev = ctx->dev;
+    u64 batches, held;
+    unsigned long flags;
+    u32 jobs, us;
+    
+    mutex_lock(&dev->lock);
+    seq_printf(m, "ai-mem-used:\t%llu\n", ctx->mem->used);
+    seq_printf(m, "ai-mem-peak:\t%llu\n", ctx->mem->peak);
+    seq_printf(m, "ai-mem-soft-limit:\t%llu\n", (u64)ctx_mem_soft_mb << 20);
+    seq_printf(m, "ai-mem-hard-limit:\t%llu\n", (u64)ctx_mem_hard_mb << 20);
+    seq_printf(m, "ai-uid-mem-used:\t%llu\n", ctx->user_mem->used);
+    mutex_unlock(&dev->lock);
+    
+    spin_lock_irqsave(&dev->sched_lock, flags);
+    jobs = ctx->coalesce_jobs;
+    us = ctx->coalesce_us;
+    batches = ctx->coalesce_batches;
+    held = ctx->coalesce_held;
+    spin_unlock_irqrestore(&dev->sched_lock, flags);
+    
+    seq_printf(m, "ai-coalesce-jobs:\t%u\n", jobs);
+    seq_printf(m, "ai-coalesce-usecs:\t%u\n", us);
+    seq_printf(m, "ai-coalesce-batches:\t%llu\n", batches);
+    seq_printf(m, "ai-coalesce-held:\t%llu\n", held);
+    mutex_lock(&ctx->staging_lock);
+    seq_printf(m, "ai-staging-pool:\t%llu\n", ctx->staging_bytes);
+    mutex_unlock(&ctx->staging_lock);
+    seq_printf(m, "ai-busy-poll-ns:\t%lld\n", atomic64_read(&ctx->busy_poll_ns));
+    seq_printf(m, "ai-busy-poll-hits:\t%lld\n",
+               atomic64_read(&ctx->busy_poll_hits));
+    seq_printf(m, "ai-busy-poll-misses:\t%lld\n",
+               atomic64_read(&ctx->busy_poll_misses));
 }
 
 static const struct file_operations ai_fops = {
@@ -372,6 +4322,7 @@ static const struct file_operations ai_fops = {
     .write          = ai_write,
     .unlocked_ioctl = ai_ioctl,
     .mmap           = ai_mmap,
+    .show_fdinfo    = ai_show_fdinfo,
 };
 
 /*
@@ -395,9 +4346,58 @@ static ssize_t total_inferences_show(struct device *dev,
 }
 static DEVICE_ATTR_RO(total_inferences);
 
+/* Device memory counters, all under ai_dev->lock */
+#define AI_MEM_ATTR(_name, _field)                                          \
+static ssize_t _name##_show(struct device *dev,                             \
+                            struct device_attribute *attr, char *buf)       \
+{                                                                           \
+    u64 val;                                                                \
+                                                                            \
+    mutex_lock(&ai_dev->lock);                                              \
+    val = ai_dev->_field;                                                   \
+    mutex_unlock(&ai_dev->lock);                                            \
+                                                                            \
+    return sprintf(buf, "%llu\n", val);                                    \
+}                                                                           \
+static DEVICE_ATTR_RO(_name)
+
+AI_MEM_ATTR(mem_used, mem_used);
+AI_MEM_ATTR(mem_throttled, mem_throttled);
+AI_MEM_ATTR(mem_resident, mem_resident);
+AI_MEM_ATTR(mem_evictions, mem_evictions);
+AI_MEM_ATTR(mem_restores, mem_restores);
+AI_MEM_ATTR(mem_bytes_evicted, mem_bytes_evicted);
+AI_MEM_ATTR(mem_bytes_restored, mem_bytes_restored);
+
+/* One "uid used peak" line per user with charged device memory */
+static ssize_t mem_users_show(struct device *dev, struct device_attribute *attr,
+                              char *buf)
+{
+    struct ai_mem_account *acct;
+    int len = 0;
+    
+    mutex_lock(&ai_dev->lock);
+    list_for_each_entry(acct, &ai_dev->mem_users, link)
+        len += sysfs_emit_at(buf, len, "%u %llu %llu\n",
+                             from_kuid_munged(&init_user_ns, acct->uid),
+                             acct->used, acct->peak);
+    mutex_unlock(&ai_dev->lock);
+    
+    return len;
+}
+static DEVICE_ATTR_RO(mem_users);
+
 static struct attribute *ai_attrs[] = {
     &dev_attr_version.attr,
     &dev_attr_total_inferences.attr,
+    &dev_attr_mem_used.attr,
+    &dev_attr_mem_throttled.attr,
+    &dev_attr_mem_resident.attr,
+    &dev_attr_mem_evictions.attr,
+    &dev_attr_mem_restores.attr,
+    &dev_attr_mem_bytes_evicted.attr,
+    &dev_attr_mem_bytes_restored.attr,
+    &dev_attr_mem_users.attr,
     NULL
 };
 
@@ -405,10 +4405,233 @@ static struct attribute_group ai_attr_group = {
     .attrs = ai_attrs,
 };
 
+/*
+ * Debugfs
+ */
+
+static int ai_flight_recorder_show(struct seq_file *m, void *unused)
+{
+    struct ai_device *adev = m->private;
+    struct ai_job_record *recs;
+    unsigned int head, n, i;
+    unsigned long flags;
+    u64 resets;
+    
+    recs = kmalloc_array(AI_FLIGHT_RECORDS, sizeof(*recs), GFP_KERNEL);
+    if (!recs)
+        return -ENOMEM;
+    
+    /* Snapshot so printing does not hold up job completion */
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    memcpy(recs, adev->flight, AI_FLIGHT_RECORDS * sizeof(*recs));
+    head = adev->flight_head;
+    n = min_t(u64, adev->flight_count, AI_FLIGHT_RECORDS);
+    resets = adev->engine_resets;
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    
+    seq_printf(m, "engine_resets: %llu\n", resets);
+    seq_puts(m, "fence      pid      eng prio status preempt  queue_us    run_us  model_us\n");
+    
+    /* Oldest first */
+    for (i = 0; i < n; i++) {
+        const struct ai_job_record *r =
+            &recs[(head + AI_FLIGHT_RECORDS - n + i) % AI_FLIGHT_RECORDS];
+        
+        seq_printf(m, "%-10llu %-8d %3u %4u %6d %7u %9llu %9llu %9llu\n",
+                   r->fence, r->pid, r->engine_id, r->priority, r->status,
+                   r->preemptions,
+                   div_u64(r->start_ns - r->submit_ns, NSEC_PER_USEC),
+                   div_u64(r->end_ns - r->start_ns, NSEC_PER_USEC),
+                   div_u64(r->duration_ns, NSEC_PER_USEC));
+    }
+    
+    kfree(recs);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ai_flight_recorder);
+
+static int ai_pin_cache_show(struct seq_file *m, void *unused)
+{
+    struct ai_device *adev = m->private;
+    
+    seq_printf(m, "hits: %lld\n", atomic64_read(&adev->pin_hits));
+    seq_printf(m, "misses: %lld\n", atomic64_read(&adev->pin_misses));
+    seq_printf(m, "invalidations: %lld\n",
+               atomic64_read(&adev->pin_invalidations));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ai_pin_cache);
+
+/* Time each engine stage has been busy, and its share of the time since load */
+static int ai_engines_show(struct seq_file *m, void *unused)
+{
+    static const char * const names[AI_STAGE_COUNT] = {
+        "copy_in", "compute", "copy_out",
+    };
+    struct ai_device *adev = m->private;
+    u64 busy[AI_STAGE_COUNT];
+    unsigned int queued, ready, drain;
+    unsigned long flags;
+    u64 elapsed;
+    ktime_t now;
+    u32 i;
+    int s;
+    
+    seq_printf(m, "copy_overlap: %d\n", copy_overlap);
+    spin_lock_irqsave(&adev->sched_lock, flags);
+    seq_printf(m, "batch_max: %u window_us: %u dispatches: %llu merged: %llu\n",
+               batch_max, batch_window_us, adev->batch_dispatches,
+               adev->batch_merged);
+    spin_unlock_irqrestore(&adev->sched_lock, flags);
+    seq_puts(m, "engine queued ready drain stage      busy_ms  busy%\n");
+    
+    for (i = 0; i < adev->num_engines; i++) {
+        struct ai_engine *eng = &adev->engines[i];
+        
+        spin_lock_irqsave(&adev->sched_lock, flags);
+        now = ktime_get();
+        memcpy(busy, eng->busy_ns, sizeof(busy));
+        if (eng->copy_in.job)
+            busy[AI_STAGE_COPY_IN] +=
+                ktime_to_ns(ktime_sub(now, eng->copy_in.start));
+        if (eng->active)
+            busy[AI_STAGE_COMPUTE] +=
+                ktime_to_ns(ktime_sub(now, eng->slice_start));
+        if (eng->copy_out.job)
+            busy[AI_STAGE_COPY_OUT] +=
+                ktime_to_ns(ktime_sub(now, eng->copy_out.start));
+        queued = eng->queued;
+        ready = eng->num_ready;
+        drain = eng->num_drain;
+        spin_unlock_irqrestore(&adev->sched_lock, flags);
+        
+        elapsed = max_t(u64, ktime_to_ns(ktime_sub(now, adev->engines_start)), 1);
+        for (s = 0; s < AI_STAGE_COUNT; s++)
+            seq_printf(m, "%6u %6u %5u %5u %-8s %9llu %5llu\n",
+                       eng->id, queued, ready, drain, names[s],
+                       div_u64(busy[s], NSEC_PER_MSEC),
+                       div64_u64(busy[s] * 100, elapsed));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ai_engines);
+
+static int ai_transfers_show(struct seq_file *m, void *unused)
+{
+    static const char * const names[AI_XFER_KINDS] = {
+        "inline", "bounce", "pinned", "packed",
+    };
+    struct ai_device *adev = m->private;
+    int k;
+    
+    seq_printf(m, "pack_max: %u\n", xfer_pack_max);
+    seq_printf(m, "pin_min_kb: %u\n", xfer_pin_min_kb);
+    for (k = 0; k < AI_XFER_KINDS; k++)
+        seq_printf(m, "%s: %lld copies, %lld bytes\n", names[k],
+                   atomic64_read(&adev->xfer_count[k]),
+                   atomic64_read(&adev->xfer_bytes[k]));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ai_transfers);
+
+static void ai_debugfs_init(struct ai_device *adev)
+{
+    adev->debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+    debugfs_create_file("flight_recorder", 0444, adev->debugfs, adev,
+                        &ai_flight_recorder_fops);
+    debugfs_create_file("pin_cache", 0444, adev->debugfs, adev,
+                        &ai_pin_cache_fops);
+    debugfs_create_file("engines", 0444, adev->debugfs, adev,
+                        &ai_engines_fops);
+    debugfs_create_file("transfers", 0444, adev->debugfs, adev,
+                        &ai_transfers_fops);
+}
+
 /*
  * Module init/exit
  */
 
+static void ai_copy_stage_init(struct ai_engine *eng, struct ai_copy_stage *st,
+                               enum ai_stage stage)
+{
+    st->eng = eng;
+    st->stage = stage;
+    hrtimer_init(&st->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    st->timer.function = ai_copy_timer_fn;
+}
+
+static int ai_engines_init(struct ai_device *adev, u32 count)
+{
+    u32 i;
+    int r;
+    
+    INIT_DELAYED_WORK(&adev->watchdog, ai_watchdog_work);
+    
+    adev->flight = kcalloc(AI_FLIGHT_RECORDS, sizeof(*adev->flight),
+                           GFP_KERNEL);
+    if (!adev->flight)
+        return -ENOMEM;
+    
+    adev->exec_wq = alloc_workqueue("ai_accel_exec", WQ_UNBOUND, 0);
+    if (!adev->exec_wq)
+        goto err_flight;
+    
+    adev->engines = kcalloc(count, sizeof(*adev->engines), GFP_KERNEL);
+    if (!adev->engines)
+        goto err_wq;
+    
+    for (i = 0; i < count; i++) {
+        struct ai_engine *eng = &adev->engines[i];
+        
+        eng->adev = adev;
+        eng->id = i;
+        for (r = 0; r < AI_RANK_COUNT; r++) {
+            INIT_LIST_HEAD(&eng->queue[r]);
+            INIT_LIST_HEAD(&eng->ready[r]);
+        }
+        INIT_LIST_HEAD(&eng->drain);
+        hrtimer_init(&eng->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+        eng->timer.function = ai_engine_timer_fn;
+        hrtimer_init(&eng->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+        eng->batch_timer.function = ai_batch_timer_fn;
+        ai_copy_stage_init(eng, &eng->copy_in, AI_STAGE_COPY_IN);
+        ai_copy_stage_init(eng, &eng->copy_out, AI_STAGE_COPY_OUT);
+    }
+    adev->num_engines = count;
+    adev->engines_start = ktime_get();
+    
+    return 0;
+
+err_wq:
+    destroy_workqueue(adev->exec_wq);
+    adev->exec_wq = NULL;
+err_flight:
+    kfree(adev->flight);
+    adev->flight = NULL;
+    return -ENOMEM;
+}
+
+static void ai_engines_fini(struct ai_device *adev)
+{
+    u32 i;
+    
+    cancel_delayed_work_sync(&adev->watchdog);
+    for (i = 0; i < adev->num_engines; i++) {
+        hrtimer_cancel(&adev->engines[i].timer);
+        hrtimer_cancel(&adev->engines[i].copy_in.timer);
+        hrtimer_cancel(&adev->engines[i].copy_out.timer);
+        hrtimer_cancel(&adev->engines[i].batch_timer);
+    }
+    if (adev->exec_wq)
+        destroy_workqueue(adev->exec_wq);
+    adev->exec_wq = NULL;
+    kfree(adev->engines);
+    adev->engines = NULL;
+    adev->num_engines = 0;
+    kfree(adev->flight);
+    adev->flight = NULL;
+}
+
 static int __init ai_accel_init(void)
 {
     int ret;
@@ -424,10 +4647,19 @@ static int __init ai_accel_init(void)
     mutex_init(&ai_dev->lock);
     idr_init(&ai_dev->buffer_idr);
     idr_init(&ai_dev->model_idr);
+    idr_init(&ai_dev->job_idr);
+    xa_init(&ai_dev->failed_fences);
+    spin_lock_init(&ai_dev->sched_lock);
+    init_waitqueue_head(&ai_dev->fence_wq);
+    INIT_LIST_HEAD(&ai_dev->mem_users);
+    INIT_LIST_HEAD(&ai_dev->mem_lru);
     atomic_set(&ai_dev->fence_counter, 0);
     atomic64_set(&ai_dev->total_inferences, 0);
     atomic64_set(&ai_dev->total_bytes_processed, 0);
     
+    /* Engines beyond what the status page describes are not used */
+    num_engines = clamp(num_engines, 1, AI_STATUS_MAX_ENGINES);
+    
     /* Set capabilities */
     ai_dev->caps.version = DRIVER_VERSION;
     ai_dev->caps.hw_version = simulate ? 0 : 0x100;
@@ -437,6 +4669,22 @@ static int __init ai_accel_init(void)
     ai_dev->caps.max_alloc_size = 256ULL << 20;  /* 256 MB */
     ai_dev->caps.features = AI_FEAT_FP32 | AI_FEAT_FP16 | AI_FEAT_INT8 | AI_FEAT_BATCH;
     
+    BUILD_BUG_ON(sizeof(struct ai_device_status) > PAGE_SIZE);
+    BUILD_BUG_ON(sizeof(struct ai_context_status) > PAGE_SIZE);
+    ai_dev->status = (struct ai_device_status *)get_zeroed_page(GFP_KERNEL);
+    if (!ai_dev->status) {
+        ret = -ENOMEM;
+        goto err_status;
+    }
+    ai_dev->status->version = AI_STATUS_VERSION;
+    ai_dev->status->num_engines = num_engines;
+    ai_dev->status->caps = ai_dev->caps;
+    ai_status_mem(ai_dev);
+    
+    ret = ai_engines_init(ai_dev, num_engines);
+    if (ret)
+        goto err_engines;
+    
     /* Allocate device number */
     ret = alloc_chrdev_region(&ai_dev_number, 0, 1, DRIVER_NAME);
     if (ret < 0) {
@@ -470,12 +4718,28 @@ static int __init ai_accel_init(void)
         goto err_device;
     }
     
+    /*
+     * The class device stands in for the hardware in DMA mappings. Without
+     * dma_parms segments would be capped at 64 KB.
+     */
+    ai_dev->dev->dma_mask = &ai_dev->dev->coherent_dma_mask;
+    ai_dev->dev->dma_parms = &ai_dev->dma_parms;
+    if (dma_set_mask_and_coherent(ai_dev->dev, DMA_BIT_MASK(64)) ||
+        dma_set_max_seg_size(ai_dev->dev, UINT_MAX))
+        pr_warn("ai_accel: failed to set DMA parameters\n");
+    
+    /* Copy engines: dmaengine channels, or the CPU when there are none */
+    if (ai_dma_init(ai_dev->dev))
+        pr_warn("ai_accel: no DMA copy engine available\n");
+    
     /* Add sysfs attributes */
     ret = sysfs_create_group(&ai_dev->dev->kobj, &ai_attr_group);
     if (ret) {
         pr_warn("ai_accel: failed to create sysfs group\n");
     }
     
+    ai_debugfs_init(ai_dev);
+    
     pr_info("ai_accel: driver initialized (major=%d)\n", MAJOR(ai_dev_number));
     return 0;
 
@@ -486,24 +4750,42 @@ err_cdev:
 err_class:
     unregister_chrdev_region(ai_dev_number, 1);
 err_alloc:
+    ai_engines_fini(ai_dev);
+err_engines:
+    free_page((unsigned long)ai_dev->status);
+err_status:
     kfree(ai_dev);
     return ret;
 }
 
 static void __exit ai_accel_exit(void)
 {
+    struct ai_buffer *buf;
+    struct ai_model *model;
+    int id;
+    
     pr_info("ai_accel: unloading driver\n");
     
+    debugfs_remove_recursive(ai_dev->debugfs);
     sysfs_remove_group(&ai_dev->dev->kobj, &ai_attr_group);
+    ai_dma_exit();
     device_destroy(ai_class, ai_dev_number);
     cdev_del(&ai_dev->cdev);
     class_destroy(ai_class);
     unregister_chrdev_region(ai_dev_number, 1);
     
     /* Clean up any remaining allocations */
+    idr_for_each_entry(&ai_dev->buffer_idr, buf, id)
+        ai_buffer_put(buf);
+    idr_for_each_entry(&ai_dev->model_idr, model, id)
+        ai_model_put(model);
     idr_destroy(&ai_dev->buffer_idr);
     idr_destroy(&ai_dev->model_idr);
+    idr_destroy(&ai_dev->job_idr);
+    xa_destroy(&ai_dev->failed_fences);
     
+    ai_engines_fini(ai_dev);
+    free_page((unsigned long)ai_dev->status);
     kfree(ai_dev);
     
     pr_info("ai_accel: driver unloaded\n");
@@ -516,3 +4798,4 @@ MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("AI Infrastructure Team");
 MODULE_DESCRIPTION("Educational AI Accelerator Driver");
 MODULE_VERSION("1.0.0");
+MODULE_IMPORT_NS(DMA_BUF);
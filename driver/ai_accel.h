@@ -7,6 +7,9 @@
 #define _AI_ACCEL_H_
 
 #include <linux/types.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmaengine.h>
+#include <linux/scatterlist.h>
 
 /* Forward declarations */
 struct ai_device;
@@ -18,6 +21,71 @@ struct ai_model;
 #define AI_MAX_MODELS       64
 #define AI_MAX_PENDING      256
 
-/* Internal structures and functions would go here */
+/* Retired failed fences remembered for later in-fences */
+#define AI_FAILED_FENCES    4096
+
+/* Job watchdog scan interval */
+#define AI_WATCHDOG_PERIOD_MS   100
+
+/* Job records kept for post-mortems (debugfs flight_recorder) */
+#define AI_FLIGHT_RECORDS   256
+
+/* Pinned user ranges cached per context */
+#define AI_PIN_CACHE_ENTRIES    64
+
+/* Longest a context may hold back completion wakeups */
+#define AI_COALESCE_MAX_US      100000
+
+/* Idle COPY_IN staging buffers kept per context */
+#define AI_STAGING_POOL_MAX     16
+
+/* Submission queues per context */
+#define AI_MAX_QUEUES       64
+
+/* DMA buffer descriptor */
+struct ai_dma_buffer {
+    void *cpu_addr;              /* CPU virtual address */
+    dma_addr_t dma_addr;         /* DMA bus address */
+    size_t size;                 /* Buffer size */
+    enum dma_data_direction dir; /* Transfer direction */
+    struct sg_table *sgt;        /* Scatter-gather table, contiguous pages merged */
+    bool mapped;                 /* Is buffer mapped? */
+    struct page **pages;         /* Pinned user pages */
+    int nr_pages;
+};
+
+/* One copy in a batched transfer list */
+struct ai_dma_xfer_desc {
+    dma_addr_t dst;
+    dma_addr_t src;
+    size_t size;
+};
+
+/* DMA operations (ai_dma.c) */
+int ai_dma_init(struct device *dev);
+void ai_dma_exit(void);
+struct ai_dma_buffer *ai_dma_alloc_buffer(struct device *dev, size_t size,
+                                          enum dma_data_direction dir);
+void ai_dma_free_buffer(struct device *dev, struct ai_dma_buffer *buf);
+struct ai_dma_buffer *ai_dma_map_user_buffer(struct device *dev,
+                                              void __user *user_addr,
+                                              size_t size,
+                                              enum dma_data_direction dir,
+                                              bool longterm);
+void ai_dma_unmap_user_buffer(struct device *dev, struct ai_dma_buffer *buf);
+int ai_dma_transfer_sync(struct device *dev, dma_addr_t dst_addr,
+                         dma_addr_t src_addr, size_t size,
+                         unsigned int timeout_ms);
+dma_cookie_t ai_dma_transfer_async(struct device *dev, dma_addr_t dst_addr,
+                                    dma_addr_t src_addr, size_t size,
+                                    dma_async_tx_callback_result callback,
+                                    void *callback_data);
+dma_cookie_t ai_dma_transfer_list(struct device *dev,
+                                  const struct ai_dma_xfer_desc *descs,
+                                  unsigned int count,
+                                  dma_async_tx_callback_result callback,
+                                  void *callback_data);
+void ai_dma_sync_for_cpu(struct device *dev, struct ai_dma_buffer *buf);
+void ai_dma_sync_for_device(struct device *dev, struct ai_dma_buffer *buf);
 
 #endif /* _AI_ACCEL_H_ */
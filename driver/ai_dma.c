@@ -7,24 +7,21 @@
  */
 
 #include <linux/module.h>
+#include <linux/bitops.h>
+#include <linux/dma-direct.h>
 #include <linux/dma-mapping.h>
 #include <linux/dmaengine.h>
+#include <linux/highmem.h>
+#include <linux/iommu.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
 #include <linux/scatterlist.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 #include <linux/completion.h>
+#include <linux/wait.h>
 #include "ai_accel.h"
 
-/* DMA buffer descriptor */
-struct ai_dma_buffer {
-    void *cpu_addr;              /* CPU virtual address */
-    dma_addr_t dma_addr;         /* DMA bus address */
-    size_t size;                 /* Buffer size */
-    enum dma_data_direction dir; /* Transfer direction */
-    struct scatterlist *sg;      /* Scatter-gather list */
-    int sg_count;                /* Number of SG entries */
-    bool mapped;                 /* Is buffer mapped? */
-};
-
 /* DMA transfer context */
 struct ai_dma_transfer {
     struct ai_dma_buffer *src;
@@ -41,6 +38,89 @@ struct ai_dma_transfer {
 static struct dma_chan *dma_channels[AI_DMA_CHANNELS];
 static DEFINE_SPINLOCK(channel_lock);
 static unsigned long channel_bitmap;
+static u64 channel_inflight[AI_DMA_CHANNELS];  /* Queued bytes, under channel_lock */
+
+static unsigned int dma_stripe_threshold = SZ_4M;
+module_param(dma_stripe_threshold, uint, 0644);
+MODULE_PARM_DESC(dma_stripe_threshold,
+                 "Split transfers of at least this many bytes across all channels, 0 = never (default: 4 MB)");
+
+/* Stripes are cut on this boundary */
+#define AI_DMA_STRIPE_ALIGN 4096
+
+static bool dma_selftest;
+module_param(dma_selftest, bool, 0444);
+MODULE_PARM_DESC(dma_selftest, "Check every transfer path when the copy engine starts (default: 0)");
+
+static char dma_selftest_result[64] = "not run";
+module_param_string(dma_selftest_result, dma_selftest_result,
+                    sizeof(dma_selftest_result), 0444);
+MODULE_PARM_DESC(dma_selftest_result, "Outcome of the self-test");
+
+/* Largest self-test copy, and how long each copy may take */
+#define AI_DMA_SELFTEST_MAX         SZ_16M
+#define AI_DMA_SELFTEST_TIMEOUT_MS  5000
+
+/* The self-test transfer list: this many copies of up to 64 KB in total */
+#define AI_DMA_SELFTEST_LIST        8
+
+/*
+ * CPU copy engine, used when no dmaengine channel is available: a pool of
+ * kernel threads copying transfers in chunks, so one large transfer is
+ * spread over several CPUs.
+ */
+static unsigned int sw_dma_threads;
+module_param(sw_dma_threads, uint, 0444);
+MODULE_PARM_DESC(sw_dma_threads,
+                 "CPU copy engine threads, 0 = one per online CPU up to 8 (default: 0)");
+
+static unsigned int sw_dma_chunk_kb = 256;
+module_param(sw_dma_chunk_kb, uint, 0644);
+MODULE_PARM_DESC(sw_dma_chunk_kb, "CPU copy engine chunk size in KB (default: 256)");
+
+static bool sw_dma_force;
+module_param(sw_dma_force, bool, 0444);
+MODULE_PARM_DESC(sw_dma_force, "Use the CPU copy engine even if DMA channels are available (default: 0)");
+
+#define AI_SW_DMA_MAX_THREADS   8
+
+/* One channel's share of a transfer */
+struct ai_dma_piece {
+    struct ai_dma_request *req;
+    int chan;
+    size_t offset;
+    size_t size;
+    bool done;
+};
+
+/* A transfer, striped over one or more channels, with one completion */
+struct ai_dma_request {
+    struct ai_dma_piece pieces[AI_DMA_CHANNELS];
+    int nr_pieces;
+    atomic_t pending;           /* Pieces not yet completed */
+    int status;
+    struct ai_dma_transfer *xfer;       /* Synchronous waiter, or */
+    dma_async_tx_callback_result callback;  /* asynchronous completion */
+    void *callback_data;
+
+    /*
+     * CPU copy engine: chunks are handed out from sw_descs[sw_idx] at
+     * sw_next, under sw_lock. Single transfers use sw_one.
+     */
+    struct list_head sw_link;
+    struct device *sw_dev;
+    const struct ai_dma_xfer_desc *sw_descs;
+    unsigned int sw_count;
+    unsigned int sw_idx;
+    size_t sw_next;
+    size_t sw_chunk;
+    struct ai_dma_xfer_desc sw_one;
+    struct ai_dma_xfer_desc sw_list[];  /* Copy of a batched list */
+};
+
+static int ai_sw_dma_start(struct device *dev);
+static void ai_sw_dma_stop(void);
+static void ai_dma_selftest(struct device *dev);
 
 /**
  * ai_dma_init - Initialize DMA subsystem
@@ -50,6 +130,9 @@ static unsigned long channel_bitmap;
  */
 int ai_dma_init(struct device *dev)
 {
+    struct dma_chan *chans[AI_DMA_CHANNELS] = {};
+    unsigned long bitmap = 0;
+    unsigned long flags;
     int i, ret = 0;
     dma_cap_mask_t mask;
 
@@ -57,25 +140,35 @@ int ai_dma_init(struct device *dev)
     dma_cap_set(DMA_MEMCPY, mask);
     dma_cap_set(DMA_SG, mask);
 
-    spin_lock(&channel_lock);
-    channel_bitmap = 0;
-
-    for (i = 0; i < AI_DMA_CHANNELS; i++) {
-        dma_channels[i] = dma_request_channel(mask, NULL, NULL);
-        if (!dma_channels[i]) {
+    /* dma_request_channel() sleeps, publish the pool afterwards */
+    for (i = 0; i < AI_DMA_CHANNELS && !sw_dma_force; i++) {
+        chans[i] = dma_request_channel(mask, NULL, NULL);
+        if (!chans[i]) {
             dev_warn(dev, "Failed to request DMA channel %d\n", i);
             /* Continue with available channels */
         } else {
-            set_bit(i, &channel_bitmap);
+            set_bit(i, &bitmap);
         }
     }
-    spin_unlock(&channel_lock);
 
+    spin_lock_irqsave(&channel_lock, flags);
+    for (i = 0; i < AI_DMA_CHANNELS; i++) {
+        dma_channels[i] = chans[i];
+        channel_inflight[i] = 0;
+    }
+    channel_bitmap = bitmap;
+    spin_unlock_irqrestore(&channel_lock, flags);
+
+    /* Fall back to copying with the CPU */
     if (channel_bitmap == 0) {
-        dev_err(dev, "No DMA channels available\n");
-        ret = -ENODEV;
+        ret = ai_sw_dma_start(dev);
+        if (ret)
+            dev_err(dev, "No DMA channels available\n");
     }
 
+    if (!ret && dma_selftest)
+        ai_dma_selftest(dev);
+
     return ret;
 }
 EXPORT_SYMBOL_GPL(ai_dma_init);
@@ -85,17 +178,23 @@ EXPORT_SYMBOL_GPL(ai_dma_init);
  */
 void ai_dma_exit(void)
 {
+    struct dma_chan *chans[AI_DMA_CHANNELS];
+    unsigned long flags;
     int i;
 
-    spin_lock(&channel_lock);
+    spin_lock_irqsave(&channel_lock, flags);
     for (i = 0; i < AI_DMA_CHANNELS; i++) {
-        if (dma_channels[i]) {
-            dma_release_channel(dma_channels[i]);
-            dma_channels[i] = NULL;
-        }
+        chans[i] = dma_channels[i];
+        dma_channels[i] = NULL;
     }
     channel_bitmap = 0;
-    spin_unlock(&channel_lock);
+    spin_unlock_irqrestore(&channel_lock, flags);
+
+    for (i = 0; i < AI_DMA_CHANNELS; i++)
+        if (chans[i])
+            dma_release_channel(chans[i]);
+
+    ai_sw_dma_stop();
 }
 EXPORT_SYMBOL_GPL(ai_dma_exit);
 
@@ -144,8 +243,10 @@ void ai_dma_free_buffer(struct device *dev, struct ai_dma_buffer *buf)
     if (buf->cpu_addr)
         dma_free_coherent(dev, buf->size, buf->cpu_addr, buf->dma_addr);
 
-    if (buf->sg)
-        kfree(buf->sg);
+    if (buf->sgt) {
+        sg_free_table(buf->sgt);
+        kfree(buf->sgt);
+    }
 
     kfree(buf);
 }
@@ -157,13 +258,21 @@ EXPORT_SYMBOL_GPL(ai_dma_free_buffer);
  * @user_addr: User-space virtual address
  * @size: Buffer size
  * @dir: Transfer direction
+ * @longterm: Pin with FOLL_LONGTERM
+ *
+ * The pages stay pinned until ai_dma_unmap_user_buffer(). Set @longterm for
+ * buffers that may live for the life of the process, such as registered or
+ * cached ones; a pin that only lasts for one job is short-term.
+ * Physically contiguous pages, as with THP-backed memory, are merged into
+ * segments of up to the device's maximum segment size.
  *
  * Returns buffer descriptor or ERR_PTR on failure
  */
 struct ai_dma_buffer *ai_dma_map_user_buffer(struct device *dev,
                                               void __user *user_addr,
                                               size_t size,
-                                              enum dma_data_direction dir)
+                                              enum dma_data_direction dir,
+                                              bool longterm)
 {
     struct ai_dma_buffer *buf;
     struct page **pages;
@@ -179,74 +288,415 @@ struct ai_dma_buffer *ai_dma_map_user_buffer(struct device *dev,
 
     pages = kvmalloc_array(nr_pages, sizeof(struct page *), GFP_KERNEL);
     if (!pages) {
-        kfree(buf);
-        return ERR_PTR(-ENOMEM);
+        ret = -ENOMEM;
+        goto err_free_buf;
     }
 
-    /* Pin user pages */
-    ret = pin_user_pages_fast((unsigned long)user_addr, nr_pages,
-                              dir == DMA_FROM_DEVICE ? FOLL_WRITE : 0,
+    /* Pin user pages; the device writes them unless they are DMA_TO_DEVICE */
+    ret = pin_user_pages_fast((unsigned long)user_addr & PAGE_MASK, nr_pages,
+                              (longterm ? FOLL_LONGTERM : 0) |
+                              (dir != DMA_TO_DEVICE ? FOLL_WRITE : 0),
                               pages);
-    if (ret < 0) {
-        kvfree(pages);
-        kfree(buf);
-        return ERR_PTR(ret);
-    }
-
     if (ret != nr_pages) {
-        unpin_user_pages(pages, ret);
-        kvfree(pages);
-        kfree(buf);
-        return ERR_PTR(-EFAULT);
+        if (ret > 0)
+            unpin_user_pages(pages, ret);
+        ret = ret < 0 ? ret : -EFAULT;
+        goto err_free_pages;
     }
 
-    /* Allocate and initialize scatter-gather list */
-    buf->sg = kvmalloc_array(nr_pages, sizeof(struct scatterlist), GFP_KERNEL);
-    if (!buf->sg) {
-        unpin_user_pages(pages, nr_pages);
-        kvfree(pages);
-        kfree(buf);
-        return ERR_PTR(-ENOMEM);
+    /* Build the scatter-gather table, merging contiguous pages */
+    buf->sgt = kzalloc(sizeof(*buf->sgt), GFP_KERNEL);
+    if (!buf->sgt) {
+        ret = -ENOMEM;
+        goto err_unpin;
     }
 
-    sg_init_table(buf->sg, nr_pages);
-
-    /* Fill scatter-gather entries */
-    for (int i = 0; i < nr_pages; i++) {
-        unsigned int offset = (i == 0) ? offset_in_page(user_addr) : 0;
-        unsigned int len = min_t(size_t,
-                                PAGE_SIZE - offset,
-                                size - (i * PAGE_SIZE - offset_in_page(user_addr)));
-        sg_set_page(&buf->sg[i], pages[i], len, offset);
-    }
+    ret = sg_alloc_table_from_pages_segment(buf->sgt, pages, nr_pages,
+                                            offset_in_page(user_addr), size,
+                                            dma_get_max_seg_size(dev),
+                                            GFP_KERNEL);
+    if (ret)
+        goto err_free_sgt;
 
     /* Map for DMA */
-    buf->sg_count = dma_map_sg(dev, buf->sg, nr_pages, dir);
-    if (buf->sg_count == 0) {
-        unpin_user_pages(pages, nr_pages);
-        kvfree(buf->sg);
-        kvfree(pages);
-        kfree(buf);
-        return ERR_PTR(-EIO);
-    }
+    ret = dma_map_sgtable(dev, buf->sgt, dir, 0);
+    if (ret)
+        goto err_free_table;
 
     buf->size = size;
     buf->dir = dir;
     buf->mapped = true;
+    buf->dma_addr = sg_dma_address(buf->sgt->sgl);
+    buf->pages = pages;
+    buf->nr_pages = nr_pages;
 
-    kvfree(pages);
     return buf;
+
+err_free_table:
+    sg_free_table(buf->sgt);
+err_free_sgt:
+    kfree(buf->sgt);
+err_unpin:
+    unpin_user_pages(pages, nr_pages);
+err_free_pages:
+    kvfree(pages);
+err_free_buf:
+    kfree(buf);
+    return ERR_PTR(ret);
 }
 EXPORT_SYMBOL_GPL(ai_dma_map_user_buffer);
 
-/* DMA completion callback */
-static void ai_dma_callback(void *data)
+/**
+ * ai_dma_unmap_user_buffer - Unmap and unpin a user buffer
+ * @dev: Device for DMA operations
+ * @buf: Buffer from ai_dma_map_user_buffer()
+ */
+void ai_dma_unmap_user_buffer(struct device *dev, struct ai_dma_buffer *buf)
 {
-    struct ai_dma_transfer *xfer = data;
+    if (!buf)
+        return;
 
-    xfer->end_time = ktime_get();
-    xfer->status = 0;
-    complete(&xfer->done);
+    dma_unmap_sgtable(dev, buf->sgt, buf->dir, 0);
+    sg_free_table(buf->sgt);
+    kfree(buf->sgt);
+    unpin_user_pages_dirty_lock(buf->pages, buf->nr_pages,
+                                buf->dir != DMA_TO_DEVICE);
+    kvfree(buf->pages);
+    kfree(buf);
+}
+EXPORT_SYMBOL_GPL(ai_dma_unmap_user_buffer);
+
+/*
+ * Channel selection
+ *
+ * Every channel's queued bytes are tracked. A transfer goes to the least
+ * loaded channel or, from dma_stripe_threshold bytes up, is cut into one
+ * stripe per channel so that large uploads use the aggregate bandwidth.
+ */
+
+static void ai_dma_request_done(struct ai_dma_request *req)
+{
+    struct ai_dma_transfer *xfer = req->xfer;
+
+    /* A synchronous waiter owns the request and frees it */
+    if (xfer) {
+        xfer->end_time = ktime_get();
+        xfer->status = req->status;
+        complete(&xfer->done);
+        return;
+    }
+
+    if (req->callback) {
+        struct dmaengine_result result = {
+            .result = req->status ? DMA_TRANS_ABORTED : DMA_TRANS_NOERROR,
+        };
+
+        req->callback(req->callback_data, &result);
+    }
+    kfree(req);
+}
+
+/* DMA completion callback, once per piece */
+static void ai_dma_callback(void *data, const struct dmaengine_result *result)
+{
+    struct ai_dma_piece *piece = data;
+    struct ai_dma_request *req = piece->req;
+    unsigned long flags;
+
+    spin_lock_irqsave(&channel_lock, flags);
+    channel_inflight[piece->chan] -= piece->size;
+    piece->done = true;
+    if (result && result->result != DMA_TRANS_NOERROR)
+        req->status = -EIO;
+    spin_unlock_irqrestore(&channel_lock, flags);
+
+    if (atomic_dec_and_test(&req->pending))
+        ai_dma_request_done(req);
+}
+
+/*
+ * Pick channels for @size bytes and charge them; returns the piece count.
+ * Without @split the whole transfer goes to one channel.
+ */
+static int ai_dma_reserve(struct ai_dma_request *req, size_t size, bool split)
+{
+    unsigned long flags;
+    size_t stripe, offset = 0;
+    int best = -1;
+    int n = 0;
+    int i;
+
+    spin_lock_irqsave(&channel_lock, flags);
+    if (split && dma_stripe_threshold && size >= dma_stripe_threshold &&
+        hweight_long(channel_bitmap) > 1) {
+        stripe = ALIGN(DIV_ROUND_UP(size, hweight_long(channel_bitmap)),
+                       AI_DMA_STRIPE_ALIGN);
+        for_each_set_bit(i, &channel_bitmap, AI_DMA_CHANNELS) {
+            if (offset >= size)
+                break;
+            req->pieces[n].chan = i;
+            req->pieces[n].offset = offset;
+            req->pieces[n].size = min(stripe, size - offset);
+            offset += req->pieces[n].size;
+            n++;
+        }
+    } else {
+        for_each_set_bit(i, &channel_bitmap, AI_DMA_CHANNELS)
+            if (best < 0 || channel_inflight[i] < channel_inflight[best])
+                best = i;
+        if (best >= 0) {
+            req->pieces[0].chan = best;
+            req->pieces[0].offset = 0;
+            req->pieces[0].size = size;
+            n = 1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        req->pieces[i].req = req;
+        channel_inflight[req->pieces[i].chan] += req->pieces[i].size;
+    }
+    spin_unlock_irqrestore(&channel_lock, flags);
+
+    req->nr_pieces = n;
+    atomic_set(&req->pending, n);
+    return n;
+}
+
+/*
+ * Queue all pieces of @req and start them. Pieces that cannot be queued are
+ * released and fail the request; if none could be, the request is freed
+ * and an error returned. Otherwise the pieces that were queued still run,
+ * and the last to finish completes the request with its status.
+ */
+static dma_cookie_t ai_dma_submit(struct ai_dma_request *req, dma_addr_t dst,
+                                  dma_addr_t src)
+{
+    struct dma_chan *issue[AI_DMA_CHANNELS];
+    struct dma_async_tx_descriptor *tx;
+    dma_cookie_t cookie, last = -ENOMEM;
+    unsigned long flags;
+    int queued = 0;
+    int i;
+
+    for (i = 0; i < req->nr_pieces; i++) {
+        struct ai_dma_piece *piece = &req->pieces[i];
+        struct dma_chan *chan = dma_channels[piece->chan];
+
+        cookie = -ENOMEM;
+        tx = dmaengine_prep_dma_memcpy(chan, dst + piece->offset,
+                                       src + piece->offset, piece->size,
+                                       DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+        if (tx) {
+            tx->callback_result = ai_dma_callback;
+            tx->callback_param = piece;
+            cookie = dmaengine_submit(tx);
+        }
+
+        if (dma_submit_error(cookie)) {
+            req->status = cookie;
+            spin_lock_irqsave(&channel_lock, flags);
+            channel_inflight[piece->chan] -= piece->size;
+            piece->done = true;
+            spin_unlock_irqrestore(&channel_lock, flags);
+            continue;
+        }
+        issue[queued++] = chan;
+        last = cookie;
+    }
+
+    if (!queued) {
+        kfree(req);
+        return last;
+    }
+
+    /* Nothing runs before issue_pending, so pending cannot drop to 0 here */
+    atomic_sub(req->nr_pieces - queued, &req->pending);
+
+    /* The request may complete and be freed from here on */
+    for (i = 0; i < queued; i++)
+        dma_async_issue_pending(issue[i]);
+
+    return last;
+}
+
+/*
+ * CPU copy engine
+ *
+ * Requests are queued on sw_queue. Idle threads take the next chunk of the
+ * oldest request, so a large transfer is copied by every thread at once
+ * while small ones stay on one. The last chunk to finish completes the
+ * request exactly as a hardware channel callback would, but from process
+ * context. DMA addresses are turned back into kernel addresses, which
+ * requires direct mapping (no IOMMU) and memory in the linear map.
+ */
+
+static struct task_struct *sw_threads[AI_SW_DMA_MAX_THREADS];
+static unsigned int sw_nr_threads;
+static LIST_HEAD(sw_queue);
+static DEFINE_SPINLOCK(sw_lock);
+static DECLARE_WAIT_QUEUE_HEAD(sw_wait);
+
+static unsigned int ai_sw_dma_chunks(const struct ai_dma_request *req,
+                                     size_t size)
+{
+    return DIV_ROUND_UP(size, req->sw_chunk);
+}
+
+/* Take the next chunk to copy, or return NULL if there is none */
+static struct ai_dma_request *ai_sw_dma_next(void **dst, const void **src,
+                                             size_t *len)
+{
+    const struct ai_dma_xfer_desc *desc;
+    struct ai_dma_request *req;
+    size_t offset;
+
+    spin_lock(&sw_lock);
+    req = list_first_entry_or_null(&sw_queue, struct ai_dma_request, sw_link);
+    if (req) {
+        desc = &req->sw_descs[req->sw_idx];
+        offset = req->sw_next;
+        *len = min(req->sw_chunk, desc->size - offset);
+        *dst = phys_to_virt(dma_to_phys(req->sw_dev, desc->dst + offset));
+        *src = phys_to_virt(dma_to_phys(req->sw_dev, desc->src + offset));
+
+        req->sw_next += *len;
+        if (req->sw_next == desc->size) {
+            req->sw_next = 0;
+            if (++req->sw_idx == req->sw_count)
+                list_del_init(&req->sw_link);
+        }
+    }
+    spin_unlock(&sw_lock);
+
+    return req;
+}
+
+static int ai_sw_dma_thread(void *unused)
+{
+    struct ai_dma_request *req;
+    const void *src;
+    void *dst;
+    size_t len;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(sw_wait, !list_empty(&sw_queue) ||
+                                          kthread_should_stop());
+
+        while ((req = ai_sw_dma_next(&dst, &src, &len))) {
+            memcpy(dst, src, len);
+            if (atomic_dec_and_test(&req->pending))
+                ai_dma_request_done(req);
+            cond_resched();
+        }
+    }
+
+    return 0;
+}
+
+static int ai_sw_dma_start(struct device *dev)
+{
+    unsigned int n = sw_dma_threads ? sw_dma_threads : num_online_cpus();
+    struct task_struct *t;
+
+    if (device_iommu_mapped(dev))
+        return -ENODEV;
+
+    n = clamp(n, 1U, (unsigned int)AI_SW_DMA_MAX_THREADS);
+    for (sw_nr_threads = 0; sw_nr_threads < n; sw_nr_threads++) {
+        t = kthread_run(ai_sw_dma_thread, NULL, "ai_dma_cpu/%u", sw_nr_threads);
+        if (IS_ERR(t))
+            break;
+        sw_threads[sw_nr_threads] = t;
+    }
+
+    if (!sw_nr_threads)
+        return -ENOMEM;
+
+    dev_info(dev, "No DMA channels, using CPU copy engine with %u threads\n",
+             sw_nr_threads);
+    return 0;
+}
+
+static void ai_sw_dma_stop(void)
+{
+    while (sw_nr_threads)
+        kthread_stop(sw_threads[--sw_nr_threads]);
+}
+
+/*
+ * Check that @size bytes at @addr are in the linear map, where
+ * ai_sw_dma_next() can find them. Without an IOMMU the range is physically
+ * contiguous, so checking both ends is enough.
+ */
+static bool ai_sw_dma_addr_ok(struct device *dev, dma_addr_t addr, size_t size)
+{
+    phys_addr_t start = dma_to_phys(dev, addr);
+    phys_addr_t end = start + size - 1;
+
+    return virt_addr_valid(phys_to_virt(start)) &&
+           virt_addr_valid(phys_to_virt(end)) &&
+           !PageHighMem(virt_to_page(phys_to_virt(start))) &&
+           !PageHighMem(virt_to_page(phys_to_virt(end)));
+}
+
+/* Queue the @count copies at @descs, which @req must own, on the CPU */
+static int ai_sw_dma_submit(struct ai_dma_request *req, struct device *dev,
+                            const struct ai_dma_xfer_desc *descs,
+                            unsigned int count)
+{
+    unsigned int chunks = 0;
+    unsigned int i;
+
+    if (!sw_nr_threads)
+        return -ENODEV;
+
+    for (i = 0; i < count; i++)
+        if (!ai_sw_dma_addr_ok(dev, descs[i].dst, descs[i].size) ||
+            !ai_sw_dma_addr_ok(dev, descs[i].src, descs[i].size))
+            return -EINVAL;
+
+    req->sw_dev = dev;
+    req->sw_descs = descs;
+    req->sw_count = count;
+    req->sw_chunk = max_t(size_t, (size_t)sw_dma_chunk_kb << 10, PAGE_SIZE);
+    for (i = 0; i < count; i++)
+        chunks += ai_sw_dma_chunks(req, descs[i].size);
+    atomic_set(&req->pending, chunks);
+
+    spin_lock(&sw_lock);
+    list_add_tail(&req->sw_link, &sw_queue);
+    spin_unlock(&sw_lock);
+
+    wake_up_all(&sw_wait);
+    return 0;
+}
+
+/*
+ * A synchronous CPU copy timed out: withdraw the chunks not started yet, and
+ * fail the request if there were any. Returns true if this finished the
+ * request. The waiter owns @req, so it stays valid even if the last chunk
+ * finishes meanwhile.
+ */
+static bool ai_sw_dma_cancel(struct ai_dma_request *req)
+{
+    unsigned int left = 0;
+    unsigned int i;
+
+    spin_lock(&sw_lock);
+    if (!list_empty(&req->sw_link)) {
+        left = ai_sw_dma_chunks(req, req->sw_descs[req->sw_idx].size -
+                                     req->sw_next);
+        for (i = req->sw_idx + 1; i < req->sw_count; i++)
+            left += ai_sw_dma_chunks(req, req->sw_descs[i].size);
+        list_del_init(&req->sw_link);
+    }
+    spin_unlock(&sw_lock);
+
+    if (!left)
+        return false;
+    req->status = -ETIMEDOUT;
+    return atomic_sub_and_test(left, &req->pending);
 }
 
 /**
@@ -264,58 +714,67 @@ int ai_dma_transfer_sync(struct device *dev, dma_addr_t dst_addr,
                          unsigned int timeout_ms)
 {
     struct ai_dma_transfer xfer;
-    struct dma_chan *chan = NULL;
-    struct dma_async_tx_descriptor *tx;
+    struct ai_dma_request *req;
+    int chans[AI_DMA_CHANNELS];
+    unsigned long flags;
     dma_cookie_t cookie;
-    int ret;
-    int i;
-
-    /* Find available channel */
-    spin_lock(&channel_lock);
-    for (i = 0; i < AI_DMA_CHANNELS; i++) {
-        if (test_bit(i, &channel_bitmap) && dma_channels[i]) {
-            chan = dma_channels[i];
-            break;
-        }
-    }
-    spin_unlock(&channel_lock);
+    int nr, i, ret;
 
-    if (!chan)
-        return -ENODEV;
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
 
     /* Prepare transfer */
     init_completion(&xfer.done);
     xfer.status = -EINPROGRESS;
     xfer.bytes_transferred = 0;
     xfer.start_time = ktime_get();
+    req->xfer = &xfer;
+    INIT_LIST_HEAD(&req->sw_link);
 
-    /* Create DMA descriptor */
-    tx = dmaengine_prep_dma_memcpy(chan, dst_addr, src_addr, size,
-                                    DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
-    if (!tx)
-        return -ENOMEM;
-
-    tx->callback = ai_dma_callback;
-    tx->callback_param = &xfer;
+    nr = ai_dma_reserve(req, size, true);
+    if (!nr) {
+        req->sw_one = (struct ai_dma_xfer_desc){ dst_addr, src_addr, size };
+        ret = size ? ai_sw_dma_submit(req, dev, &req->sw_one, 1) : -ENODEV;
+        if (ret) {
+            kfree(req);
+            return ret;
+        }
+        if (!wait_for_completion_timeout(&xfer.done,
+                                         msecs_to_jiffies(timeout_ms)) &&
+            ai_sw_dma_cancel(req))
+            ai_dma_request_done(req);
+        wait_for_completion(&xfer.done);
+        goto out;
+    }
+    for (i = 0; i < nr; i++)
+        chans[i] = req->pieces[i].chan;
 
-    /* Submit transfer */
-    cookie = dmaengine_submit(tx);
-    ret = dma_submit_error(cookie);
-    if (ret)
-        return ret;
-
-    /* Start DMA */
-    dma_async_issue_pending(chan);
+    cookie = ai_dma_submit(req, dst_addr, src_addr);
+    if (dma_submit_error(cookie))
+        return cookie;
 
     /* Wait for completion */
-    ret = wait_for_completion_timeout(&xfer.done,
-                                       msecs_to_jiffies(timeout_ms));
-    if (ret == 0) {
-        dmaengine_terminate_sync(chan);
-        return -ETIMEDOUT;
+    if (!wait_for_completion_timeout(&xfer.done,
+                                     msecs_to_jiffies(timeout_ms))) {
+        for (i = 0; i < nr; i++)
+            dmaengine_terminate_sync(dma_channels[chans[i]]);
+
+        /* No callbacks run after termination; finish the request here */
+        if (!completion_done(&xfer.done)) {
+            spin_lock_irqsave(&channel_lock, flags);
+            for (i = 0; i < nr; i++)
+                if (!req->pieces[i].done)
+                    channel_inflight[chans[i]] -= req->pieces[i].size;
+            spin_unlock_irqrestore(&channel_lock, flags);
+            xfer.status = -ETIMEDOUT;
+        }
     }
 
-    xfer.bytes_transferred = size;
+out:
+    kfree(req);
+    if (!xfer.status)
+        xfer.bytes_transferred = size;
     return xfer.status;
 }
 EXPORT_SYMBOL_GPL(ai_dma_transfer_sync);
@@ -326,49 +785,150 @@ EXPORT_SYMBOL_GPL(ai_dma_transfer_sync);
  * @dst_addr: Destination DMA address
  * @src_addr: Source DMA address
  * @size: Transfer size
- * @callback: Completion callback
+ * @callback: Completion callback, called once for the whole transfer
  * @callback_data: Data passed to callback
  *
+ * Large transfers may be striped over several channels; the returned cookie
+ * then belongs to the last stripe queued and @callback is the only reliable
+ * completion signal. If some stripes could not be queued, or a channel
+ * reports an error, the others still run and @callback is passed
+ * DMA_TRANS_ABORTED: the destination is incomplete.
+ *
  * Returns transfer cookie on success, negative error code on failure
  */
 dma_cookie_t ai_dma_transfer_async(struct device *dev, dma_addr_t dst_addr,
                                     dma_addr_t src_addr, size_t size,
-                                    dma_async_tx_callback callback,
+                                    dma_async_tx_callback_result callback,
                                     void *callback_data)
 {
-    struct dma_chan *chan = NULL;
-    struct dma_async_tx_descriptor *tx;
-    dma_cookie_t cookie;
-    int i;
+    struct ai_dma_request *req;
+    int ret;
 
-    /* Find available channel */
-    spin_lock(&channel_lock);
-    for (i = 0; i < AI_DMA_CHANNELS; i++) {
-        if (test_bit(i, &channel_bitmap) && dma_channels[i]) {
-            chan = dma_channels[i];
-            break;
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+
+    req->callback = callback;
+    req->callback_data = callback_data;
+    INIT_LIST_HEAD(&req->sw_link);
+
+    if (!ai_dma_reserve(req, size, true)) {
+        req->sw_one = (struct ai_dma_xfer_desc){ dst_addr, src_addr, size };
+        ret = size ? ai_sw_dma_submit(req, dev, &req->sw_one, 1) : -ENODEV;
+        if (ret) {
+            kfree(req);
+            return ret;
         }
+        /* No dmaengine cookie; report the first valid one */
+        return DMA_MIN_COOKIE;
     }
-    spin_unlock(&channel_lock);
 
-    if (!chan)
-        return -ENODEV;
+    return ai_dma_submit(req, dst_addr, src_addr);
+}
+EXPORT_SYMBOL_GPL(ai_dma_transfer_async);
 
-    tx = dmaengine_prep_dma_memcpy(chan, dst_addr, src_addr, size,
-                                    DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
-    if (!tx)
+/**
+ * ai_dma_transfer_list - Initiate a batch of copies with one completion
+ * @dev: Device for DMA operations
+ * @descs: Copies to perform
+ * @count: Number of entries in @descs
+ * @callback: Completion callback, called once after the last copy, with
+ *            DMA_TRANS_ABORTED if the channel reported an error
+ * @callback_data: Data passed to callback
+ *
+ * All copies are queued in order on one channel, so only the last
+ * descriptor requests an interrupt and the channel is kicked once for the
+ * whole list. Meant for many small copies; large ones are better off with
+ * ai_dma_transfer_async(), which may stripe them.
+ *
+ * Returns cookie of the last copy on success, negative error code on failure
+ */
+dma_cookie_t ai_dma_transfer_list(struct device *dev,
+                                  const struct ai_dma_xfer_desc *descs,
+                                  unsigned int count,
+                                  dma_async_tx_callback_result callback,
+                                  void *callback_data)
+{
+    struct dma_async_tx_descriptor *tx;
+    struct ai_dma_request *req;
+    struct ai_dma_piece *piece;
+    dma_cookie_t cookie, last = 0;
+    struct dma_chan *chan;
+    unsigned long flags;
+    unsigned int i;
+    size_t total = 0;
+    int ret;
+
+    if (!count)
+        return -EINVAL;
+    for (i = 0; i < count; i++) {
+        if (!descs[i].size)
+            return -EINVAL;
+        total += descs[i].size;
+    }
+
+    req = kzalloc(struct_size(req, sw_list, count), GFP_KERNEL);
+    if (!req)
         return -ENOMEM;
 
-    tx->callback = callback;
-    tx->callback_param = callback_data;
+    req->callback = callback;
+    req->callback_data = callback_data;
+    INIT_LIST_HEAD(&req->sw_link);
+
+    if (!ai_dma_reserve(req, total, false)) {
+        memcpy(req->sw_list, descs, flex_array_size(req, sw_list, count));
+        ret = ai_sw_dma_submit(req, dev, req->sw_list, count);
+        if (ret) {
+            kfree(req);
+            return ret;
+        }
+        return DMA_MIN_COOKIE;
+    }
 
-    cookie = dmaengine_submit(tx);
-    if (!dma_submit_error(cookie))
-        dma_async_issue_pending(chan);
+    piece = &req->pieces[0];
+    chan = dma_channels[piece->chan];
 
-    return cookie;
+    for (i = 0; i < count; i++) {
+        bool tail = i == count - 1;
+
+        cookie = -ENOMEM;
+        tx = dmaengine_prep_dma_memcpy(chan, descs[i].dst, descs[i].src,
+                                       descs[i].size,
+                                       DMA_CTRL_ACK |
+                                       (tail ? DMA_PREP_INTERRUPT : 0));
+        if (!tx)
+            break;
+        if (tail) {
+            tx->callback_result = ai_dma_callback;
+            tx->callback_param = piece;
+        }
+        cookie = dmaengine_submit(tx);
+        if (dma_submit_error(cookie))
+            break;
+        last = cookie;
+    }
+
+    if (dma_submit_error(cookie)) {
+        /*
+         * The copies already queued raise no interrupt: run them and poll
+         * for the last so none touches the buffers after we fail.
+         */
+        if (i) {
+            dma_async_issue_pending(chan);
+            dma_sync_wait(chan, last);
+        }
+        spin_lock_irqsave(&channel_lock, flags);
+        channel_inflight[piece->chan] -= piece->size;
+        spin_unlock_irqrestore(&channel_lock, flags);
+        kfree(req);
+        return cookie;
+    }
+
+    /* The request may complete and be freed from here on */
+    dma_async_issue_pending(chan);
+    return last;
 }
-EXPORT_SYMBOL_GPL(ai_dma_transfer_async);
+EXPORT_SYMBOL_GPL(ai_dma_transfer_list);
 
 /**
  * ai_dma_sync_for_cpu - Sync buffer for CPU access
@@ -380,8 +940,8 @@ void ai_dma_sync_for_cpu(struct device *dev, struct ai_dma_buffer *buf)
     if (!buf || !buf->mapped)
         return;
 
-    if (buf->sg)
-        dma_sync_sg_for_cpu(dev, buf->sg, buf->sg_count, buf->dir);
+    if (buf->sgt)
+        dma_sync_sgtable_for_cpu(dev, buf->sgt, buf->dir);
     else
         dma_sync_single_for_cpu(dev, buf->dma_addr, buf->size, buf->dir);
 }
@@ -397,13 +957,154 @@ void ai_dma_sync_for_device(struct device *dev, struct ai_dma_buffer *buf)
     if (!buf || !buf->mapped)
         return;
 
-    if (buf->sg)
-        dma_sync_sg_for_device(dev, buf->sg, buf->sg_count, buf->dir);
+    if (buf->sgt)
+        dma_sync_sgtable_for_device(dev, buf->sgt, buf->dir);
     else
         dma_sync_single_for_device(dev, buf->dma_addr, buf->size, buf->dir);
 }
 EXPORT_SYMBOL_GPL(ai_dma_sync_for_device);
 
+/*
+ * Self-test
+ *
+ * With dma_selftest set, ai_dma_init() runs each transfer path once on the
+ * engine it started and checks the data: a small copy, which goes to the
+ * least loaded channel, a copy of dma_stripe_threshold bytes, which is
+ * striped, the same asynchronously, and a transfer list of small copies.
+ * The result is logged and kept in dma_selftest_result.
+ */
+
+enum ai_dma_selftest_mode {
+    AI_DMA_SELFTEST_SYNC,
+    AI_DMA_SELFTEST_ASYNC,
+    AI_DMA_SELFTEST_XFER_LIST,
+};
+
+struct ai_dma_selftest_wait {
+    struct completion done;
+    enum dmaengine_tx_result result;
+};
+
+static void ai_dma_selftest_callback(void *data,
+                                     const struct dmaengine_result *result)
+{
+    struct ai_dma_selftest_wait *wait = data;
+
+    wait->result = result->result;
+    complete(&wait->done);
+}
+
+/*
+ * Copy @size bytes of random data from @src to @dst and compare. Returns
+ * -ETIMEDOUT if an asynchronous copy did not finish, in which case it may
+ * still write @dst and the buffers must not be freed.
+ */
+static int ai_dma_selftest_copy(struct device *dev, struct ai_dma_buffer *dst,
+                                struct ai_dma_buffer *src, size_t size,
+                                enum ai_dma_selftest_mode mode)
+{
+    struct ai_dma_xfer_desc descs[AI_DMA_SELFTEST_LIST];
+    struct ai_dma_selftest_wait *wait;
+    unsigned int count, i;
+    dma_cookie_t cookie;
+    size_t piece;
+    int ret;
+
+    get_random_bytes(src->cpu_addr, size);
+    memset(dst->cpu_addr, 0, size);
+
+    if (mode == AI_DMA_SELFTEST_SYNC) {
+        ret = ai_dma_transfer_sync(dev, dst->dma_addr, src->dma_addr, size,
+                                   AI_DMA_SELFTEST_TIMEOUT_MS);
+    } else {
+        wait = kzalloc(sizeof(*wait), GFP_KERNEL);
+        if (!wait)
+            return -ENOMEM;
+        init_completion(&wait->done);
+        if (mode == AI_DMA_SELFTEST_ASYNC) {
+            cookie = ai_dma_transfer_async(dev, dst->dma_addr, src->dma_addr,
+                                           size, ai_dma_selftest_callback,
+                                           wait);
+        } else {
+            /* Equal pieces, the last one taking the remainder */
+            count = min_t(size_t, size, AI_DMA_SELFTEST_LIST);
+            piece = size / count;
+            for (i = 0; i < count; i++) {
+                descs[i].dst = dst->dma_addr + i * piece;
+                descs[i].src = src->dma_addr + i * piece;
+                descs[i].size = i == count - 1 ? size - i * piece : piece;
+            }
+            cookie = ai_dma_transfer_list(dev, descs, count,
+                                          ai_dma_selftest_callback, wait);
+        }
+        if (dma_submit_error(cookie)) {
+            kfree(wait);
+            return cookie;
+        }
+        /* The callback may still run: leave it @wait */
+        if (!wait_for_completion_timeout(&wait->done,
+                msecs_to_jiffies(AI_DMA_SELFTEST_TIMEOUT_MS)))
+            return -ETIMEDOUT;
+        ret = wait->result == DMA_TRANS_NOERROR ? 0 : -EIO;
+        kfree(wait);
+    }
+
+    if (!ret && memcmp(dst->cpu_addr, src->cpu_addr, size))
+        ret = -EILSEQ;
+    return ret;
+}
+
+static void ai_dma_selftest(struct device *dev)
+{
+    size_t size = dma_stripe_threshold ?
+        min_t(size_t, dma_stripe_threshold, AI_DMA_SELFTEST_MAX) : SZ_1M;
+    size_t small = min_t(size_t, size, PAGE_SIZE + 1);
+    struct ai_dma_buffer *src, *dst;
+    const char *step = "alloc";
+    bool busy = false;
+    int ret = -ENOMEM;
+
+    src = ai_dma_alloc_buffer(dev, size, DMA_TO_DEVICE);
+    dst = ai_dma_alloc_buffer(dev, size, DMA_FROM_DEVICE);
+    if (src && dst) {
+        step = "single";
+        ret = ai_dma_selftest_copy(dev, dst, src, small,
+                                   AI_DMA_SELFTEST_SYNC);
+        if (!ret) {
+            step = "striped";
+            ret = ai_dma_selftest_copy(dev, dst, src, size,
+                                       AI_DMA_SELFTEST_SYNC);
+        }
+        if (!ret) {
+            step = "async";
+            ret = ai_dma_selftest_copy(dev, dst, src, size,
+                                       AI_DMA_SELFTEST_ASYNC);
+            busy = ret == -ETIMEDOUT;
+        }
+        if (!ret) {
+            step = "list";
+            ret = ai_dma_selftest_copy(dev, dst, src,
+                                       min_t(size_t, size, SZ_64K),
+                                       AI_DMA_SELFTEST_XFER_LIST);
+            busy = ret == -ETIMEDOUT;
+        }
+    }
+
+    if (ret) {
+        snprintf(dma_selftest_result, sizeof(dma_selftest_result),
+                 "failed at %s copy: %d", step, ret);
+        dev_err(dev, "DMA self-test %s\n", dma_selftest_result);
+    } else {
+        strscpy(dma_selftest_result, "passed", sizeof(dma_selftest_result));
+        dev_info(dev, "DMA self-test passed\n");
+    }
+
+    if (busy)
+        return;
+    ai_dma_free_buffer(dev, dst);
+    ai_dma_free_buffer(dev, src);
+}
+
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("AI Accelerator DMA Operations Module");
 MODULE_AUTHOR("AI Performance Engineering");
@@ -61,7 +61,13 @@ struct ai_free_request {
     __u64 handle;
 };
 
-/* Inference submission */
+/*
+ * Inference submission. The structure has grown since AI_IOC_SUBMIT was
+ * introduced, which changes the size encoded in the ioctl number. The driver
+ * accepts any size from AI_INFERENCE_REQUEST_SIZE_V0 up and reads fields
+ * beyond the caller's size as 0, so binaries built against an older header
+ * keep working. reserved must be 0.
+ */
 struct ai_inference_request {
     __u64 model_handle;     /* Handle to loaded model */
     __u64 input_handle;     /* Handle to input buffer */
@@ -72,21 +78,58 @@ struct ai_inference_request {
     __u32 priority;         /* Scheduling priority */
     __u64 user_data;        /* User context */
     __u64 fence;            /* Returned fence for completion */
+    __u32 batch_size;       /* Batch items in input (0 = 1) */
+    __u32 num_in_fences;    /* Entries in in_fences */
+    __u64 in_fences;        /* Pointer to __u64 fences to wait on */
+    __u32 timeout_ms;       /* Execution timeout (0 = driver default) */
+    __u32 queue;            /* From AI_IOC_CREATE_QUEUE, 0 = none */
+    __u64 reserved[2];      /* Room for future fields, must be 0 */
 };
 
+/* Size of the original struct ai_inference_request, fence included */
+#define AI_INFERENCE_REQUEST_SIZE_V0    56
+
+/* Maximum dependencies per submission */
+#define AI_MAX_IN_FENCES    16
+
+/* Priority classes (ai_inference_request.priority) */
+#define AI_PRIORITY_NORMAL  0   /* Default */
+#define AI_PRIORITY_LOW     1   /* Batch work, preempted by everything else */
+#define AI_PRIORITY_HIGH    2   /* Latency critical, preempts lower classes */
+#define AI_PRIORITY_COUNT   3
+
 /* Inference flags */
 #define AI_INFER_SYNC       (1 << 0)  /* Synchronous execution */
 #define AI_INFER_ASYNC      (1 << 1)  /* Asynchronous execution */
 #define AI_INFER_PROFILING  (1 << 2)  /* Enable profiling */
+#define AI_INFER_NO_IMPLICIT_SYNC (1 << 3)  /* Skip buffer reservations */
 
 /* Wait for completion */
 struct ai_wait_request {
     __u64 fence;            /* Fence to wait on */
-    __u64 timeout_ns;       /* Timeout in nanoseconds */
+    __u64 timeout_ns;       /* Timeout in nanoseconds (0 = poll) */
     __s32 status;           /* Returned status */
-    __u32 reserved;
+    __u32 flags;            /* AI_WAIT_* */
+};
+
+/* Wait flags */
+#define AI_WAIT_BUSY_POLL   (1 << 0)  /* Spin briefly before sleeping */
+#define AI_WAIT_ALL         (1 << 1)  /* AI_IOC_WAIT_MULTI: every fence, not any */
+
+/* Wait for any or all of several fences */
+struct ai_wait_multi_request {
+    __u64 fences;           /* Pointer to __u64 fences */
+    __u64 statuses;         /* Pointer to __s32 per fence, returned AI_STATUS_* */
+    __u64 timeout_ns;       /* Timeout in nanoseconds (0 = poll) */
+    __u32 num_fences;       /* Entries in fences and statuses */
+    __u32 flags;            /* AI_WAIT_ALL */
+    __u32 num_signaled;     /* Returned: fences no longer pending */
+    __u32 first_signaled;   /* Returned: lowest such index, or num_fences */
 };
 
+/* Maximum fences per AI_IOC_WAIT_MULTI */
+#define AI_MAX_WAIT_FENCES  64
+
 /* Status codes */
 #define AI_STATUS_SUCCESS       0
 #define AI_STATUS_PENDING       1
@@ -95,6 +138,93 @@ struct ai_wait_request {
 #define AI_STATUS_INVALID       -3
 #define AI_STATUS_NOMEM         -4
 
+/*
+ * Command buffers
+ *
+ * A command buffer is an array of struct ai_cmd executed in order as a single
+ * job with a single fence. COPY_IN reads host memory at submit time, unless
+ * it is flagged AI_CMD_FLAG_DEFER_READ: a large one may then be pinned at
+ * submit and read when the job runs (AI_XFER_PINNED). A copy read at submit
+ * above the xfer_bounce_max_kb module parameter (default 1024 KB) is staged
+ * in a host buffer allocated and freed for that job alone, so large inputs
+ * are cheaper with DEFER_READ or from a registered user pointer. The host
+ * pages of a COPY_OUT are pinned at submit and written when the job runs. A
+ * small COPY_IN may instead carry its data inline, in the entries that follow
+ * it (AI_CMD_FLAG_INLINE, copy.user_ptr unused).
+ */
+struct ai_cmd {
+    __u32 op;               /* AI_CMD_* */
+    __u32 flags;            /* AI_CMD_FLAG_* */
+    union {
+        struct {
+            __u64 handle;       /* Device buffer */
+            __u64 offset;       /* Offset into device buffer */
+            __u64 size;         /* Bytes to copy */
+            __u64 user_ptr;     /* Host address */
+        } copy;                 /* AI_CMD_COPY_IN, AI_CMD_COPY_OUT */
+        struct {
+            __u64 handle;
+            __u64 offset;
+            __u64 size;
+            __u32 pattern;      /* Byte value in the low 8 bits */
+            __u32 reserved;
+        } fill;                 /* AI_CMD_FILL */
+        struct {
+            __u64 model_handle;
+            __u64 input_handle;
+            __u64 output_handle;
+            __u32 batch_size;   /* 0 = 1 */
+            __u32 reserved;
+        } run;                  /* AI_CMD_RUN */
+        struct {
+            __u64 handle;
+            __u64 offset;       /* 8-byte aligned */
+            __u64 value;        /* Stored once all earlier ops are done */
+            __u64 reserved;
+        } signal;               /* AI_CMD_SIGNAL */
+        struct {
+            __s32 fd;           /* From AI_IOC_TIMELINE_CREATE */
+            __u32 reserved;
+            __u64 value;
+            __u64 reserved2[2];
+        } timeline;             /* AI_CMD_TIMELINE_WAIT, AI_CMD_TIMELINE_SIGNAL */
+    };
+};
+
+/* Command buffer operations */
+#define AI_CMD_COPY_IN      0   /* Host memory -> device buffer */
+#define AI_CMD_RUN          1   /* Execute a model */
+#define AI_CMD_COPY_OUT     2   /* Device buffer -> host memory */
+#define AI_CMD_FILL         3   /* Fill device buffer with a byte */
+#define AI_CMD_BARRIER      4   /* Wait for all earlier ops */
+#define AI_CMD_SIGNAL       5   /* Write a 64-bit value to a device buffer */
+#define AI_CMD_TIMELINE_WAIT    6   /* Hold the whole job until timeline >= value */
+#define AI_CMD_TIMELINE_SIGNAL  7   /* Advance a timeline to value */
+
+/* Command flags */
+#define AI_CMD_FLAG_INLINE  (1 << 0)  /* COPY_IN: data in the next entries */
+#define AI_CMD_FLAG_DEFER_READ  (1 << 1)  /* COPY_IN: source may be read when the job runs */
+
+/* Largest inline COPY_IN; it takes size / sizeof(struct ai_cmd) extra entries */
+#define AI_CMD_INLINE_MAX   512
+
+/* Maximum entries per command buffer, inline data included */
+#define AI_MAX_CMDS         64
+
+/* Command buffer submission */
+struct ai_cmdbuf_request {
+    __u64 cmds;             /* Pointer to struct ai_cmd array */
+    __u32 num_cmds;         /* Entries in cmds */
+    __u32 flags;            /* AI_INFER_* execution flags */
+    __u32 priority;         /* Scheduling priority */
+    __u32 num_in_fences;    /* Entries in in_fences */
+    __u64 in_fences;        /* Pointer to __u64 fences to wait on */
+    __u64 user_data;        /* User context */
+    __u64 fence;            /* Returned fence for completion */
+    __u32 timeout_ms;       /* Execution timeout (0 = driver default) */
+    __u32 queue;            /* From AI_IOC_CREATE_QUEUE, 0 = none */
+};
+
 /* Profiling data */
 struct ai_profile_data {
     __u64 fence;
@@ -105,9 +235,17 @@ struct ai_profile_data {
     __u64 memory_read;      /* Bytes read from memory */
     __u64 memory_write;     /* Bytes written to memory */
     __u32 engine_id;        /* Engine that executed */
-    __u32 reserved[3];
+    __u32 preemptions;      /* Times the job was switched out */
+    __u32 xfer_strategies;  /* AI_XFER_* used by the job's COPY_INs */
+    __u32 batch_size;       /* Requests in the dispatch that ran the job */
 };
 
+/* COPY_IN transfer strategies */
+#define AI_XFER_INLINE      (1 << 0)  /* Carried in the command entries */
+#define AI_XFER_BOUNCE      (1 << 1)  /* Through a staging buffer */
+#define AI_XFER_PINNED      (1 << 2)  /* Straight from pinned user memory */
+#define AI_XFER_PACKED      (1 << 3)  /* Gathered with the job's small copies */
+
 /* Model loading */
 struct ai_load_model_request {
     __u64 model_data;       /* Pointer to model data */
@@ -122,6 +260,128 @@ struct ai_unload_model_request {
     __u64 model_handle;
 };
 
+/* Export a buffer as a dma-buf */
+struct ai_export_request {
+    __u64 handle;           /* Buffer to export */
+    __u32 flags;            /* AI_EXPORT_* */
+    __s32 fd;               /* Returned dma-buf fd */
+};
+
+/* Export flags */
+#define AI_EXPORT_CLOEXEC   (1 << 0)  /* Set FD_CLOEXEC on the returned fd */
+
+/* Import a dma-buf as a buffer */
+struct ai_import_request {
+    __s32 fd;               /* dma-buf fd to import */
+    __u32 flags;            /* Must be 0 */
+    __u64 handle;           /* Returned buffer handle */
+    __u64 size;             /* Returned buffer size */
+};
+
+/* Register host memory as a buffer */
+struct ai_userptr_request {
+    __u64 user_ptr;         /* Start of the user virtual range */
+    __u64 size;             /* Range size in bytes */
+    __u32 flags;            /* AI_USERPTR_* */
+    __u32 reserved;
+    __u64 handle;           /* Returned buffer handle */
+};
+
+/* Userptr flags */
+#define AI_USERPTR_READ_ONLY (1 << 0)  /* Device only reads the memory */
+
+/*
+ * Timeline semaphores: a 64-bit value that only moves forward, shared as an
+ * fd. AI_IOC_TIMELINE_CREATE starts it at value and returns fd; SIGNAL
+ * advances it to value; WAIT sleeps until it reaches value and returns the
+ * current value (timeout_ns 0 only reads it).
+ */
+struct ai_timeline_request {
+    __s32 fd;
+    __u32 flags;            /* CREATE: AI_TIMELINE_CLOEXEC, otherwise 0 */
+    __u64 value;
+    __u64 timeout_ns;       /* WAIT only */
+};
+
+/* Timeline flags */
+#define AI_TIMELINE_CLOEXEC (1 << 0)
+
+/*
+ * Submission queue of a context. Its jobs run one at a time in submission
+ * order, at its priority and on its engines; separate queues run
+ * concurrently. A failed job does not fail the next one in its queue.
+ */
+struct ai_queue_request {
+    __u32 priority;         /* AI_PRIORITY_*, overrides the submission's */
+    __u32 engine_mask;      /* Bit n allows engine n, 0 = any */
+    __u32 flags;            /* Must be 0 */
+    __u32 queue;            /* CREATE: returned id; DESTROY: id */
+};
+
+/* Completion coalescing for the calling context */
+struct ai_coalesce_request {
+    __u32 max_jobs;         /* Wake waiters once this many jobs finished, 0 or 1 = off */
+    __u32 max_usecs;        /* ... or this long after the first of them */
+};
+
+/*
+ * Status pages
+ *
+ * mmap() of one page, read-only, at AI_MMAP_DEVICE_STATUS maps the device's
+ * status and at AI_MMAP_CONTEXT_STATUS that of the open file. The driver
+ * updates them as jobs finish and memory is allocated, so they can be polled
+ * without system calls. Each field is updated on its own (64-bit fields only
+ * atomically on 64-bit kernels); together they are not a snapshot.
+ */
+#define AI_MMAP_DEVICE_STATUS   0x40000000ULL
+#define AI_MMAP_CONTEXT_STATUS  0x40010000ULL
+
+#define AI_STATUS_VERSION       1
+#define AI_STATUS_MAX_ENGINES   32
+#define AI_STATUS_FENCE_SLOTS   128
+
+struct ai_engine_status {
+    __u64 last_fence;       /* Last job to finish on the engine */
+    __u64 completed;        /* Jobs finished on the engine */
+    __u32 depth;            /* Jobs assigned to the engine, not finished */
+    __u32 reserved;
+};
+
+struct ai_device_status {
+    __u32 version;          /* AI_STATUS_VERSION */
+    __u32 num_engines;
+    struct ai_device_caps caps;     /* As returned by AI_IOC_GET_CAPS */
+    __u64 mem_total;        /* Allocatable device memory, overcommit included */
+    __u64 mem_used;
+    __u64 mem_free;
+    __u64 total_inferences;
+    __u64 total_bytes_processed;
+    __u64 completed_jobs;   /* Whatever their status */
+    __u64 failed_jobs;      /* Errors and timeouts */
+    __u64 timed_out_jobs;
+    struct ai_engine_status engines[AI_STATUS_MAX_ENGINES];
+};
+
+/*
+ * Fences complete out of order, so a context's finished jobs are recorded in
+ * fences[fence % AI_STATUS_FENCE_SLOTS]. A slot holding another fence says
+ * nothing; ask AI_IOC_WAIT. Read fence, then status, then fence again: a
+ * slot being rewritten reads fence 0 or the new fence the second time.
+ */
+struct ai_fence_slot {
+    __u64 fence;
+    __s32 status;           /* AI_STATUS_* the job finished with */
+    __u32 reserved;
+};
+
+struct ai_context_status {
+    __u32 version;          /* AI_STATUS_VERSION */
+    __u32 num_slots;        /* AI_STATUS_FENCE_SLOTS */
+    __u64 submitted;        /* Jobs submitted through this file */
+    __u64 completed;        /* ... and finished */
+    struct ai_fence_slot fences[AI_STATUS_FENCE_SLOTS];
+};
+
 /*
  * IOCTL commands
  */
@@ -133,8 +393,19 @@ struct ai_unload_model_request {
 #define AI_IOC_SUBMIT           _IOWR(AI_IOC_MAGIC, 5, struct ai_inference_request)
 #define AI_IOC_WAIT             _IOWR(AI_IOC_MAGIC, 6, struct ai_wait_request)
 #define AI_IOC_GET_PROFILE      _IOWR(AI_IOC_MAGIC, 7, struct ai_profile_data)
+#define AI_IOC_SUBMIT_CMDBUF    _IOWR(AI_IOC_MAGIC, 8, struct ai_cmdbuf_request)
+#define AI_IOC_EXPORT_BUFFER    _IOWR(AI_IOC_MAGIC, 9, struct ai_export_request)
+#define AI_IOC_IMPORT_BUFFER    _IOWR(AI_IOC_MAGIC, 10, struct ai_import_request)
+#define AI_IOC_REGISTER_USERPTR _IOWR(AI_IOC_MAGIC, 11, struct ai_userptr_request)
+#define AI_IOC_SET_COALESCE     _IOW(AI_IOC_MAGIC, 12, struct ai_coalesce_request)
+#define AI_IOC_WAIT_MULTI       _IOWR(AI_IOC_MAGIC, 13, struct ai_wait_multi_request)
+#define AI_IOC_TIMELINE_CREATE  _IOWR(AI_IOC_MAGIC, 14, struct ai_timeline_request)
+#define AI_IOC_TIMELINE_SIGNAL  _IOW(AI_IOC_MAGIC, 15, struct ai_timeline_request)
+#define AI_IOC_TIMELINE_WAIT    _IOWR(AI_IOC_MAGIC, 16, struct ai_timeline_request)
+#define AI_IOC_CREATE_QUEUE     _IOWR(AI_IOC_MAGIC, 17, struct ai_queue_request)
+#define AI_IOC_DESTROY_QUEUE    _IOW(AI_IOC_MAGIC, 18, struct ai_queue_request)
 
 /* Maximum IOCTL number */
-#define AI_IOC_MAXNR 7
+#define AI_IOC_MAXNR 18
 
 #endif /* _UAPI_AI_ACCEL_H_ */
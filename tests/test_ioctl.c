@@ -0,0 +1,2258 @@
+/*
+ * Behavior tests for the AI Accelerator ioctl interface
+ * Compile: gcc -Wall -I../include test_ioctl.c -o test_ioctl
+ *
+ * Tests that need the device skip when /dev/ai_accel is missing. Tests that
+ * change module parameters skip when they are not writable, and restore them.
+ * The expected timings assume the driver runs in simulate mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "uapi/ai_accel.h"
+
+#define TEST_PASS() printf("[PASS] %s\n", __func__)
+#define TEST_FAIL(msg) do { printf("[FAIL] %s: %s\n", __func__, msg); return 1; } while(0)
+#define TEST_SKIP(msg) do { printf("[SKIP] %s: %s\n", __func__, msg); return 0; } while(0)
+
+#define AI_TEST_DEVICE "/dev/ai_accel"
+#define AI_TEST_PARAMS "/sys/module/ai_accel/parameters/"
+#define AI_TEST_DEBUGFS "/sys/kernel/debug/ai_accel/"
+#define AI_TEST_DMA_PARAMS "/sys/module/ai_dma/parameters/"
+
+/* Open the device or skip the calling test */
+#define OPEN_DEVICE(fd) do { \
+    (fd) = open(AI_TEST_DEVICE, O_RDWR); \
+    if ((fd) < 0) \
+        TEST_SKIP("no " AI_TEST_DEVICE); \
+} while(0)
+
+/* ioctl() returning 0 or -errno */
+static int ai_ioctl(int fd, unsigned long cmd, void *arg)
+{
+    return ioctl(fd, cmd, arg) ? -errno : 0;
+}
+
+/* Module parameter @name as a number, or @def if it cannot be read */
+static long param_get(const char *name, long def)
+{
+    char path[256];
+    long val;
+    FILE *f;
+
+    snprintf(path, sizeof(path), AI_TEST_PARAMS "%s", name);
+    f = fopen(path, "r");
+    if (!f)
+        return def;
+    if (fscanf(f, "%ld", &val) != 1)
+        val = def;
+    fclose(f);
+    return val;
+}
+
+/* Set module parameter @name, 0 or -errno */
+static int param_set(const char *name, long val)
+{
+    char path[256];
+    FILE *f;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), AI_TEST_PARAMS "%s", name);
+    f = fopen(path, "w");
+    if (!f)
+        return -errno;
+    if (fprintf(f, "%ld\n", val) < 0)
+        ret = -EIO;
+    if (fclose(f))
+        ret = -errno;
+    return ret;
+}
+
+/* First line of the file at @path, without the newline; 0 or -1 */
+static int file_read(const char *path, char *buf, size_t len)
+{
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (!fgets(buf, len, f))
+        buf[0] = 0;
+    fclose(f);
+    buf[strcspn(buf, "\n")] = 0;
+    return 0;
+}
+
+/* CLOCK_MONOTONIC, the clock of the profile timestamps, in ns */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Number after "@key:" in the file at @path, or -1 */
+static long long file_get(const char *path, const char *key)
+{
+    char line[256];
+    size_t len = strlen(key);
+    long long val = -1;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, len) && line[len] == ':') {
+            val = strtoll(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return val;
+}
+
+/* Value of @key in the fdinfo of @fd, or -1 */
+static long long fdinfo_get(int fd, const char *key)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+    return file_get(path, key);
+}
+
+static uint64_t buf_alloc(int fd, uint64_t size)
+{
+    struct ai_alloc_request req = { .size = size };
+
+    return ai_ioctl(fd, AI_IOC_ALLOC, &req) ? 0 : req.handle;
+}
+
+static void buf_free(int fd, uint64_t handle)
+{
+    struct ai_free_request req = { .handle = handle };
+
+    ai_ioctl(fd, AI_IOC_FREE, &req);
+}
+
+/* Register host memory, returning 0 or -errno */
+static int userptr_register(int fd, void *ptr, uint64_t size, uint32_t flags,
+                            uint64_t *handle)
+{
+    struct ai_userptr_request req = {
+        .user_ptr = (uintptr_t)ptr,
+        .size = size,
+        .flags = flags,
+    };
+    int ret;
+
+    ret = ai_ioctl(fd, AI_IOC_REGISTER_USERPTR, &req);
+    *handle = req.handle;
+    return ret;
+}
+
+/* Load a model of @size zero bytes */
+static uint64_t model_load(int fd, uint64_t size)
+{
+    struct ai_load_model_request req = { .model_size = size };
+    void *data = calloc(1, size);
+    int ret;
+
+    if (!data)
+        return 0;
+    req.model_data = (uintptr_t)data;
+    ret = ai_ioctl(fd, AI_IOC_LOAD_MODEL, &req);
+    free(data);
+    return ret ? 0 : req.model_handle;
+}
+
+static void model_unload(int fd, uint64_t handle)
+{
+    struct ai_unload_model_request req = { .model_handle = handle };
+
+    ai_ioctl(fd, AI_IOC_UNLOAD_MODEL, &req);
+}
+
+/* A model with an input and an output buffer */
+struct infer_setup {
+    uint64_t model;
+    uint64_t input;
+    uint64_t output;
+};
+
+static int infer_setup(int fd, struct infer_setup *s, uint64_t model_size)
+{
+    s->model = model_load(fd, model_size);
+    s->input = buf_alloc(fd, 4096);
+    s->output = buf_alloc(fd, 4096);
+    return s->model && s->input && s->output ? 0 : -1;
+}
+
+static void infer_teardown(int fd, struct infer_setup *s)
+{
+    if (s->model)
+        model_unload(fd, s->model);
+    if (s->input)
+        buf_free(fd, s->input);
+    if (s->output)
+        buf_free(fd, s->output);
+}
+
+static void infer_req(struct ai_inference_request *req,
+                      const struct infer_setup *s, uint32_t flags)
+{
+    memset(req, 0, sizeof(*req));
+    req->model_handle = s->model;
+    req->input_handle = s->input;
+    req->output_handle = s->output;
+    req->input_size = 4096;
+    req->output_size = 4096;
+    req->flags = flags;
+}
+
+static int fence_wait(int fd, uint64_t fence, uint64_t timeout_ns,
+                      int32_t *status)
+{
+    struct ai_wait_request req = { .fence = fence, .timeout_ns = timeout_ns };
+    int ret;
+
+    ret = ai_ioctl(fd, AI_IOC_WAIT, &req);
+    *status = req.status;
+    return ret;
+}
+
+static int fence_profile(int fd, uint64_t fence, struct ai_profile_data *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->fence = fence;
+    return ai_ioctl(fd, AI_IOC_GET_PROFILE, prof);
+}
+
+/* Profile of @fence once it has finished, without retiring it */
+static int profile_wait(int fd, uint64_t fence, struct ai_profile_data *prof)
+{
+    int ret, ms;
+
+    for (ms = 0; ms < 5000; ms++) {
+        ret = fence_profile(fd, fence, prof);
+        if (ret || prof->end_ns)
+            return ret;
+        usleep(1000);
+    }
+    return -ETIMEDOUT;
+}
+
+/* Submit @n commands with the rest of the request taken from @req */
+static int cmdbuf_submit(int fd, struct ai_cmdbuf_request *req,
+                         struct ai_cmd *cmds, uint32_t n)
+{
+    req->cmds = (uintptr_t)cmds;
+    req->num_cmds = n;
+    return ai_ioctl(fd, AI_IOC_SUBMIT_CMDBUF, req);
+}
+
+static void cmd_copy(struct ai_cmd *cmd, uint32_t op, uint64_t handle,
+                     uint64_t offset, uint64_t size, void *ptr)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = op;
+    cmd->copy.handle = handle;
+    cmd->copy.offset = offset;
+    cmd->copy.size = size;
+    cmd->copy.user_ptr = (uintptr_t)ptr;
+}
+
+static void cmd_fill(struct ai_cmd *cmd, uint64_t handle, uint64_t offset,
+                     uint64_t size, uint8_t pattern)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = AI_CMD_FILL;
+    cmd->fill.handle = handle;
+    cmd->fill.offset = offset;
+    cmd->fill.size = size;
+    cmd->fill.pattern = pattern;
+}
+
+static void cmd_timeline(struct ai_cmd *cmd, uint32_t op, int tl, uint64_t value)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->op = op;
+    cmd->timeline.fd = tl;
+    cmd->timeline.value = value;
+}
+
+/* A new timeline at @value, or -errno */
+static int timeline_create(int fd, uint64_t value)
+{
+    struct ai_timeline_request req = { .value = value };
+    int ret;
+
+    ret = ai_ioctl(fd, AI_IOC_TIMELINE_CREATE, &req);
+    return ret ? ret : req.fd;
+}
+
+/* A queue on the engines in @engine_mask, or -errno */
+static int queue_create(int fd, uint32_t priority, uint32_t engine_mask)
+{
+    struct ai_queue_request req = {
+        .priority = priority,
+        .engine_mask = engine_mask,
+    };
+    int ret;
+
+    ret = ai_ioctl(fd, AI_IOC_CREATE_QUEUE, &req);
+    return ret ? ret : (int)req.queue;
+}
+
+/*
+ * Job timing and request layout (AI_IOC_SUBMIT, AI_IOC_GET_PROFILE)
+ */
+
+/* The request only grows at the end; the original layout ends with fence */
+int test_submit_layout(void)
+{
+    if (offsetof(struct ai_inference_request, fence) + sizeof(__u64) !=
+        AI_INFERENCE_REQUEST_SIZE_V0)
+        TEST_FAIL("AI_INFERENCE_REQUEST_SIZE_V0 does not end at fence");
+    if (sizeof(struct ai_inference_request) != 96)
+        TEST_FAIL("struct ai_inference_request changed size");
+    if (sizeof(struct ai_inference_request) % sizeof(__u64))
+        TEST_FAIL("struct ai_inference_request has tail padding");
+
+    TEST_PASS();
+    return 0;
+}
+
+/* A synchronous job takes at least its modelled time, in order */
+int test_submit_timing(void)
+{
+    struct ai_inference_request req;
+    struct ai_profile_data prof;
+    struct infer_setup s = {};
+    uint64_t model_size = 1 << 20;
+    uint64_t min_ns;
+    int32_t status;
+    int fd, ret;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, model_size))
+        TEST_FAIL("setup failed");
+
+    infer_req(&req, &s, 0);
+    ret = ai_ioctl(fd, AI_IOC_SUBMIT, &req);
+    if (ret)
+        TEST_FAIL("synchronous submit failed");
+    if (!req.fence)
+        TEST_FAIL("no fence returned");
+
+    /* Synchronous jobs stay waitable until retired */
+    if (fence_profile(fd, req.fence, &prof))
+        TEST_FAIL("no profile for an unretired job");
+    if (prof.fence != req.fence)
+        TEST_FAIL("profile of the wrong job");
+    if (!(prof.submit_ns <= prof.start_ns && prof.start_ns <= prof.end_ns))
+        TEST_FAIL("submit, start and end out of order");
+    if (param_get("sim_jitter_pct", -1) == 0) {
+        min_ns = param_get("sim_launch_ns", 0) +
+                 model_size * param_get("sim_compute_ps_per_byte", 0) / 1000;
+        if (prof.end_ns - prof.start_ns < min_ns)
+            TEST_FAIL("job finished before its modelled time");
+    }
+
+    if (fence_wait(fd, req.fence, 0, &status) || status != AI_STATUS_SUCCESS)
+        TEST_FAIL("completed job did not report success");
+
+    /* Waiting retired it */
+    if (fence_profile(fd, req.fence, &prof) != -ENOENT)
+        TEST_FAIL("retired job still has a profile");
+    if (fence_profile(fd, 0, &prof) != -ENOENT)
+        TEST_FAIL("fence 0 has a profile");
+
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/* Binaries built against older or newer headers */
+int test_submit_sizes(void)
+{
+    struct {
+        struct ai_inference_request req;
+        __u64 tail;
+    } big;
+    struct ai_inference_request req;
+    struct infer_setup s = {};
+    unsigned long v0, small, large;
+    int fd;
+
+    v0 = _IOC(_IOC_READ | _IOC_WRITE, AI_IOC_MAGIC, _IOC_NR(AI_IOC_SUBMIT),
+              AI_INFERENCE_REQUEST_SIZE_V0);
+    small = _IOC(_IOC_READ | _IOC_WRITE, AI_IOC_MAGIC, _IOC_NR(AI_IOC_SUBMIT),
+                 AI_INFERENCE_REQUEST_SIZE_V0 - sizeof(__u64));
+    large = _IOC(_IOC_READ | _IOC_WRITE, AI_IOC_MAGIC, _IOC_NR(AI_IOC_SUBMIT),
+                 sizeof(big));
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+
+    /* The fields past version 0 must not be read */
+    infer_req(&req, &s, 0);
+    memset(&req.batch_size, 0xff,
+           sizeof(req) - offsetof(struct ai_inference_request, batch_size));
+    if (ai_ioctl(fd, v0, &req))
+        TEST_FAIL("version 0 request rejected");
+    if (!req.fence)
+        TEST_FAIL("version 0 request got no fence");
+
+    infer_req(&req, &s, 0);
+    if (ai_ioctl(fd, small, &req) != -EINVAL)
+        TEST_FAIL("request smaller than version 0 accepted");
+
+    infer_req(&big.req, &s, 0);
+    big.tail = 0;
+    if (ai_ioctl(fd, large, &big))
+        TEST_FAIL("larger request with a zero tail rejected");
+    big.tail = 1;
+    if (ai_ioctl(fd, large, &big) != -E2BIG)
+        TEST_FAIL("unknown nonzero field not rejected with E2BIG");
+
+    infer_req(&req, &s, 0);
+    req.reserved[1] = 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req) != -EINVAL)
+        TEST_FAIL("nonzero reserved accepted");
+
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Dependencies between jobs (ai_inference_request.in_fences)
+ */
+
+/* A job starts only once its in-fences have signaled */
+int test_in_fences(void)
+{
+    struct ai_inference_request a, b;
+    struct ai_profile_data pa, pb;
+    struct infer_setup s = {};
+    uint64_t fences[AI_MAX_IN_FENCES + 1] = {};
+    int32_t status;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 1 << 20))
+        TEST_FAIL("setup failed");
+
+    infer_req(&a, &s, AI_INFER_ASYNC);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &a))
+        TEST_FAIL("submit failed");
+    infer_req(&b, &s, 0);
+    b.in_fences = (uintptr_t)&a.fence;
+    b.num_in_fences = 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &b))
+        TEST_FAIL("dependent submit failed");
+
+    if (fence_profile(fd, a.fence, &pa) || fence_profile(fd, b.fence, &pb))
+        TEST_FAIL("no profiles");
+    if (pb.start_ns < pa.end_ns)
+        TEST_FAIL("job started before its in-fence signaled");
+
+    /* Fences that were never issued, and too many of them */
+    infer_req(&b, &s, 0);
+    b.in_fences = (uintptr_t)fences;
+    b.num_in_fences = 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &b) != -EINVAL)
+        TEST_FAIL("fence 0 accepted");
+    fences[0] = 1ULL << 62;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &b) != -EINVAL)
+        TEST_FAIL("unissued fence accepted");
+    fences[0] = a.fence;
+    b.num_in_fences = AI_MAX_IN_FENCES + 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &b) != -EINVAL)
+        TEST_FAIL("too many in-fences accepted");
+
+    fence_wait(fd, a.fence, 0, &status);
+    fence_wait(fd, b.fence, 0, &status);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * A job depending on a failed one fails, before and after the failed one is
+ * retired. The failure comes from closing the file of a job held back on a
+ * timeline that never advances.
+ */
+int test_in_fence_failed(void)
+{
+    struct ai_cmdbuf_request creq = { .flags = AI_INFER_ASYNC };
+    struct ai_inference_request b, c;
+    struct infer_setup s = {};
+    struct ai_cmd cmds[2];
+    int fd, fd2, tl;
+    int32_t status;
+
+    OPEN_DEVICE(fd);
+    fd2 = open(AI_TEST_DEVICE, O_RDWR);
+    if (fd2 < 0)
+        TEST_FAIL("second open failed");
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    tl = timeline_create(fd, 0);
+    if (tl < 0)
+        TEST_FAIL("timeline create failed");
+
+    cmd_timeline(&cmds[0], AI_CMD_TIMELINE_WAIT, tl, 1);
+    cmd_fill(&cmds[1], s.input, 0, 4096, 0);
+    if (cmdbuf_submit(fd2, &creq, cmds, 2))
+        TEST_FAIL("held-back submit failed");
+
+    infer_req(&b, &s, AI_INFER_ASYNC);
+    b.in_fences = (uintptr_t)&creq.fence;
+    b.num_in_fences = 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &b))
+        TEST_FAIL("dependent submit failed");
+    if (fence_wait(fd, b.fence, 0, &status) || status != AI_STATUS_PENDING)
+        TEST_FAIL("dependent job ran before its in-fence");
+
+    /* Fails and retires the held-back job */
+    close(fd2);
+    if (fence_wait(fd, b.fence, 1000000000ULL, &status))
+        TEST_FAIL("wait failed");
+    if (status != AI_STATUS_ERROR)
+        TEST_FAIL("job with a failed in-fence did not fail");
+    if (fence_wait(fd, creq.fence, 0, &status) || status != AI_STATUS_ERROR)
+        TEST_FAIL("retired failed job not reported as failed");
+
+    infer_req(&c, &s, 0);
+    c.in_fences = (uintptr_t)&creq.fence;
+    c.num_in_fences = 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &c) != -EIO)
+        TEST_FAIL("job with a retired failed in-fence did not fail");
+
+    close(tl);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Command buffers (AI_IOC_SUBMIT_CMDBUF)
+ */
+
+/* Ops run in order and see each other's results */
+int test_cmdbuf_ops(void)
+{
+    struct ai_cmdbuf_request req = {};
+    uint8_t src[256], dst[520];
+    struct ai_cmd cmds[5];
+    uint64_t value = 0x1122334455667788ULL;
+    uint64_t buf;
+    int fd, i;
+
+    OPEN_DEVICE(fd);
+    buf = buf_alloc(fd, 8192);
+    if (!buf)
+        TEST_FAIL("alloc failed");
+
+    for (i = 0; i < 256; i++)
+        src[i] = i;
+    memset(dst, 0, sizeof(dst));
+    cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 0, 256, src);
+    cmd_fill(&cmds[1], buf, 256, 256, 0xab);
+    memset(&cmds[2], 0, sizeof(cmds[2]));
+    cmds[2].op = AI_CMD_SIGNAL;
+    cmds[2].signal.handle = buf;
+    cmds[2].signal.offset = 512;
+    cmds[2].signal.value = value;
+    memset(&cmds[3], 0, sizeof(cmds[3]));
+    cmds[3].op = AI_CMD_BARRIER;
+    cmd_copy(&cmds[4], AI_CMD_COPY_OUT, buf, 0, sizeof(dst), dst);
+    if (cmdbuf_submit(fd, &req, cmds, 5))
+        TEST_FAIL("submit failed");
+
+    if (memcmp(dst, src, 256))
+        TEST_FAIL("COPY_IN data wrong");
+    for (i = 256; i < 512; i++)
+        if (dst[i] != 0xab)
+            TEST_FAIL("FILL data wrong");
+    if (memcmp(dst + 512, &value, sizeof(value)))
+        TEST_FAIL("SIGNAL value wrong");
+
+    /* Empty, oversized and malformed command buffers */
+    if (cmdbuf_submit(fd, &req, cmds, 0) != -EINVAL)
+        TEST_FAIL("empty command buffer accepted");
+    if (cmdbuf_submit(fd, &req, cmds, AI_MAX_CMDS + 1) != -EINVAL)
+        TEST_FAIL("oversized command buffer accepted");
+    cmds[0].op = 99;
+    if (cmdbuf_submit(fd, &req, cmds, 1) != -EINVAL)
+        TEST_FAIL("unknown op accepted");
+    cmds[2].signal.offset = 4;
+    if (cmdbuf_submit(fd, &req, &cmds[2], 1) != -EINVAL)
+        TEST_FAIL("unaligned SIGNAL accepted");
+    cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 8000, 256, src);
+    if (cmdbuf_submit(fd, &req, cmds, 1) != -EINVAL)
+        TEST_FAIL("copy past the end of the buffer accepted");
+    cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 0, 0, src);
+    if (cmdbuf_submit(fd, &req, cmds, 1) != -EINVAL)
+        TEST_FAIL("empty copy accepted");
+    cmd_fill(&cmds[0], 1ULL << 40, 0, 16, 0);
+    if (cmdbuf_submit(fd, &req, cmds, 1) != -EINVAL)
+        TEST_FAIL("unknown handle accepted");
+
+    buf_free(fd, buf);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Priority classes (ai_inference_request.priority)
+ */
+
+/* A high priority job preempts a long low priority one on the same engine */
+int test_priority_preempt(void)
+{
+    struct ai_inference_request low, high, bad;
+    struct ai_profile_data pl, ph;
+    struct infer_setup sl = {}, sh = {};
+    struct ai_cmdbuf_request creq = {};
+    struct ai_cmd cmd;
+    int32_t status;
+    int fd, ql, qh;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &sl, 16 << 20) || infer_setup(fd, &sh, 4096))
+        TEST_FAIL("setup failed");
+    ql = queue_create(fd, AI_PRIORITY_LOW, 1);
+    qh = queue_create(fd, AI_PRIORITY_HIGH, 1);
+    if (ql < 0 || qh < 0)
+        TEST_FAIL("queue create failed");
+
+    /* About 50 ms of compute at the default simulation speed */
+    infer_req(&low, &sl, AI_INFER_ASYNC);
+    low.batch_size = 32;
+    low.queue = ql;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &low))
+        TEST_FAIL("low priority submit failed");
+    usleep(2000);
+    infer_req(&high, &sh, 0);
+    high.queue = qh;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &high))
+        TEST_FAIL("high priority submit failed");
+
+    /* Waiting would retire the low job, poll its profile instead */
+    if (profile_wait(fd, low.fence, &pl) || fence_profile(fd, high.fence, &ph))
+        TEST_FAIL("no profiles");
+    if (param_get("sim_checkpoint_us", 0) > 0) {
+        if (ph.end_ns >= pl.end_ns)
+            TEST_FAIL("high priority job waited for the low one");
+        if (pl.preemptions == 0)
+            TEST_FAIL("low priority job was not preempted");
+    }
+
+    /* No such class */
+    infer_req(&bad, &sh, 0);
+    bad.priority = AI_PRIORITY_COUNT;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &bad) != -EINVAL)
+        TEST_FAIL("bad priority accepted");
+    cmd_fill(&cmd, sh.input, 0, 16, 0);
+    creq.priority = AI_PRIORITY_COUNT;
+    if (cmdbuf_submit(fd, &creq, &cmd, 1) != -EINVAL)
+        TEST_FAIL("bad command buffer priority accepted");
+
+    fence_wait(fd, low.fence, 0, &status);
+    fence_wait(fd, high.fence, 0, &status);
+    infer_teardown(fd, &sl);
+    infer_teardown(fd, &sh);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Job timeouts (ai_inference_request.timeout_ms)
+ */
+
+/* The watchdog fails a job that runs too long; the engine keeps working */
+int test_job_timeout(void)
+{
+    struct ai_inference_request req, dep;
+    struct infer_setup slow = {}, fast = {};
+    int32_t status;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &slow, 16 << 20) || infer_setup(fd, &fast, 4096))
+        TEST_FAIL("setup failed");
+
+    /* About 50 ms of compute against a 5 ms limit */
+    infer_req(&req, &slow, AI_INFER_ASYNC);
+    req.batch_size = 32;
+    req.timeout_ms = 5;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req))
+        TEST_FAIL("submit failed");
+    if (fence_wait(fd, req.fence, 0, &status) || status != AI_STATUS_PENDING)
+        TEST_FAIL("poll of a running job did not report pending");
+
+    infer_req(&dep, &fast, 0);
+    dep.in_fences = (uintptr_t)&req.fence;
+    dep.num_in_fences = 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &dep) != -EIO)
+        TEST_FAIL("job depending on a timed-out one did not fail");
+    if (fence_wait(fd, req.fence, 0, &status) || status != AI_STATUS_TIMEOUT)
+        TEST_FAIL("timed-out job not reported as such");
+
+    /* Synchronous submitters learn of it from the ioctl */
+    infer_req(&req, &slow, 0);
+    req.batch_size = 32;
+    req.timeout_ms = 5;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req) != -ETIMEDOUT)
+        TEST_FAIL("synchronous submit did not time out");
+    fence_wait(fd, req.fence, 0, &status);
+
+    infer_req(&req, &fast, 0);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req))
+        TEST_FAIL("engine did not recover");
+    fence_wait(fd, req.fence, 0, &status);
+
+    infer_teardown(fd, &slow);
+    infer_teardown(fd, &fast);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Memory accounting and quotas (AI_IOC_ALLOC, AI_IOC_FREE, fdinfo)
+ */
+
+/* Allocations are charged to the context until freed */
+int test_mem_accounting(void)
+{
+    struct ai_alloc_request req = {};
+    struct ai_free_request freq = {};
+    struct ai_device_caps caps;
+    long long used;
+    uint64_t buf;
+    long hard;
+    int fd, ret;
+
+    OPEN_DEVICE(fd);
+    if (ai_ioctl(fd, AI_IOC_GET_CAPS, &caps))
+        TEST_FAIL("get caps failed");
+    used = fdinfo_get(fd, "ai-mem-used");
+    if (used < 0)
+        TEST_FAIL("no ai-mem-used in fdinfo");
+
+    buf = buf_alloc(fd, 1 << 20);
+    if (!buf)
+        TEST_FAIL("alloc failed");
+    if (fdinfo_get(fd, "ai-mem-used") != used + (1 << 20))
+        TEST_FAIL("allocation not charged");
+    if (fdinfo_get(fd, "ai-mem-peak") < used + (1 << 20))
+        TEST_FAIL("peak below current use");
+    if (fdinfo_get(fd, "ai-uid-mem-used") < (1 << 20))
+        TEST_FAIL("allocation not charged to the user");
+    buf_free(fd, buf);
+    if (fdinfo_get(fd, "ai-mem-used") != used)
+        TEST_FAIL("free not uncharged");
+
+    /* Sizes out of range and unknown handles */
+    req.size = 0;
+    if (ai_ioctl(fd, AI_IOC_ALLOC, &req) != -EINVAL)
+        TEST_FAIL("empty allocation accepted");
+    req.size = caps.max_alloc_size + 1;
+    if (ai_ioctl(fd, AI_IOC_ALLOC, &req) != -EINVAL)
+        TEST_FAIL("allocation above max_alloc_size accepted");
+    freq.handle = 1ULL << 40;
+    if (ai_ioctl(fd, AI_IOC_FREE, &freq) != -EINVAL)
+        TEST_FAIL("free of an unknown handle accepted");
+
+    /* Hard limit, if this test may change it */
+    hard = param_get("ctx_mem_hard_mb", -1);
+    if (hard >= 0 && param_set("ctx_mem_hard_mb", 1) == 0) {
+        req.size = 2 << 20;
+        ret = ai_ioctl(fd, AI_IOC_ALLOC, &req);
+        if (!ret)
+            buf_free(fd, req.handle);
+        param_set("ctx_mem_hard_mb", hard);
+        if (ret != -EDQUOT)
+            TEST_FAIL("allocation above the hard limit not refused");
+    }
+
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Device memory overcommit (mem_overcommit_pct)
+ */
+
+/* Beyond device memory, idle buffers are evicted and brought back intact */
+int test_mem_overcommit(void)
+{
+    struct ai_cmdbuf_request req = {};
+    uint64_t bufs[16] = {};
+    uint8_t page[4096];
+    struct ai_cmd cmds[2];
+    uint64_t size = 256 << 20;
+    long pct;
+    int fd, n, i, ret = 0;
+
+    OPEN_DEVICE(fd);
+    pct = param_get("mem_overcommit_pct", -1);
+    if (pct < 0 || param_set("mem_overcommit_pct", 100)) {
+        close(fd);
+        TEST_SKIP("mem_overcommit_pct not writable");
+    }
+
+    /* Fill device memory; the first buffer becomes the coldest */
+    for (n = 0; n < 8; n++) {
+        bufs[n] = buf_alloc(fd, size);
+        if (!bufs[n])
+            break;
+        if (n == 0) {
+            cmd_fill(&cmds[0], bufs[0], 0, 4096, 0x5a);
+            cmd_fill(&cmds[1], bufs[0], size - 4096, 4096, 0x5a);
+            if (cmdbuf_submit(fd, &req, cmds, 2))
+                ret = 4;
+        }
+    }
+    if (!ret && (n == 8 || n == 0))
+        ret = 1;
+
+    /* Without overcommit that was all; with it there is room for more */
+    if (!ret && param_set("mem_overcommit_pct", 200) == 0) {
+        bufs[n] = buf_alloc(fd, size);
+        if (bufs[n])
+            n++;
+        else
+            ret = 2;
+    }
+
+    if (!ret) {
+        cmd_copy(&cmds[0], AI_CMD_COPY_OUT, bufs[0], size - 4096, 4096, page);
+        memset(page, 0, sizeof(page));
+        if (cmdbuf_submit(fd, &req, cmds, 1))
+            ret = 3;
+        for (i = 0; !ret && i < 4096; i++)
+            if (page[i] != 0x5a)
+                ret = 3;
+    }
+
+    for (i = 0; i < n; i++)
+        buf_free(fd, bufs[i]);
+    param_set("mem_overcommit_pct", pct);
+    close(fd);
+
+    if (ret == 1)
+        TEST_FAIL("device memory limit not enforced without overcommit");
+    if (ret == 2)
+        TEST_FAIL("overcommitted allocation failed");
+    if (ret == 3)
+        TEST_FAIL("evicted buffer lost its contents");
+    if (ret == 4)
+        TEST_FAIL("fill failed");
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * dma-buf sharing (AI_IOC_EXPORT_BUFFER, AI_IOC_IMPORT_BUFFER)
+ */
+
+/* An exported buffer can be mapped and imported with its contents */
+int test_dmabuf_export_import(void)
+{
+    struct ai_export_request exp = {};
+    struct ai_import_request imp = {};
+    struct ai_cmdbuf_request req = {};
+    uint8_t page[4096];
+    struct ai_cmd cmd;
+    uint8_t *map;
+    uint64_t buf;
+    int fd, i;
+
+    OPEN_DEVICE(fd);
+    buf = buf_alloc(fd, 8192);
+    if (!buf)
+        TEST_FAIL("alloc failed");
+    cmd_fill(&cmd, buf, 0, 8192, 0x3c);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("fill failed");
+
+    exp.handle = buf;
+    exp.flags = AI_EXPORT_CLOEXEC;
+    if (ai_ioctl(fd, AI_IOC_EXPORT_BUFFER, &exp))
+        TEST_FAIL("export failed");
+    if (!(fcntl(exp.fd, F_GETFD) & FD_CLOEXEC))
+        TEST_FAIL("AI_EXPORT_CLOEXEC not honored");
+
+    map = mmap(NULL, 8192, PROT_READ, MAP_SHARED, exp.fd, 0);
+    if (map == MAP_FAILED)
+        TEST_FAIL("mmap of the dma-buf failed");
+    for (i = 0; i < 8192; i++)
+        if (map[i] != 0x3c)
+            TEST_FAIL("dma-buf mapping does not show the buffer");
+    munmap(map, 8192);
+
+    /* Our own dma-buf comes back as the same buffer */
+    imp.fd = exp.fd;
+    if (ai_ioctl(fd, AI_IOC_IMPORT_BUFFER, &imp))
+        TEST_FAIL("import failed");
+    if (imp.size != 8192)
+        TEST_FAIL("imported size wrong");
+    cmd_fill(&cmd, buf, 4096, 4096, 0x77);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("fill failed");
+    cmd_copy(&cmd, AI_CMD_COPY_OUT, imp.handle, 4096, 4096, page);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("copy out of the import failed");
+    for (i = 0; i < 4096; i++)
+        if (page[i] != 0x77)
+            TEST_FAIL("import does not share the buffer");
+
+    /* Unknown flags, handles and fds */
+    exp.flags = 1 << 7;
+    if (ai_ioctl(fd, AI_IOC_EXPORT_BUFFER, &exp) != -EINVAL)
+        TEST_FAIL("unknown export flag accepted");
+    exp.flags = 0;
+    exp.handle = 1ULL << 40;
+    if (ai_ioctl(fd, AI_IOC_EXPORT_BUFFER, &exp) != -EINVAL)
+        TEST_FAIL("export of an unknown handle accepted");
+    imp.flags = 1;
+    if (ai_ioctl(fd, AI_IOC_IMPORT_BUFFER, &imp) != -EINVAL)
+        TEST_FAIL("import flags accepted");
+    imp.flags = 0;
+    imp.fd = -1;
+    if (ai_ioctl(fd, AI_IOC_IMPORT_BUFFER, &imp) != -EBADF)
+        TEST_FAIL("import of a bad fd accepted");
+
+    buf_free(fd, imp.handle);
+    buf_free(fd, buf);
+    close(exp.fd);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Registered host memory (AI_IOC_REGISTER_USERPTR)
+ */
+
+/* The device reads and writes registered memory in place */
+int test_userptr(void)
+{
+    struct ai_cmdbuf_request req = {};
+    struct ai_export_request exp = {};
+    struct ai_inference_request ireq;
+    struct infer_setup s = {};
+    uint64_t rw, ro, dummy;
+    uint8_t out[4096];
+    struct ai_cmd cmd;
+    uint8_t *host;
+    int fd, i;
+
+    OPEN_DEVICE(fd);
+    host = mmap(NULL, 8192, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (host == MAP_FAILED)
+        TEST_FAIL("mmap failed");
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    if (userptr_register(fd, host, 8192, 0, &rw))
+        TEST_FAIL("register failed");
+
+    cmd_fill(&cmd, rw, 100, 4000, 0xe1);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("fill of registered memory failed");
+    if (host[99] != 0 || host[100] != 0xe1 || host[4099] != 0xe1 ||
+        host[4100] != 0)
+        TEST_FAIL("fill did not land in host memory");
+
+    /* Read-only memory is a source only */
+    memset(host + 4096, 0x42, 4096);
+    if (userptr_register(fd, host + 4096, 4096, AI_USERPTR_READ_ONLY, &ro))
+        TEST_FAIL("read-only register failed");
+    cmd_copy(&cmd, AI_CMD_COPY_OUT, ro, 0, 4096, out);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("copy out of read-only memory failed");
+    for (i = 0; i < 4096; i++)
+        if (out[i] != 0x42)
+            TEST_FAIL("device did not read host memory");
+    cmd_fill(&cmd, ro, 0, 16, 0);
+    if (cmdbuf_submit(fd, &req, &cmd, 1) != -EINVAL)
+        TEST_FAIL("write to read-only memory accepted");
+    infer_req(&ireq, &s, 0);
+    ireq.output_handle = ro;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &ireq) != -EINVAL)
+        TEST_FAIL("read-only memory accepted as an output");
+
+    /* Bad flags and sizes; host memory is not exported */
+    if (userptr_register(fd, host, 8192, 1 << 5, &dummy) != -EINVAL)
+        TEST_FAIL("unknown flag accepted");
+    if (userptr_register(fd, host, 0, 0, &dummy) != -EINVAL)
+        TEST_FAIL("empty range accepted");
+    exp.handle = rw;
+    if (ai_ioctl(fd, AI_IOC_EXPORT_BUFFER, &exp) != -EINVAL)
+        TEST_FAIL("export of registered memory accepted");
+
+    buf_free(fd, rw);
+    buf_free(fd, ro);
+    infer_teardown(fd, &s);
+    munmap(host, 8192);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Pinned user range cache (COPY_OUT destinations)
+ */
+
+/* Repeated copies reuse the pin, and remapping the range invalidates it */
+int test_pin_cache(void)
+{
+    struct ai_cmdbuf_request req = {};
+    struct ai_cmd cmds[2];
+    long long hits;
+    uint8_t *host, *again;
+    uint64_t buf;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    buf = buf_alloc(fd, 4096);
+    host = mmap(NULL, 8192, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!buf || host == MAP_FAILED)
+        TEST_FAIL("setup failed");
+
+    cmd_fill(&cmds[0], buf, 0, 4096, 0x21);
+    cmd_copy(&cmds[1], AI_CMD_COPY_OUT, buf, 0, 4096, host);
+    if (cmdbuf_submit(fd, &req, cmds, 2) || host[4095] != 0x21)
+        TEST_FAIL("copy out failed");
+    hits = file_get(AI_TEST_DEBUGFS "pin_cache", "hits");
+    if (cmdbuf_submit(fd, &req, cmds, 2))
+        TEST_FAIL("second copy out failed");
+    if (hits >= 0 && file_get(AI_TEST_DEBUGFS "pin_cache", "hits") <= hits)
+        TEST_FAIL("second copy to the same range missed the cache");
+
+    /* New pages at the same address must receive the next copy */
+    again = mmap(host, 4096, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (again != host)
+        TEST_FAIL("remap failed");
+    cmd_fill(&cmds[0], buf, 0, 4096, 0x22);
+    if (cmdbuf_submit(fd, &req, cmds, 2))
+        TEST_FAIL("copy out after remap failed");
+    if (host[0] != 0x22 || host[4095] != 0x22)
+        TEST_FAIL("copy went to the pages unmapped from the range");
+
+    /* Nothing mapped there */
+    munmap(host, 4096);
+    if (cmdbuf_submit(fd, &req, &cmds[1], 1) != -EFAULT)
+        TEST_FAIL("copy out to unmapped memory accepted");
+
+    munmap(host + 4096, 4096);
+    buf_free(fd, buf);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Large and unaligned registered ranges
+ */
+
+/* Ranges spanning many pages, and starting mid-page, are mapped exactly */
+int test_userptr_large(void)
+{
+    struct ai_cmdbuf_request req = {};
+    size_t size = 8 << 20;
+    uint64_t big, odd, dummy;
+    struct ai_cmd cmd;
+    uint8_t *host;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    host = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (host == MAP_FAILED)
+        TEST_FAIL("mmap failed");
+    /* Contiguous pages, if any, make fewer segments */
+    madvise(host, size, MADV_HUGEPAGE);
+    memset(host, 0, size);
+
+    if (userptr_register(fd, host, size, 0, &big))
+        TEST_FAIL("large register failed");
+    cmd_fill(&cmd, big, size - 3 * 4096 - 7, 3 * 4096, 0x9d);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("fill failed");
+    if (host[size - 3 * 4096 - 8] != 0 || host[size - 3 * 4096 - 7] != 0x9d ||
+        host[size - 8] != 0x9d || host[size - 7] != 0)
+        TEST_FAIL("fill of a large range misplaced");
+
+    if (userptr_register(fd, host + 100, 3 * 4096, 0, &odd))
+        TEST_FAIL("unaligned register failed");
+    cmd_fill(&cmd, odd, 0, 3 * 4096, 0x5e);
+    if (cmdbuf_submit(fd, &req, &cmd, 1))
+        TEST_FAIL("fill failed");
+    if (host[99] != 0 || host[100] != 0x5e || host[100 + 3 * 4096 - 1] != 0x5e ||
+        host[100 + 3 * 4096] != 0)
+        TEST_FAIL("fill of an unaligned range misplaced");
+    cmd_fill(&cmd, odd, 1, 3 * 4096, 0);
+    if (cmdbuf_submit(fd, &req, &cmd, 1) != -EINVAL)
+        TEST_FAIL("fill past the registered range accepted");
+
+    /* A range with a hole cannot be pinned */
+    buf_free(fd, big);
+    buf_free(fd, odd);
+    munmap(host + (4 << 20), 4096);
+    if (userptr_register(fd, host, size, 0, &dummy) != -EFAULT)
+        TEST_FAIL("range with a hole registered");
+
+    munmap(host, size);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * DMA engine self-test (ai_dma dma_selftest=1)
+ */
+
+/* Single, striped, asynchronous and listed copies all check out */
+int test_dma_selftest(void)
+{
+    char enabled[8], result[64], msg[128];
+
+    if (file_read(AI_TEST_DMA_PARAMS "dma_selftest_result", result,
+                  sizeof(result)))
+        TEST_SKIP("ai_dma not loaded");
+    if (file_read(AI_TEST_DMA_PARAMS "dma_selftest", enabled,
+                  sizeof(enabled)) || strcmp(enabled, "Y"))
+        TEST_SKIP("ai_dma loaded without dma_selftest=1");
+
+    /* A failure names the copy that failed and its error */
+    if (strcmp(result, "passed")) {
+        snprintf(msg, sizeof(msg), "self-test %s", result);
+        TEST_FAIL(msg);
+    }
+
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * CPU copy engine (ai_dma sw_dma_force=1)
+ */
+
+/* Threads whose name starts with @prefix */
+static int count_threads(const char *prefix)
+{
+    char path[300], comm[32];
+    struct dirent *de;
+    DIR *dir;
+    int n = 0;
+
+    dir = opendir("/proc");
+    if (!dir)
+        return -1;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] < '1' || de->d_name[0] > '9')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s/comm", de->d_name);
+        if (!file_read(path, comm, sizeof(comm)) &&
+            !strncmp(comm, prefix, strlen(prefix)))
+            n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+/* The forced CPU engine runs its threads and passes the self-test */
+int test_dma_cpu_engine(void)
+{
+    char forced[8], enabled[8], result[64], msg[128];
+    long threads;
+    int n;
+
+    if (file_read(AI_TEST_DMA_PARAMS "sw_dma_force", forced, sizeof(forced)))
+        TEST_SKIP("ai_dma not loaded");
+    if (strcmp(forced, "Y"))
+        TEST_SKIP("ai_dma loaded without sw_dma_force=1");
+
+    n = count_threads("ai_dma_cpu/");
+    if (n == 0)
+        TEST_FAIL("no CPU copy engine threads");
+    if (file_read(AI_TEST_DMA_PARAMS "sw_dma_threads", msg, sizeof(msg)) == 0) {
+        threads = strtol(msg, NULL, 10);
+        if (threads > 0 && threads <= 8 && n != threads)
+            TEST_FAIL("sw_dma_threads not honored");
+        if (n > 8)
+            TEST_FAIL("more than 8 CPU copy engine threads");
+    }
+
+    if (!file_read(AI_TEST_DMA_PARAMS "dma_selftest", enabled,
+                   sizeof(enabled)) && !strcmp(enabled, "Y") &&
+        !file_read(AI_TEST_DMA_PARAMS "dma_selftest_result", result,
+                   sizeof(result)) && strcmp(result, "passed")) {
+        snprintf(msg, sizeof(msg), "self-test on the CPU engine %s", result);
+        TEST_FAIL(msg);
+    }
+
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Batched transfer lists (ai_dma_transfer_list)
+ */
+
+/* The self-test's last step copies a list of pieces of one transfer */
+int test_dma_xfer_list(void)
+{
+    char enabled[8], result[64], msg[128];
+
+    if (file_read(AI_TEST_DMA_PARAMS "dma_selftest_result", result,
+                  sizeof(result)))
+        TEST_SKIP("ai_dma not loaded");
+    if (file_read(AI_TEST_DMA_PARAMS "dma_selftest", enabled,
+                  sizeof(enabled)) || strcmp(enabled, "Y"))
+        TEST_SKIP("ai_dma loaded without dma_selftest=1");
+
+    if (!strncmp(result, "failed at list", 14)) {
+        snprintf(msg, sizeof(msg), "transfer list %s", result);
+        TEST_FAIL(msg);
+    }
+    if (strcmp(result, "passed"))
+        TEST_SKIP("self-test failed before the transfer list");
+
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Copy and compute overlap (copy_overlap)
+ */
+
+/* On a busy engine, a job's input DMA runs during the previous compute */
+int test_copy_overlap(void)
+{
+    uint64_t io = 12 << 20, model_size = 10 << 20;
+    uint64_t models[16] = {}, first[32] = {}, last[32] = {}, busy[32] = {};
+    int jobs[32] = {};
+    struct ai_inference_request req[16];
+    struct ai_profile_data prof;
+    struct ai_device_caps caps;
+    uint64_t input, output;
+    int fd, n, i, e, ret = 0;
+    int32_t status;
+
+    OPEN_DEVICE(fd);
+    if (param_get("copy_overlap", 1) == 0 || param_get("sim_dma_mbps", 1) == 0) {
+        close(fd);
+        TEST_SKIP("copy_overlap or simulated DMA time is off");
+    }
+    if (ai_ioctl(fd, AI_IOC_GET_CAPS, &caps) || caps.num_engines > 8) {
+        close(fd);
+        TEST_SKIP("more than 8 engines");
+    }
+
+    /* Two jobs per engine, each about 1 ms in every stage */
+    n = 2 * caps.num_engines;
+    input = buf_alloc(fd, io);
+    output = buf_alloc(fd, io);
+    if (!input || !output)
+        TEST_FAIL("alloc failed");
+    for (i = 0; i < n; i++) {
+        /* Distinct models are not batched together */
+        models[i] = model_load(fd, model_size);
+        if (!models[i])
+            TEST_FAIL("model load failed");
+    }
+    for (i = 0; i < n; i++) {
+        memset(&req[i], 0, sizeof(req[i]));
+        req[i].model_handle = models[i];
+        req[i].input_handle = input;
+        req[i].output_handle = output;
+        req[i].input_size = io;
+        req[i].output_size = io;
+        req[i].flags = AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC;
+        if (ai_ioctl(fd, AI_IOC_SUBMIT, &req[i]))
+            TEST_FAIL("submit failed");
+    }
+
+    for (i = 0; i < n && !ret; i++) {
+        ret = profile_wait(fd, req[i].fence, &prof);
+        e = prof.engine_id % 32;
+        if (!first[e] || prof.start_ns < first[e])
+            first[e] = prof.start_ns;
+        if (prof.end_ns > last[e])
+            last[e] = prof.end_ns;
+        busy[e] += prof.end_ns - prof.start_ns;
+        jobs[e]++;
+    }
+    for (i = 0; i < n; i++) {
+        fence_wait(fd, req[i].fence, 0, &status);
+        model_unload(fd, models[i]);
+    }
+    buf_free(fd, input);
+    buf_free(fd, output);
+    close(fd);
+    if (ret)
+        TEST_FAIL("no profiles");
+
+    /* Back to back, an engine would take as long as its jobs added up */
+    for (e = 0; e < 32; e++) {
+        if (jobs[e] > 1 && last[e] - first[e] >= busy[e] * 9 / 10)
+            TEST_FAIL("jobs on an engine did not overlap");
+    }
+
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Completion coalescing (AI_IOC_SET_COALESCE)
+ */
+
+/* A lone job is woken max_usecs after it finished; a full batch at once */
+int test_coalesce(void)
+{
+    struct ai_coalesce_request co = { .max_jobs = 4, .max_usecs = 20000 };
+    struct ai_inference_request req[4];
+    struct ai_profile_data prof;
+    struct infer_setup s = {};
+    long long held, batches;
+    uint64_t woken;
+    int32_t status;
+    int fd, i;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    if (ai_ioctl(fd, AI_IOC_SET_COALESCE, &co))
+        TEST_FAIL("set coalesce failed");
+    if (fdinfo_get(fd, "ai-coalesce-jobs") != 4 ||
+        fdinfo_get(fd, "ai-coalesce-usecs") != 20000)
+        TEST_FAIL("fdinfo does not show the setting");
+    held = fdinfo_get(fd, "ai-coalesce-held");
+    batches = fdinfo_get(fd, "ai-coalesce-batches");
+
+    infer_req(&req[0], &s, 0);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req[0]))
+        TEST_FAIL("submit failed");
+    woken = now_ns();
+    if (fence_profile(fd, req[0].fence, &prof))
+        TEST_FAIL("no profile");
+    if (woken - prof.end_ns < 18000000)
+        TEST_FAIL("lone job woken before max_usecs");
+    fence_wait(fd, req[0].fence, 0, &status);
+
+    for (i = 0; i < 4; i++) {
+        infer_req(&req[i], &s, AI_INFER_ASYNC);
+        if (ai_ioctl(fd, AI_IOC_SUBMIT, &req[i]))
+            TEST_FAIL("submit failed");
+    }
+    for (i = 0; i < 4; i++)
+        if (fence_wait(fd, req[i].fence, 1000000000ULL, &status) ||
+            status != AI_STATUS_SUCCESS)
+            TEST_FAIL("coalesced job not completed");
+    if (fdinfo_get(fd, "ai-coalesce-held") != held + 5)
+        TEST_FAIL("held wakeups not counted");
+    if (fdinfo_get(fd, "ai-coalesce-batches") < batches + 2)
+        TEST_FAIL("batched wakeups not counted");
+
+    /* Too many jobs, too long, and a batch without a time bound */
+    co.max_jobs = 257;
+    if (ai_ioctl(fd, AI_IOC_SET_COALESCE, &co) != -EINVAL)
+        TEST_FAIL("max_jobs above the pending limit accepted");
+    co.max_jobs = 4;
+    co.max_usecs = 100001;
+    if (ai_ioctl(fd, AI_IOC_SET_COALESCE, &co) != -EINVAL)
+        TEST_FAIL("max_usecs above 100 ms accepted");
+    co.max_usecs = 0;
+    if (ai_ioctl(fd, AI_IOC_SET_COALESCE, &co) != -EINVAL)
+        TEST_FAIL("batch without a time bound accepted");
+
+    co.max_jobs = 0;
+    if (ai_ioctl(fd, AI_IOC_SET_COALESCE, &co) ||
+        fdinfo_get(fd, "ai-coalesce-jobs") != 0)
+        TEST_FAIL("coalescing not turned off");
+
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Busy-polling waits (AI_WAIT_BUSY_POLL)
+ */
+
+/* A busy-polling wait spins once, within its budget, and is counted */
+int test_wait_busy_poll(void)
+{
+    struct ai_wait_request wait = {};
+    struct ai_inference_request req;
+    struct infer_setup s = {};
+    long long before, after;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    before = fdinfo_get(fd, "ai-busy-poll-hits") +
+             fdinfo_get(fd, "ai-busy-poll-misses");
+
+    infer_req(&req, &s, AI_INFER_ASYNC);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req))
+        TEST_FAIL("submit failed");
+    wait.fence = req.fence;
+    wait.timeout_ns = 1000000000ULL;
+    wait.flags = AI_WAIT_BUSY_POLL;
+    if (ai_ioctl(fd, AI_IOC_WAIT, &wait) || wait.status != AI_STATUS_SUCCESS)
+        TEST_FAIL("busy-polling wait failed");
+
+    after = fdinfo_get(fd, "ai-busy-poll-hits") +
+            fdinfo_get(fd, "ai-busy-poll-misses");
+    if (after != before + (param_get("wait_busy_poll_us", 0) ? 1 : 0))
+        TEST_FAIL("spin not counted once");
+
+    /* Flags AI_IOC_WAIT does not take, and fences never issued */
+    wait.flags = AI_WAIT_ALL;
+    if (ai_ioctl(fd, AI_IOC_WAIT, &wait) != -EINVAL)
+        TEST_FAIL("AI_WAIT_ALL accepted by a single wait");
+    wait.flags = 1 << 7;
+    if (ai_ioctl(fd, AI_IOC_WAIT, &wait) != -EINVAL)
+        TEST_FAIL("unknown wait flag accepted");
+    wait.flags = AI_WAIT_BUSY_POLL;
+    wait.fence = 0;
+    if (ai_ioctl(fd, AI_IOC_WAIT, &wait) != -EINVAL)
+        TEST_FAIL("wait on fence 0 accepted");
+    wait.fence = 1ULL << 62;
+    if (ai_ioctl(fd, AI_IOC_WAIT, &wait) != -EINVAL)
+        TEST_FAIL("wait on an unissued fence accepted");
+
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Inline copies and the staging pool (AI_CMD_FLAG_INLINE)
+ */
+
+/* Small copies can travel in the command stream, large ones are staged */
+int test_cmdbuf_inline(void)
+{
+    struct ai_cmdbuf_request req = {};
+    struct ai_profile_data prof;
+    struct ai_cmd cmds[20];
+    uint8_t data[100], out[100];
+    uint8_t *big;
+    uint32_t slots = (sizeof(data) + sizeof(struct ai_cmd) - 1) /
+                     sizeof(struct ai_cmd);
+    uint64_t buf;
+    int32_t status;
+    int fd, i;
+
+    OPEN_DEVICE(fd);
+    buf = buf_alloc(fd, 16384);
+    big = calloc(1, 8192);
+    if (!buf || !big)
+        TEST_FAIL("setup failed");
+
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = 3 * i;
+    cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 0, sizeof(data), NULL);
+    cmds[0].flags = AI_CMD_FLAG_INLINE;
+    memset(&cmds[1], 0, slots * sizeof(struct ai_cmd));
+    memcpy(&cmds[1], data, sizeof(data));
+    cmd_copy(&cmds[1 + slots], AI_CMD_COPY_OUT, buf, 0, sizeof(out), out);
+    if (cmdbuf_submit(fd, &req, cmds, 2 + slots))
+        TEST_FAIL("inline submit failed");
+    if (memcmp(out, data, sizeof(data)))
+        TEST_FAIL("inline data wrong");
+    if (fence_profile(fd, req.fence, &prof) ||
+        !(prof.xfer_strategies & AI_XFER_INLINE))
+        TEST_FAIL("inline transfer not reported");
+    fence_wait(fd, req.fence, 0, &status);
+
+    /* A bounced copy leaves its staging buffer in the pool */
+    if (param_get("xfer_pack_max", 4096) < 8192) {
+        cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 0, 8192, big);
+        if (cmdbuf_submit(fd, &req, cmds, 1))
+            TEST_FAIL("staged submit failed");
+        if (fdinfo_get(fd, "ai-staging-pool") < 8192)
+            TEST_FAIL("staging buffer not pooled");
+    }
+
+    /* Too large, cut short, on the wrong op, and unknown flags */
+    cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 0, AI_CMD_INLINE_MAX + 1, NULL);
+    cmds[0].flags = AI_CMD_FLAG_INLINE;
+    if (cmdbuf_submit(fd, &req, cmds, 20) != -EINVAL)
+        TEST_FAIL("oversized inline copy accepted");
+    cmds[0].copy.size = sizeof(data);
+    if (cmdbuf_submit(fd, &req, cmds, slots) != -EINVAL)
+        TEST_FAIL("inline copy beyond the last entry accepted");
+    cmd_fill(&cmds[0], buf, 0, 16, 0);
+    cmds[0].flags = AI_CMD_FLAG_INLINE;
+    if (cmdbuf_submit(fd, &req, cmds, 2) != -EINVAL)
+        TEST_FAIL("inline fill accepted");
+    cmds[0].flags = 1 << 7;
+    if (cmdbuf_submit(fd, &req, cmds, 1) != -EINVAL)
+        TEST_FAIL("unknown command flag accepted");
+
+    free(big);
+    buf_free(fd, buf);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/* A burst of large copies leaves no more than staging_pool_max_kb pooled */
+int test_staging_pool_cap(void)
+{
+    static const uint64_t sizes[] = {
+        1 << 20, 1 << 20, 1 << 20, 1 << 20,
+        1 << 20, 1 << 20, 512 << 10, 2 << 20,
+    };
+    struct ai_cmd cmds[sizeof(sizes) / sizeof(sizes[0])];
+    struct ai_cmdbuf_request req = {};
+    uint64_t buf, off, cap;
+    int32_t status;
+    uint8_t *src;
+    int fd, i, n;
+
+    OPEN_DEVICE(fd);
+    buf = buf_alloc(fd, 8 << 20);
+    src = calloc(1, 2 << 20);
+    if (!buf || !src)
+        TEST_FAIL("setup failed");
+    cap = param_get("staging_pool_max_kb", 4096) << 10;
+
+    n = sizeof(sizes) / sizeof(sizes[0]);
+    for (i = 0, off = 0; i < n; off += sizes[i], i++)
+        cmd_copy(&cmds[i], AI_CMD_COPY_IN, buf, off, sizes[i], src);
+    for (i = 0; i < 3; i++) {
+        if (cmdbuf_submit(fd, &req, cmds, n))
+            TEST_FAIL("burst submit failed");
+        fence_wait(fd, req.fence, 1000000000ULL, &status);
+        if ((uint64_t)fdinfo_get(fd, "ai-staging-pool") > cap)
+            TEST_FAIL("staging pool grew past staging_pool_max_kb");
+    }
+
+    free(src);
+    buf_free(fd, buf);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * COPY_IN transfer strategies (AI_XFER_*, AI_CMD_FLAG_DEFER_READ)
+ */
+
+/* COPY_IN of @size bytes from @src, then back; the strategies used, or -1 */
+static int copy_in_strategy(int fd, uint64_t buf, uint8_t *src, uint8_t *dst,
+                            uint64_t size, uint32_t flags)
+{
+    struct ai_cmdbuf_request req = {};
+    struct ai_profile_data prof;
+    struct ai_cmd cmds[2];
+    int32_t status;
+    int ret;
+
+    cmd_copy(&cmds[0], AI_CMD_COPY_IN, buf, 0, size, src);
+    cmds[0].flags = flags;
+    cmd_copy(&cmds[1], AI_CMD_COPY_OUT, buf, 0, size, dst);
+    memset(dst, 0, size);
+    if (cmdbuf_submit(fd, &req, cmds, 2))
+        return -1;
+    ret = fence_profile(fd, req.fence, &prof);
+    fence_wait(fd, req.fence, 0, &status);
+    if (ret || memcmp(src, dst, size))
+        return -1;
+    return prof.xfer_strategies;
+}
+
+/* Copies are packed, bounced or read when the job runs, by size */
+int test_xfer_strategies(void)
+{
+    struct ai_cmdbuf_request req = {};
+    uint64_t size = 2 << 20, pin_min;
+    struct ai_cmd cmd;
+    uint8_t *src, *dst;
+    uint64_t buf, i;
+    long long pool;
+    int fd, ret;
+
+    OPEN_DEVICE(fd);
+    buf = buf_alloc(fd, size);
+    src = malloc(size);
+    dst = malloc(size);
+    if (!buf || !src || !dst)
+        TEST_FAIL("setup failed");
+    for (i = 0; i < size; i++)
+        src[i] = i * 7;
+
+    if (param_get("xfer_pack_max", 4096) >= 64 &&
+        copy_in_strategy(fd, buf, src, dst, 64, 0) != AI_XFER_PACKED)
+        TEST_FAIL("small copy not packed");
+    if (param_get("xfer_pack_max", 4096) < 65536 &&
+        copy_in_strategy(fd, buf, src, dst, 65536, 0) != AI_XFER_BOUNCE)
+        TEST_FAIL("medium copy not bounced");
+
+    /* Only read at execution when the caller allows it */
+    pin_min = param_get("xfer_pin_min_kb", 1024) << 10;
+    pool = fdinfo_get(fd, "ai-staging-pool");
+    if (param_get("xfer_pack_max", 4096) < (long)size &&
+        copy_in_strategy(fd, buf, src, dst, size, 0) != AI_XFER_BOUNCE)
+        TEST_FAIL("large copy without DEFER_READ not bounced");
+    if (param_get("xfer_bounce_max_kb", 1024) << 10 < (long)size &&
+        fdinfo_get(fd, "ai-staging-pool") != pool)
+        TEST_FAIL("copy above xfer_bounce_max_kb kept in the staging pool");
+    ret = copy_in_strategy(fd, buf, src, dst, size, AI_CMD_FLAG_DEFER_READ);
+    if (ret < 0)
+        TEST_FAIL("deferred copy failed");
+    if (pin_min && pin_min <= size && ret != AI_XFER_PINNED)
+        TEST_FAIL("large deferred copy not read from pinned memory");
+
+    /* DEFER_READ is for host sources only, and not with inline data */
+    cmd_copy(&cmd, AI_CMD_COPY_OUT, buf, 0, 4096, dst);
+    cmd.flags = AI_CMD_FLAG_DEFER_READ;
+    if (cmdbuf_submit(fd, &req, &cmd, 1) != -EINVAL)
+        TEST_FAIL("DEFER_READ on COPY_OUT accepted");
+    cmd_copy(&cmd, AI_CMD_COPY_IN, buf, 0, 16, NULL);
+    cmd.flags = AI_CMD_FLAG_DEFER_READ | AI_CMD_FLAG_INLINE;
+    if (cmdbuf_submit(fd, &req, &cmd, 1) != -EINVAL)
+        TEST_FAIL("DEFER_READ with inline data accepted");
+
+    free(src);
+    free(dst);
+    buf_free(fd, buf);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Status pages (mmap of AI_MMAP_DEVICE_STATUS, AI_MMAP_CONTEXT_STATUS)
+ */
+
+/* Read-only pages that follow jobs without system calls */
+int test_status_pages(void)
+{
+    const struct ai_device_status *dst;
+    const struct ai_context_status *cst;
+    const struct ai_fence_slot *slot;
+    struct ai_inference_request req;
+    struct ai_device_caps caps;
+    struct infer_setup s = {};
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t completed;
+    void *map;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 4096) || ai_ioctl(fd, AI_IOC_GET_CAPS, &caps))
+        TEST_FAIL("setup failed");
+
+    dst = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, AI_MMAP_DEVICE_STATUS);
+    cst = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, AI_MMAP_CONTEXT_STATUS);
+    if (dst == MAP_FAILED || cst == MAP_FAILED)
+        TEST_FAIL("mmap of the status pages failed");
+    if (dst->version != AI_STATUS_VERSION || cst->version != AI_STATUS_VERSION)
+        TEST_FAIL("unknown status page version");
+    if (memcmp(&dst->caps, &caps, sizeof(caps)) ||
+        dst->num_engines != caps.num_engines)
+        TEST_FAIL("device page does not match the capabilities");
+    if (cst->num_slots != AI_STATUS_FENCE_SLOTS || cst->submitted != 0)
+        TEST_FAIL("new context page not empty");
+
+    completed = dst->completed_jobs;
+    infer_req(&req, &s, 0);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req))
+        TEST_FAIL("submit failed");
+    if (cst->submitted != 1 || cst->completed != 1)
+        TEST_FAIL("context page does not count the job");
+    slot = &cst->fences[req.fence % AI_STATUS_FENCE_SLOTS];
+    if (slot->fence != req.fence || slot->status != AI_STATUS_SUCCESS)
+        TEST_FAIL("fence slot does not record the job");
+    if (dst->completed_jobs <= completed)
+        TEST_FAIL("device page does not count the job");
+
+    /* The pages stay read-only */
+    if (mprotect((void *)cst, page, PROT_READ | PROT_WRITE) == 0 ||
+        errno != EACCES)
+        TEST_FAIL("status page made writable");
+    map = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               AI_MMAP_CONTEXT_STATUS);
+    if (map != MAP_FAILED || errno != EPERM)
+        TEST_FAIL("writable mapping allowed");
+    map = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED || errno != EINVAL)
+        TEST_FAIL("mapping at an unknown offset allowed");
+    map = mmap(NULL, 2 * page, PROT_READ, MAP_SHARED, fd,
+               AI_MMAP_DEVICE_STATUS);
+    if (map != MAP_FAILED || errno != EINVAL)
+        TEST_FAIL("mapping of more than a page allowed");
+
+    munmap((void *)dst, page);
+    munmap((void *)cst, page);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Waiting on several fences (AI_IOC_WAIT_MULTI)
+ */
+
+/* Wait for any or all of a finished job and one held on a timeline */
+int test_wait_multi(void)
+{
+    struct ai_timeline_request sig = { .value = 1 };
+    struct ai_cmdbuf_request creq = { .flags = AI_INFER_ASYNC };
+    struct ai_wait_multi_request wm = {};
+    struct ai_inference_request req;
+    struct infer_setup s = {};
+    struct ai_cmd cmds[2];
+    uint64_t fences[2];
+    int32_t statuses[2];
+    int fd, tl;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    tl = timeline_create(fd, 0);
+    if (tl < 0)
+        TEST_FAIL("timeline create failed");
+
+    cmd_timeline(&cmds[0], AI_CMD_TIMELINE_WAIT, tl, 1);
+    cmd_fill(&cmds[1], s.output, 0, 16, 0);
+    if (cmdbuf_submit(fd, &creq, cmds, 2))
+        TEST_FAIL("held-back submit failed");
+    infer_req(&req, &s, AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &req))
+        TEST_FAIL("submit failed");
+    fences[0] = creq.fence;
+    fences[1] = req.fence;
+
+    wm.fences = (uintptr_t)fences;
+    wm.statuses = (uintptr_t)statuses;
+    wm.num_fences = 2;
+    wm.timeout_ns = 1000000000ULL;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm))
+        TEST_FAIL("wait for any failed");
+    if (wm.num_signaled != 1 || wm.first_signaled != 1 ||
+        statuses[0] != AI_STATUS_PENDING || statuses[1] != AI_STATUS_SUCCESS)
+        TEST_FAIL("wait for any did not return the finished job");
+
+    /* Times out on the held job; the other was retired but still counts */
+    wm.flags = AI_WAIT_ALL;
+    wm.timeout_ns = 10000000ULL;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm))
+        TEST_FAIL("timed-out wait for all failed");
+    if (wm.num_signaled != 1 || statuses[0] != AI_STATUS_PENDING ||
+        statuses[1] != AI_STATUS_SUCCESS)
+        TEST_FAIL("timed-out wait for all reported the wrong jobs");
+
+    sig.fd = tl;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &sig))
+        TEST_FAIL("timeline signal failed");
+    wm.timeout_ns = 1000000000ULL;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm))
+        TEST_FAIL("wait for all failed");
+    if (wm.num_signaled != 2 || wm.first_signaled != 0 ||
+        statuses[0] != AI_STATUS_SUCCESS)
+        TEST_FAIL("wait for all did not return both jobs");
+
+    /* No fences, too many, unknown flags and unissued fences */
+    wm.num_fences = 0;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm) != -EINVAL)
+        TEST_FAIL("empty wait accepted");
+    wm.num_fences = AI_MAX_WAIT_FENCES + 1;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm) != -EINVAL)
+        TEST_FAIL("too many fences accepted");
+    wm.num_fences = 2;
+    wm.flags = AI_WAIT_BUSY_POLL;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm) != -EINVAL)
+        TEST_FAIL("AI_WAIT_BUSY_POLL accepted by a multi wait");
+    wm.flags = 0;
+    fences[1] = 0;
+    if (ai_ioctl(fd, AI_IOC_WAIT_MULTI, &wm) != -EINVAL)
+        TEST_FAIL("fence 0 accepted");
+
+    close(tl);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Timeline semaphores (AI_IOC_TIMELINE_*, AI_CMD_TIMELINE_*)
+ */
+
+/* Timelines only move forward, and jobs wait for and advance them */
+int test_timeline(void)
+{
+    struct ai_timeline_request tr = { .value = 5, .flags = AI_TIMELINE_CLOEXEC };
+    struct ai_cmdbuf_request creq = { .flags = AI_INFER_ASYNC };
+    struct ai_cmd cmds[2];
+    int32_t status;
+    int fd, tl;
+
+    OPEN_DEVICE(fd);
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_CREATE, &tr))
+        TEST_FAIL("timeline create failed");
+    tl = tr.fd;
+    if (!(fcntl(tl, F_GETFD) & FD_CLOEXEC))
+        TEST_FAIL("AI_TIMELINE_CLOEXEC not honored");
+
+    tr.flags = 0;
+    tr.value = 100;
+    tr.timeout_ns = 0;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_WAIT, &tr) || tr.value != 5)
+        TEST_FAIL("read of the initial value failed");
+    tr.value = 5;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &tr) != -EINVAL)
+        TEST_FAIL("signal to the current value accepted");
+    tr.value = 7;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &tr))
+        TEST_FAIL("signal failed");
+    tr.value = 10;
+    tr.timeout_ns = 10000000ULL;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_WAIT, &tr) || tr.value != 7)
+        TEST_FAIL("timed-out wait did not return the current value");
+
+    /* A job held until 8 that advances the timeline to 9 */
+    cmd_timeline(&cmds[0], AI_CMD_TIMELINE_WAIT, tl, 8);
+    cmd_timeline(&cmds[1], AI_CMD_TIMELINE_SIGNAL, tl, 9);
+    if (cmdbuf_submit(fd, &creq, cmds, 2))
+        TEST_FAIL("timeline job submit failed");
+    if (fence_wait(fd, creq.fence, 0, &status) || status != AI_STATUS_PENDING)
+        TEST_FAIL("job ran before its timeline value");
+    tr.value = 8;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &tr))
+        TEST_FAIL("signal failed");
+    tr.value = 9;
+    tr.timeout_ns = 1000000000ULL;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_WAIT, &tr) || tr.value != 9)
+        TEST_FAIL("job did not advance the timeline");
+    if (fence_wait(fd, creq.fence, 1000000000ULL, &status) ||
+        status != AI_STATUS_SUCCESS)
+        TEST_FAIL("timeline job failed");
+
+    /* Unknown flags, fds that are not timelines, and bad fds */
+    tr.flags = 1 << 5;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_CREATE, &tr) != -EINVAL)
+        TEST_FAIL("unknown create flag accepted");
+    tr.flags = AI_TIMELINE_CLOEXEC;
+    tr.value = 20;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &tr) != -EINVAL)
+        TEST_FAIL("signal flags accepted");
+    tr.flags = 0;
+    tr.fd = fd;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &tr) != -EINVAL)
+        TEST_FAIL("signal of a non-timeline fd accepted");
+    tr.fd = -1;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_WAIT, &tr) != -EBADF)
+        TEST_FAIL("wait on a bad fd accepted");
+    cmd_timeline(&cmds[0], AI_CMD_TIMELINE_WAIT, -1, 1);
+    if (cmdbuf_submit(fd, &creq, cmds, 1) != -EBADF)
+        TEST_FAIL("timeline op on a bad fd accepted");
+
+    close(tl);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/* Closing a file fails every job it still holds back on a timeline */
+int test_timeline_release(void)
+{
+    struct ai_cmdbuf_request creq = { .flags = AI_INFER_ASYNC };
+    struct ai_cmd cmd;
+    uint64_t fences[3];
+    int32_t status;
+    int fd, fd2, tl, i;
+
+    OPEN_DEVICE(fd);
+    fd2 = open(AI_TEST_DEVICE, O_RDWR);
+    tl = timeline_create(fd, 0);
+    if (fd2 < 0 || tl < 0)
+        TEST_FAIL("setup failed");
+
+    for (i = 0; i < 3; i++) {
+        cmd_timeline(&cmd, AI_CMD_TIMELINE_WAIT, tl, 100 + i);
+        if (cmdbuf_submit(fd2, &creq, &cmd, 1))
+            TEST_FAIL("held-back submit failed");
+        fences[i] = creq.fence;
+    }
+
+    /* Would hang if the release waited for the timeline */
+    close(fd2);
+    for (i = 0; i < 3; i++)
+        if (fence_wait(fd, fences[i], 0, &status) || status != AI_STATUS_ERROR)
+            TEST_FAIL("held-back job not failed on release");
+
+    close(tl);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Submission queues (AI_IOC_CREATE_QUEUE, AI_IOC_DESTROY_QUEUE)
+ */
+
+/* A queue runs its jobs in order on its engines, past failures */
+int test_queue(void)
+{
+    struct ai_queue_request qr = {};
+    struct ai_inference_request a, b;
+    struct ai_profile_data pa, pb;
+    struct infer_setup slow = {}, fast = {};
+    struct ai_device_caps caps;
+    int32_t status;
+    int fd, q;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &slow, 16 << 20) || infer_setup(fd, &fast, 4096) ||
+        ai_ioctl(fd, AI_IOC_GET_CAPS, &caps))
+        TEST_FAIL("setup failed");
+    q = queue_create(fd, AI_PRIORITY_NORMAL, 1);
+    if (q <= 0)
+        TEST_FAIL("queue create failed");
+
+    /* Independent jobs, serialized only by the queue */
+    infer_req(&a, &slow, AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC);
+    a.queue = q;
+    infer_req(&b, &fast, AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC);
+    b.queue = q;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &a) || ai_ioctl(fd, AI_IOC_SUBMIT, &b))
+        TEST_FAIL("queue submit failed");
+    if (profile_wait(fd, b.fence, &pb) || fence_profile(fd, a.fence, &pa))
+        TEST_FAIL("no profiles");
+    if (pb.start_ns < pa.end_ns)
+        TEST_FAIL("queue jobs overlapped");
+    if (pa.engine_id != 0 || pb.engine_id != 0)
+        TEST_FAIL("queue job ran outside its engines");
+    fence_wait(fd, a.fence, 0, &status);
+    fence_wait(fd, b.fence, 0, &status);
+
+    /* The next job runs after one that timed out */
+    a.batch_size = 32;
+    a.timeout_ms = 5;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &a) || ai_ioctl(fd, AI_IOC_SUBMIT, &b))
+        TEST_FAIL("queue submit failed");
+    if (fence_wait(fd, b.fence, 1000000000ULL, &status) ||
+        status != AI_STATUS_SUCCESS)
+        TEST_FAIL("job after a failed one did not run");
+    if (fence_wait(fd, a.fence, 0, &status) || status != AI_STATUS_TIMEOUT)
+        TEST_FAIL("queue job did not time out");
+
+    qr.queue = q;
+    if (ai_ioctl(fd, AI_IOC_DESTROY_QUEUE, &qr))
+        TEST_FAIL("queue destroy failed");
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &b) != -ENOENT)
+        TEST_FAIL("submit to a destroyed queue accepted");
+    if (ai_ioctl(fd, AI_IOC_DESTROY_QUEUE, &qr) != -ENOENT)
+        TEST_FAIL("second destroy accepted");
+
+    /* Flags, classes and engines that do not exist */
+    memset(&qr, 0, sizeof(qr));
+    qr.flags = 1;
+    if (ai_ioctl(fd, AI_IOC_CREATE_QUEUE, &qr) != -EINVAL)
+        TEST_FAIL("queue flags accepted");
+    qr.flags = 0;
+    qr.priority = AI_PRIORITY_COUNT;
+    if (ai_ioctl(fd, AI_IOC_CREATE_QUEUE, &qr) != -EINVAL)
+        TEST_FAIL("bad queue priority accepted");
+    qr.priority = 0;
+    if (caps.num_engines < 32) {
+        qr.engine_mask = 1U << caps.num_engines;
+        if (ai_ioctl(fd, AI_IOC_CREATE_QUEUE, &qr) != -EINVAL)
+            TEST_FAIL("queue on a missing engine accepted");
+    }
+
+    infer_teardown(fd, &slow);
+    infer_teardown(fd, &fast);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Implicit buffer synchronization (AI_INFER_NO_IMPLICIT_SYNC)
+ */
+
+/* Readers of a buffer wait for its pending writer unless they opt out */
+int test_implicit_sync(void)
+{
+    struct ai_timeline_request sig = { .value = 1 };
+    struct ai_cmdbuf_request wreq = { .flags = AI_INFER_ASYNC };
+    struct ai_cmdbuf_request rreq = { .flags = AI_INFER_ASYNC };
+    struct ai_cmdbuf_request oreq = {
+        .flags = AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC,
+    };
+    struct ai_inference_request ireq;
+    struct infer_setup s = {};
+    struct ai_cmd wcmds[2], rcmd, ocmd;
+    uint8_t host[4096], other[4096];
+    int32_t status;
+    int fd, tl;
+
+    OPEN_DEVICE(fd);
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    tl = timeline_create(fd, 0);
+    if (tl < 0)
+        TEST_FAIL("timeline create failed");
+
+    /* A writer of the input held back on the timeline */
+    cmd_timeline(&wcmds[0], AI_CMD_TIMELINE_WAIT, tl, 1);
+    cmd_fill(&wcmds[1], s.input, 0, 4096, 0x11);
+    if (cmdbuf_submit(fd, &wreq, wcmds, 2))
+        TEST_FAIL("writer submit failed");
+
+    memset(host, 0, sizeof(host));
+    cmd_copy(&rcmd, AI_CMD_COPY_OUT, s.input, 0, sizeof(host), host);
+    if (cmdbuf_submit(fd, &rreq, &rcmd, 1))
+        TEST_FAIL("reader submit failed");
+    infer_req(&ireq, &s, AI_INFER_ASYNC);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &ireq))
+        TEST_FAIL("inference submit failed");
+    cmd_copy(&ocmd, AI_CMD_COPY_OUT, s.input, 0, sizeof(other), other);
+    if (cmdbuf_submit(fd, &oreq, &ocmd, 1))
+        TEST_FAIL("unsynchronized reader submit failed");
+
+    /* Only the reader that opted out may run before the write */
+    if (fence_wait(fd, oreq.fence, 1000000000ULL, &status) ||
+        status != AI_STATUS_SUCCESS)
+        TEST_FAIL("unsynchronized reader waited for the writer");
+    usleep(5000);
+    if (fence_wait(fd, rreq.fence, 0, &status) || status != AI_STATUS_PENDING)
+        TEST_FAIL("reader ran before the pending write");
+    if (fence_wait(fd, ireq.fence, 0, &status) || status != AI_STATUS_PENDING)
+        TEST_FAIL("inference ran before the pending write to its input");
+
+    sig.fd = tl;
+    if (ai_ioctl(fd, AI_IOC_TIMELINE_SIGNAL, &sig))
+        TEST_FAIL("timeline signal failed");
+    if (fence_wait(fd, rreq.fence, 1000000000ULL, &status) ||
+        status != AI_STATUS_SUCCESS)
+        TEST_FAIL("reader did not complete");
+    if (host[0] != 0x11 || host[4095] != 0x11)
+        TEST_FAIL("reader did not see the write");
+    if (fence_wait(fd, ireq.fence, 1000000000ULL, &status) ||
+        status != AI_STATUS_SUCCESS)
+        TEST_FAIL("inference did not complete");
+    fence_wait(fd, wreq.fence, 0, &status);
+
+    close(tl);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/* A failed writer orders its buffer's readers but does not fail them */
+int test_implicit_sync_failed(void)
+{
+    struct ai_cmdbuf_request wreq = { .flags = AI_INFER_ASYNC };
+    struct ai_inference_request ireq;
+    struct infer_setup s = {};
+    struct ai_cmd wcmds[2];
+    int32_t status;
+    int fd, fd2, tl;
+
+    OPEN_DEVICE(fd);
+    fd2 = open(AI_TEST_DEVICE, O_RDWR);
+    if (fd2 < 0)
+        TEST_FAIL("second open failed");
+    if (infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+    tl = timeline_create(fd, 0);
+    if (tl < 0)
+        TEST_FAIL("timeline create failed");
+
+    cmd_timeline(&wcmds[0], AI_CMD_TIMELINE_WAIT, tl, 1);
+    cmd_fill(&wcmds[1], s.input, 0, 4096, 0x22);
+    if (cmdbuf_submit(fd2, &wreq, wcmds, 2))
+        TEST_FAIL("writer submit failed");
+
+    infer_req(&ireq, &s, AI_INFER_ASYNC);
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &ireq))
+        TEST_FAIL("reader submit failed");
+    if (fence_wait(fd, ireq.fence, 0, &status) || status != AI_STATUS_PENDING)
+        TEST_FAIL("reader ran before the pending write");
+
+    /* Fails and retires the held-back writer */
+    close(fd2);
+    if (fence_wait(fd, wreq.fence, 1000000000ULL, &status) ||
+        status != AI_STATUS_ERROR)
+        TEST_FAIL("held-back writer did not fail");
+    if (fence_wait(fd, ireq.fence, 1000000000ULL, &status))
+        TEST_FAIL("wait failed");
+    if (status != AI_STATUS_SUCCESS)
+        TEST_FAIL("reader failed along with its buffer's writer");
+
+    close(tl);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+/*
+ * Dynamic batching (batch_max, ai_profile_data.batch_size)
+ */
+
+/* Queued requests for one model share a dispatch of at most batch_max */
+int test_batching(void)
+{
+    struct ai_inference_request busy[8], reqs[8], bad;
+    struct ai_cmdbuf_request creq = {};
+    struct infer_setup big = {}, s = {};
+    struct ai_device_caps caps;
+    struct ai_profile_data prof;
+    struct ai_cmd cmd;
+    uint32_t i, merged = 0;
+    int64_t max;
+    int32_t status;
+    int fd;
+
+    OPEN_DEVICE(fd);
+    if (ai_ioctl(fd, AI_IOC_GET_CAPS, &caps) || caps.num_engines > 8) {
+        close(fd);
+        TEST_SKIP("more than 8 engines");
+    }
+    max = param_get("batch_max", 32);
+    if (max > caps.max_batch_size)
+        max = caps.max_batch_size;
+    if (infer_setup(fd, &big, 16 << 20) || infer_setup(fd, &s, 4096))
+        TEST_FAIL("setup failed");
+
+    /* Full batches, each about 50 ms, keep every engine busy */
+    for (i = 0; i < caps.num_engines; i++) {
+        infer_req(&busy[i], &big, AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC);
+        busy[i].batch_size = caps.max_batch_size;
+        if (ai_ioctl(fd, AI_IOC_SUBMIT, &busy[i]))
+            TEST_FAIL("long submit failed");
+    }
+    for (i = 0; i < 8; i++) {
+        infer_req(&reqs[i], &s, AI_INFER_ASYNC | AI_INFER_NO_IMPLICIT_SYNC);
+        if (ai_ioctl(fd, AI_IOC_SUBMIT, &reqs[i]))
+            TEST_FAIL("submit failed");
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (profile_wait(fd, reqs[i].fence, &prof))
+            TEST_FAIL("no profile");
+        if (prof.batch_size < 1 || prof.batch_size > (max > 1 ? max : 1))
+            TEST_FAIL("dispatch larger than batch_max");
+        if (prof.batch_size > 1)
+            merged++;
+        if (fence_wait(fd, reqs[i].fence, 0, &status) ||
+            status != AI_STATUS_SUCCESS)
+            TEST_FAIL("batched request failed");
+    }
+    if (max > 1 && !merged)
+        TEST_FAIL("no requests were batched behind busy engines");
+
+    /* More items than the device takes */
+    infer_req(&bad, &s, 0);
+    bad.batch_size = caps.max_batch_size + 1;
+    if (ai_ioctl(fd, AI_IOC_SUBMIT, &bad) != -EINVAL)
+        TEST_FAIL("oversized batch accepted");
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = AI_CMD_RUN;
+    cmd.run.model_handle = s.model;
+    cmd.run.input_handle = s.input;
+    cmd.run.output_handle = s.output;
+    cmd.run.batch_size = caps.max_batch_size + 1;
+    if (cmdbuf_submit(fd, &creq, &cmd, 1) != -EINVAL)
+        TEST_FAIL("oversized RUN batch accepted");
+
+    for (i = 0; i < caps.num_engines; i++)
+        fence_wait(fd, busy[i].fence, 1000000000ULL, &status);
+    infer_teardown(fd, &big);
+    infer_teardown(fd, &s);
+    close(fd);
+    TEST_PASS();
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    printf("=== AI Accelerator ioctl Tests ===\n\n");
+
+    failures += test_submit_layout();
+    failures += test_submit_timing();
+    failures += test_submit_sizes();
+    failures += test_in_fences();
+    failures += test_in_fence_failed();
+    failures += test_cmdbuf_ops();
+    failures += test_priority_preempt();
+    failures += test_job_timeout();
+    failures += test_mem_accounting();
+    failures += test_mem_overcommit();
+    failures += test_dmabuf_export_import();
+    failures += test_userptr();
+    failures += test_pin_cache();
+    failures += test_userptr_large();
+    failures += test_dma_selftest();
+    failures += test_dma_cpu_engine();
+    failures += test_dma_xfer_list();
+    failures += test_copy_overlap();
+    failures += test_coalesce();
+    failures += test_wait_busy_poll();
+    failures += test_cmdbuf_inline();
+    failures += test_staging_pool_cap();
+    failures += test_xfer_strategies();
+    failures += test_status_pages();
+    failures += test_wait_multi();
+    failures += test_timeline();
+    failures += test_timeline_release();
+    failures += test_queue();
+    failures += test_implicit_sync();
+    failures += test_implicit_sync_failed();
+    failures += test_batching();
+
+    printf("\n=== Results ===\n");
+    if (failures == 0) {
+        printf("All tests passed!\n");
+        return 0;
+    } else {
+        printf("%d test(s) failed\n", failures);
+        return 1;
+    }
+}
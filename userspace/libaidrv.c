@@ -12,6 +12,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "libaidrv.h"
 #include "../include/uapi/ai_accel.h"
@@ -26,6 +27,10 @@ struct ai_device_s {
     ai_device_info_t info;
     pthread_mutex_t lock;
     int profiling_enabled;
+    ai_wait_policy_t wait_policy;
+    /* Driver status pages, NULL if they could not be mapped */
+    const volatile struct ai_device_status* status;
+    const volatile struct ai_context_status* ctx_status;
 };
 
 struct ai_buffer_s {
@@ -34,10 +39,12 @@ struct ai_buffer_s {
     size_t size;
     void* mapped_ptr;
     int is_mapped;
+    int is_host;        /* Registered host memory, mapped_ptr is its start */
 };
 
 struct ai_model_s {
     ai_device_t device;
+    uint64_t handle;
     void* model_data;
     size_t model_size;
     int num_inputs;
@@ -48,10 +55,11 @@ struct ai_model_s {
 
 struct ai_job_s {
     ai_device_t device;
-    uint64_t job_id;
+    uint64_t job_id;            /* Driver fence, 0 if never submitted */
     int complete;
     ai_error_t result;
-    uint64_t latency_ns;
+    uint64_t submit_ns;
+    uint64_t latency_ns;        /* Submission until completion was seen */
     void (*callback)(ai_job_t, void*);
     void* user_data;
 };
@@ -127,6 +135,39 @@ const char* ai_get_error_string(ai_error_t error)
  * Device Management
  */
 
+/* Map a driver status page read-only, NULL on failure */
+static const void* ai_map_status(int fd, uint64_t offset)
+{
+    void* page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                      fd, (off_t)offset);
+    return page == MAP_FAILED ? NULL : page;
+}
+
+static ai_error_t ai_job_status_error(int32_t status)
+{
+    return status == AI_STATUS_SUCCESS ? AI_SUCCESS :
+           status == AI_STATUS_TIMEOUT ? AI_ERROR_TIMEOUT :
+           AI_ERROR_DRIVER_ERROR;
+}
+
+static uint64_t ai_now_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The driver reported the job finished with @status */
+static void ai_job_finish(ai_job_t job, int32_t status)
+{
+    job->complete = 1;
+    job->result = ai_job_status_error(status);
+    job->latency_ns = ai_now_ns() - job->submit_ns;
+    if (job->callback)
+        job->callback(job, job->user_data);
+}
+
 ai_error_t ai_get_device_count(int* count)
 {
     if (!g_initialized)
@@ -194,20 +235,23 @@ ai_error_t ai_open_device(int device_index, ai_device_t* device)
     pthread_mutex_init(&dev->lock, NULL);
     
     /* Get device info */
-    struct ai_accel_info kinfo;
-    if (ioctl(dev->fd, AI_ACCEL_IOC_GET_INFO, &kinfo) == 0) {
-        strncpy(dev->info.name, kinfo.name, sizeof(dev->info.name));
-        dev->info.version_major = kinfo.version_major;
-        dev->info.version_minor = kinfo.version_minor;
-        dev->info.version_patch = kinfo.version_patch;
-        dev->info.device_memory_total = kinfo.device_memory_size;
-        dev->info.device_memory_free = kinfo.device_memory_free;
-        dev->info.max_batch_size = kinfo.max_batch_size;
-        dev->info.max_compute_units = kinfo.max_compute_units;
-        dev->info.max_frequency_mhz = kinfo.max_frequency_mhz;
-        dev->info.memory_bandwidth_gbps = kinfo.memory_bandwidth_gbps;
+    struct ai_device_caps caps;
+    if (ioctl(dev->fd, AI_IOC_GET_CAPS, &caps) == 0) {
+        snprintf(dev->info.name, sizeof(dev->info.name), "%s%d",
+                 AI_ACCEL_DEV_NAME, device_index);
+        dev->info.version_major = caps.version >> 16;
+        dev->info.version_minor = (caps.version >> 8) & 0xff;
+        dev->info.version_patch = caps.version & 0xff;
+        dev->info.device_memory_total = caps.memory_size;
+        dev->info.device_memory_free = caps.memory_size;
+        dev->info.max_batch_size = caps.max_batch_size;
+        dev->info.max_compute_units = caps.num_engines;
     }
     
+    /* Optional: without them stats and job checks use ioctls */
+    dev->status = ai_map_status(dev->fd, AI_MMAP_DEVICE_STATUS);
+    dev->ctx_status = ai_map_status(dev->fd, AI_MMAP_CONTEXT_STATUS);
+    
     *device = dev;
     return AI_SUCCESS;
 }
@@ -217,6 +261,10 @@ ai_error_t ai_close_device(ai_device_t device)
     if (!device)
         return AI_ERROR_INVALID_HANDLE;
     
+    if (device->status)
+        munmap((void*)device->status, sysconf(_SC_PAGESIZE));
+    if (device->ctx_status)
+        munmap((void*)device->ctx_status, sysconf(_SC_PAGESIZE));
     pthread_mutex_destroy(&device->lock);
     close(device->fd);
     free(device);
@@ -230,6 +278,8 @@ ai_error_t ai_get_device_info(ai_device_t device, ai_device_info_t* info)
         return AI_ERROR_INVALID_PARAM;
     
     memcpy(info, &device->info, sizeof(*info));
+    if (device->status)
+        info->device_memory_free = device->status->mem_free;
     return AI_SUCCESS;
 }
 
@@ -238,35 +288,66 @@ ai_error_t ai_get_device_stats(ai_device_t device, ai_stats_t* stats)
     if (!device || !stats)
         return AI_ERROR_INVALID_PARAM;
     
-    struct ai_accel_stats kstats;
+    /* The status page answers without a system call; it has no latency */
+    if (device->status) {
+        const volatile struct ai_device_status* st = device->status;
+        uint32_t active = 0;
+        
+        for (uint32_t i = 0; i < st->num_engines; i++)
+            active += st->engines[i].depth;
+        
+        stats->total_inferences = st->total_inferences;
+        stats->total_bytes_processed = st->total_bytes_processed;
+        stats->average_latency_ns = 0;
+        stats->active_jobs = active;
+        stats->completed_jobs = st->completed_jobs;
+        stats->failed_jobs = st->failed_jobs;
+        return AI_SUCCESS;
+    }
+    
+    /* The driver reports statistics only through the status page */
+    return AI_ERROR_NOT_SUPPORTED;
+}
+
+ai_error_t ai_set_power_mode(ai_device_t device, ai_power_mode_t mode)
+{
+    if (!device)
+        return AI_ERROR_INVALID_HANDLE;
+    
+    /* The driver has no power management interface */
+    (void)mode;
+    return AI_ERROR_NOT_SUPPORTED;
+}
+
+ai_error_t ai_set_completion_coalescing(ai_device_t device, uint32_t max_jobs,
+                                        uint32_t max_usecs)
+{
+    if (!device)
+        return AI_ERROR_INVALID_HANDLE;
+    
+    struct ai_coalesce_request req = {
+        .max_jobs = max_jobs,
+        .max_usecs = max_usecs
+    };
     
     pthread_mutex_lock(&device->lock);
-    int ret = ioctl(device->fd, AI_ACCEL_IOC_GET_STATS, &kstats);
+    int ret = ioctl(device->fd, AI_IOC_SET_COALESCE, &req);
     pthread_mutex_unlock(&device->lock);
     
     if (ret < 0)
-        return AI_ERROR_DRIVER_ERROR;
-    
-    stats->total_inferences = kstats.total_inferences;
-    stats->total_bytes_processed = kstats.total_bytes_in + kstats.total_bytes_out;
-    stats->average_latency_ns = kstats.average_latency_ns;
-    stats->active_jobs = kstats.active_jobs;
-    stats->completed_jobs = kstats.completed_jobs;
-    stats->failed_jobs = kstats.failed_jobs;
-    
+        return errno == EINVAL ? AI_ERROR_INVALID_PARAM : AI_ERROR_DRIVER_ERROR;
     return AI_SUCCESS;
 }
 
-ai_error_t ai_set_power_mode(ai_device_t device, ai_power_mode_t mode)
+ai_error_t ai_set_wait_policy(ai_device_t device, ai_wait_policy_t policy)
 {
     if (!device)
         return AI_ERROR_INVALID_HANDLE;
+    if (policy != AI_WAIT_POLICY_SLEEP && policy != AI_WAIT_POLICY_BUSY_POLL)
+        return AI_ERROR_INVALID_PARAM;
     
-    pthread_mutex_lock(&device->lock);
-    int ret = ioctl(device->fd, AI_ACCEL_IOC_SET_POWER, (unsigned long)mode);
-    pthread_mutex_unlock(&device->lock);
-    
-    return (ret < 0) ? AI_ERROR_DRIVER_ERROR : AI_SUCCESS;
+    device->wait_policy = policy;
+    return AI_SUCCESS;
 }
 
 /*
@@ -282,10 +363,10 @@ ai_error_t ai_alloc_buffer(ai_device_t device, size_t size, ai_buffer_t* buffer)
     if (!buf)
         return AI_ERROR_NO_MEMORY;
     
-    struct ai_accel_mem_alloc alloc = { .size = size };
+    struct ai_alloc_request alloc = { .size = size };
     
     pthread_mutex_lock(&device->lock);
-    int ret = ioctl(device->fd, AI_ACCEL_IOC_ALLOC_MEM, &alloc);
+    int ret = ioctl(device->fd, AI_IOC_ALLOC, &alloc);
     pthread_mutex_unlock(&device->lock);
     
     if (ret < 0) {
@@ -295,7 +376,7 @@ ai_error_t ai_alloc_buffer(ai_device_t device, size_t size, ai_buffer_t* buffer)
     
     buf->device = device;
     buf->handle = alloc.handle;
-    buf->size = alloc.size;
+    buf->size = size;
     buf->mapped_ptr = NULL;
     buf->is_mapped = 0;
     
@@ -303,6 +384,41 @@ ai_error_t ai_alloc_buffer(ai_device_t device, size_t size, ai_buffer_t* buffer)
     return AI_SUCCESS;
 }
 
+ai_error_t ai_register_host_memory(ai_device_t device, void* ptr, size_t size,
+                                   ai_buffer_t* buffer)
+{
+    if (!device || !ptr || !buffer || size == 0)
+        return AI_ERROR_INVALID_PARAM;
+    
+    struct ai_buffer_s* buf = calloc(1, sizeof(struct ai_buffer_s));
+    if (!buf)
+        return AI_ERROR_NO_MEMORY;
+    
+    struct ai_userptr_request req = {
+        .user_ptr = (uint64_t)(uintptr_t)ptr,
+        .size = size
+    };
+    
+    pthread_mutex_lock(&device->lock);
+    int ret = ioctl(device->fd, AI_IOC_REGISTER_USERPTR, &req);
+    pthread_mutex_unlock(&device->lock);
+    
+    if (ret < 0) {
+        free(buf);
+        return errno == EINVAL ? AI_ERROR_INVALID_PARAM : AI_ERROR_NO_MEMORY;
+    }
+    
+    buf->device = device;
+    buf->handle = req.handle;
+    buf->size = size;
+    buf->mapped_ptr = ptr;
+    buf->is_mapped = 1;
+    buf->is_host = 1;
+    
+    *buffer = buf;
+    return AI_SUCCESS;
+}
+
 ai_error_t ai_free_buffer(ai_buffer_t buffer)
 {
     if (!buffer)
@@ -312,13 +428,10 @@ ai_error_t ai_free_buffer(ai_buffer_t buffer)
         ai_unmap_buffer(buffer);
     }
     
-    struct ai_accel_mem_free mfree = {
-        .handle = buffer->handle,
-        .size = buffer->size
-    };
+    struct ai_free_request mfree = { .handle = buffer->handle };
     
     pthread_mutex_lock(&buffer->device->lock);
-    ioctl(buffer->device->fd, AI_ACCEL_IOC_FREE_MEM, &mfree);
+    ioctl(buffer->device->fd, AI_IOC_FREE, &mfree);
     pthread_mutex_unlock(&buffer->device->lock);
     
     free(buffer);
@@ -393,7 +506,8 @@ ai_error_t ai_unmap_buffer(ai_buffer_t buffer)
     if (!buffer)
         return AI_ERROR_INVALID_HANDLE;
     
-    if (!buffer->is_mapped)
+    /* Host memory stays mapped for as long as the buffer exists */
+    if (!buffer->is_mapped || buffer->is_host)
         return AI_SUCCESS;
     
     munmap(buffer->mapped_ptr, buffer->size);
@@ -459,6 +573,23 @@ ai_error_t ai_load_model_from_memory(ai_device_t device, const void* data,
     m->model_size = size;
     m->device = device;
     
+    struct ai_load_model_request req = {
+        .model_data = (uintptr_t)data,
+        .model_size = size
+    };
+    
+    pthread_mutex_lock(&device->lock);
+    int ret = ioctl(device->fd, AI_IOC_LOAD_MODEL, &req);
+    pthread_mutex_unlock(&device->lock);
+    
+    if (ret < 0) {
+        free(m->model_data);
+        free(m);
+        return errno == ENOMEM || errno == EDQUOT ? AI_ERROR_NO_MEMORY :
+               AI_ERROR_DRIVER_ERROR;
+    }
+    m->handle = req.model_handle;
+    
     /* Default: assume 1 input, 1 output (would parse model format in real impl) */
     m->num_inputs = 1;
     m->num_outputs = 1;
@@ -474,6 +605,13 @@ ai_error_t ai_unload_model(ai_model_t model)
     if (!model)
         return AI_ERROR_INVALID_HANDLE;
     
+    /* Jobs still using the model keep it alive in the driver */
+    struct ai_unload_model_request req = { .model_handle = model->handle };
+    
+    pthread_mutex_lock(&model->device->lock);
+    ioctl(model->device->fd, AI_IOC_UNLOAD_MODEL, &req);
+    pthread_mutex_unlock(&model->device->lock);
+    
     free(model->model_data);
     free(model->inputs);
     free(model->outputs);
@@ -508,32 +646,55 @@ ai_error_t ai_get_model_output(ai_model_t model, int index, ai_tensor_desc_t* de
  * Inference
  */
 
-ai_error_t ai_run_inference(ai_model_t model,
-                            ai_buffer_t* inputs, int num_inputs,
-                            ai_buffer_t* outputs, int num_outputs,
-                            const ai_inference_params_t* params)
+/* An AI_IOC_SUBMIT request for the first input and output buffer */
+static ai_error_t ai_prepare_submit(struct ai_inference_request* req,
+                                    ai_model_t model,
+                                    ai_buffer_t* inputs, int num_inputs,
+                                    ai_buffer_t* outputs, int num_outputs,
+                                    const ai_inference_params_t* params)
 {
     if (!model || !inputs || !outputs)
         return AI_ERROR_INVALID_PARAM;
-    if (num_inputs < 1 || num_outputs < 1)
+    if (num_inputs < 1 || num_outputs < 1 || !inputs[0] || !outputs[0])
         return AI_ERROR_INVALID_PARAM;
     
-    struct ai_accel_inference inf = {
-        .input_data = (uint64_t)inputs[0]->handle,
-        .input_size = inputs[0]->size,
-        .output_data = (uint64_t)outputs[0]->handle,
-        .output_size = outputs[0]->size,
-        .batch_size = params ? params->batch_size : 1,
-    };
-    
-    pthread_mutex_lock(&model->device->lock);
-    int ret = ioctl(model->device->fd, AI_ACCEL_IOC_SUBMIT_INFERENCE, &inf);
-    pthread_mutex_unlock(&model->device->lock);
-    
-    if (ret < 0)
-        return AI_ERROR_DRIVER_ERROR;
+    memset(req, 0, sizeof(*req));
+    req->model_handle = model->handle;
+    req->input_handle = inputs[0]->handle;
+    req->output_handle = outputs[0]->handle;
+    req->input_size = inputs[0]->size;
+    req->output_size = outputs[0]->size;
+    if (params) {
+        req->batch_size = params->batch_size;
+        req->timeout_ms = params->timeout_ms;
+    }
+    return AI_SUCCESS;
+}
+
+static ai_error_t ai_submit_error(int err)
+{
+    return err == ETIMEDOUT ? AI_ERROR_TIMEOUT :
+           err == EINVAL || err == ENOENT ? AI_ERROR_INVALID_PARAM :
+           err == ENOMEM || err == EDQUOT ? AI_ERROR_NO_MEMORY :
+           AI_ERROR_DRIVER_ERROR;
+}
+
+ai_error_t ai_run_inference(ai_model_t model,
+                            ai_buffer_t* inputs, int num_inputs,
+                            ai_buffer_t* outputs, int num_outputs,
+                            const ai_inference_params_t* params)
+{
+    struct ai_inference_request req;
+    ai_error_t err = ai_prepare_submit(&req, model, inputs, num_inputs,
+                                       outputs, num_outputs, params);
+    if (err != AI_SUCCESS)
+        return err;
     
-    return (inf.status == AI_STATUS_SUCCESS) ? AI_SUCCESS : AI_ERROR_DRIVER_ERROR;
+    /* The driver returns once the job has finished */
+    req.flags = AI_INFER_SYNC;
+    if (ioctl(model->device->fd, AI_IOC_SUBMIT, &req) < 0)
+        return ai_submit_error(errno);
+    return AI_SUCCESS;
 }
 
 ai_error_t ai_submit_inference(ai_model_t model,
@@ -542,8 +703,38 @@ ai_error_t ai_submit_inference(ai_model_t model,
                                 const ai_inference_params_t* params,
                                 ai_job_t* job)
 {
+    uint64_t fences[AI_MAX_IN_FENCES];
+    uint32_t num_fences = 0;
+    
     if (!job)
         return AI_ERROR_INVALID_PARAM;
+    if (params && (params->num_wait_jobs < 0 ||
+                   params->num_wait_jobs > AI_MAX_IN_FENCES ||
+                   (params->num_wait_jobs && !params->wait_jobs)))
+        return AI_ERROR_INVALID_PARAM;
+    
+    struct ai_inference_request req;
+    ai_error_t err = ai_prepare_submit(&req, model, inputs, num_inputs,
+                                       outputs, num_outputs, params);
+    if (err != AI_SUCCESS)
+        return err;
+    
+    /*
+     * Pending dependencies become in-fences, so the driver holds the job
+     * back; one already known to have failed fails the job right away.
+     */
+    ai_error_t dep_err = AI_SUCCESS;
+    for (int i = 0; params && i < params->num_wait_jobs; i++) {
+        ai_job_t dep = params->wait_jobs[i];
+        if (!dep)
+            return AI_ERROR_INVALID_HANDLE;
+        if (dep->device != model->device)
+            return AI_ERROR_INVALID_PARAM;
+        if (!dep->complete)
+            fences[num_fences++] = dep->job_id;
+        else if (dep->result != AI_SUCCESS)
+            dep_err = dep->result;
+    }
     
     struct ai_job_s* j = calloc(1, sizeof(struct ai_job_s));
     if (!j)
@@ -553,13 +744,26 @@ ai_error_t ai_submit_inference(ai_model_t model,
     j->callback = params ? params->completion_callback : NULL;
     j->user_data = params ? params->user_data : NULL;
     
-    /* For sync implementation, run immediately */
-    ai_error_t err = ai_run_inference(model, inputs, num_inputs, 
-                                       outputs, num_outputs, params);
+    if (dep_err != AI_SUCCESS) {
+        j->complete = 1;
+        j->result = dep_err;
+        *job = j;
+        if (j->callback)
+            j->callback(j, j->user_data);
+        return AI_SUCCESS;
+    }
     
-    j->complete = 1;
-    j->result = err;
+    req.flags = AI_INFER_ASYNC;
+    req.num_in_fences = num_fences;
+    req.in_fences = (uintptr_t)fences;
+    if (ioctl(model->device->fd, AI_IOC_SUBMIT, &req) < 0) {
+        err = ai_submit_error(errno);
+        free(j);
+        return err;
+    }
     
+    j->job_id = req.fence;
+    j->submit_ns = ai_now_ns();
     *job = j;
     return AI_SUCCESS;
 }
@@ -569,11 +773,85 @@ ai_error_t ai_wait_job(ai_job_t job, uint32_t timeout_ms)
     if (!job)
         return AI_ERROR_INVALID_HANDLE;
     
-    /* In async implementation, would wait on completion */
-    /* For sync, job is already complete */
-    (void)timeout_ms;
+    if (job->complete)
+        return job->result;
     
-    return job->complete ? AI_SUCCESS : AI_ERROR_TIMEOUT;
+    /* The busy-poll budget is the driver's wait_busy_poll_us */
+    struct ai_wait_request req = {
+        .fence = job->job_id,
+        .timeout_ns = timeout_ms ? (uint64_t)timeout_ms * 1000000 : UINT64_MAX,
+        .flags = job->device->wait_policy == AI_WAIT_POLICY_BUSY_POLL ?
+                 AI_WAIT_BUSY_POLL : 0
+    };
+    
+    if (ioctl(job->device->fd, AI_IOC_WAIT, &req) < 0)
+        return AI_ERROR_DRIVER_ERROR;
+    if (req.status == AI_STATUS_PENDING)
+        return AI_ERROR_TIMEOUT;
+    
+    ai_job_finish(job, req.status);
+    return job->result;
+}
+
+ai_error_t ai_wait_jobs(ai_job_t* jobs, int num_jobs, int wait_all,
+                        uint32_t timeout_ms, int* index)
+{
+    uint64_t fences[AI_MAX_WAIT_FENCES];
+    int32_t status[AI_MAX_WAIT_FENCES];
+    int slot[AI_MAX_WAIT_FENCES];
+    ai_device_t device = NULL;
+    int pending = 0, first = -1;
+    
+    if (!jobs || num_jobs <= 0 || num_jobs > AI_MAX_WAIT_FENCES)
+        return AI_ERROR_INVALID_PARAM;
+    
+    for (int i = 0; i < num_jobs; i++) {
+        if (!jobs[i])
+            return AI_ERROR_INVALID_HANDLE;
+        if (jobs[i]->complete) {
+            if (first < 0)
+                first = i;
+            continue;
+        }
+        if (device && jobs[i]->device != device)
+            return AI_ERROR_INVALID_PARAM;
+        device = jobs[i]->device;
+        slot[pending] = i;
+        fences[pending++] = jobs[i]->job_id;
+    }
+    
+    if (pending && (wait_all || first < 0)) {
+        struct ai_wait_multi_request req = {
+            .fences = (uintptr_t)fences,
+            .statuses = (uintptr_t)status,
+            .timeout_ns = timeout_ms ? (uint64_t)timeout_ms * 1000000 : UINT64_MAX,
+            .num_fences = pending,
+            .flags = wait_all ? AI_WAIT_ALL : 0
+        };
+        
+        if (ioctl(device->fd, AI_IOC_WAIT_MULTI, &req) < 0)
+            return AI_ERROR_DRIVER_ERROR;
+        
+        for (int k = 0; k < pending; k++) {
+            ai_job_t job = jobs[slot[k]];
+            
+            if (status[k] == AI_STATUS_PENDING)
+                continue;
+            ai_job_finish(job, status[k]);
+            if (first < 0 || slot[k] < first)
+                first = slot[k];
+        }
+        
+        if (wait_all ? req.num_signaled < (uint32_t)pending : !req.num_signaled) {
+            if (index)
+                *index = first;
+            return AI_ERROR_TIMEOUT;
+        }
+    }
+    
+    if (index)
+        *index = first;
+    return AI_SUCCESS;
 }
 
 ai_error_t ai_check_job(ai_job_t job, int* complete)
@@ -581,6 +859,28 @@ ai_error_t ai_check_job(ai_job_t job, int* complete)
     if (!job || !complete)
         return AI_ERROR_INVALID_PARAM;
     
+    const volatile struct ai_context_status* cst = job->device->ctx_status;
+    if (!job->complete && job->job_id && cst) {
+        const volatile struct ai_fence_slot* slot =
+            &cst->fences[job->job_id % AI_STATUS_FENCE_SLOTS];
+        uint64_t fence = slot->fence;
+        __sync_synchronize();
+        int32_t status = slot->status;
+        __sync_synchronize();
+        
+        if (fence == job->job_id && slot->fence == fence) {
+            ai_job_finish(job, status);
+        } else if (fence > job->job_id) {
+            /* A later job took the slot; ask the driver without waiting */
+            struct ai_wait_request req = { .fence = job->job_id };
+            
+            if (ioctl(job->device->fd, AI_IOC_WAIT, &req) < 0)
+                return AI_ERROR_DRIVER_ERROR;
+            if (req.status != AI_STATUS_PENDING)
+                ai_job_finish(job, req.status);
+        }
+    }
+    
     *complete = job->complete;
     return AI_SUCCESS;
 }
@@ -602,6 +902,58 @@ void ai_release_job(ai_job_t job)
         free(job);
 }
 
+/*
+ * Timeline Semaphores
+ */
+
+ai_error_t ai_create_timeline(ai_device_t device, uint64_t initial_value, int* fd)
+{
+    if (!device)
+        return AI_ERROR_INVALID_HANDLE;
+    if (!fd)
+        return AI_ERROR_INVALID_PARAM;
+    
+    struct ai_timeline_request req = {
+        .value = initial_value,
+        .flags = AI_TIMELINE_CLOEXEC
+    };
+    
+    if (ioctl(device->fd, AI_IOC_TIMELINE_CREATE, &req) < 0)
+        return errno == ENOMEM ? AI_ERROR_NO_MEMORY : AI_ERROR_DRIVER_ERROR;
+    
+    *fd = req.fd;
+    return AI_SUCCESS;
+}
+
+ai_error_t ai_signal_timeline(ai_device_t device, int fd, uint64_t value)
+{
+    if (!device)
+        return AI_ERROR_INVALID_HANDLE;
+    
+    struct ai_timeline_request req = { .fd = fd, .value = value };
+    
+    if (ioctl(device->fd, AI_IOC_TIMELINE_SIGNAL, &req) < 0)
+        return errno == EINVAL ? AI_ERROR_INVALID_PARAM : AI_ERROR_DRIVER_ERROR;
+    return AI_SUCCESS;
+}
+
+ai_error_t ai_wait_timeline(ai_device_t device, int fd, uint64_t value,
+                            uint32_t timeout_ms)
+{
+    if (!device)
+        return AI_ERROR_INVALID_HANDLE;
+    
+    struct ai_timeline_request req = {
+        .fd = fd,
+        .value = value,
+        .timeout_ns = timeout_ms ? (uint64_t)timeout_ms * 1000000 : UINT64_MAX
+    };
+    
+    if (ioctl(device->fd, AI_IOC_TIMELINE_WAIT, &req) < 0)
+        return AI_ERROR_DRIVER_ERROR;
+    return req.value >= value ? AI_SUCCESS : AI_ERROR_TIMEOUT;
+}
+
 /*
  * Profiling
  */
@@ -55,6 +55,12 @@ typedef enum {
     AI_POWER_MAX = 4
 } ai_power_mode_t;
 
+/* Wait Policies */
+typedef enum {
+    AI_WAIT_POLICY_SLEEP = 0,       /* Sleep until the job completes */
+    AI_WAIT_POLICY_BUSY_POLL = 1    /* Spin briefly first, for very short jobs */
+} ai_wait_policy_t;
+
 /* Opaque handle types */
 typedef struct ai_device_s* ai_device_t;
 typedef struct ai_buffer_s* ai_buffer_t;
@@ -105,8 +111,11 @@ typedef struct {
     uint32_t timeout_ms;
     ai_power_mode_t power_mode;
     int async;
+    /* Called by whichever wait or check call first sees the job complete */
     void (*completion_callback)(ai_job_t job, void* user_data);
     void* user_data;
+    const ai_job_t* wait_jobs;      /* Jobs that must finish first (may be NULL) */
+    int num_wait_jobs;              /* Entries in wait_jobs, at most 16 */
 } ai_inference_params_t;
 
 /*
@@ -189,6 +198,24 @@ ai_error_t ai_get_device_stats(ai_device_t device, ai_stats_t* stats);
  */
 ai_error_t ai_set_power_mode(ai_device_t device, ai_power_mode_t mode);
 
+/**
+ * Wake waiters on this device handle in batches
+ * @param device Device handle
+ * @param max_jobs Completions per wakeup, 0 or 1 to disable
+ * @param max_usecs Longest a completion is held back, required with max_jobs > 1
+ * @return AI_SUCCESS on success
+ */
+ai_error_t ai_set_completion_coalescing(ai_device_t device, uint32_t max_jobs,
+                                        uint32_t max_usecs);
+
+/**
+ * Choose how ai_wait_job() waits on jobs of this device
+ * @param device Device handle
+ * @param policy Wait policy
+ * @return AI_SUCCESS on success
+ */
+ai_error_t ai_set_wait_policy(ai_device_t device, ai_wait_policy_t policy);
+
 /*
  * Memory Management
  */
@@ -202,6 +229,17 @@ ai_error_t ai_set_power_mode(ai_device_t device, ai_power_mode_t mode);
  */
 ai_error_t ai_alloc_buffer(ai_device_t device, size_t size, ai_buffer_t* buffer);
 
+/**
+ * Register existing host memory as a buffer, without copying
+ * @param device Device handle
+ * @param ptr Start of the host memory; it must stay mapped until freed
+ * @param size Size in bytes
+ * @param buffer Pointer to store buffer handle
+ * @return AI_SUCCESS on success
+ */
+ai_error_t ai_register_host_memory(ai_device_t device, void* ptr, size_t size,
+                                   ai_buffer_t* buffer);
+
 /**
  * Free device memory buffer
  * @param buffer Buffer handle
@@ -316,6 +354,11 @@ ai_error_t ai_run_inference(ai_model_t model,
 
 /**
  * Submit asynchronous inference job
+ *
+ * The job is queued immediately and starts once every job listed in
+ * params->wait_jobs has finished. If any of them failed, this job fails
+ * without running.
+ *
  * @param model Model handle
  * @param inputs Array of input buffers
  * @param num_inputs Number of inputs
@@ -335,10 +378,24 @@ ai_error_t ai_submit_inference(ai_model_t model,
  * Wait for job completion
  * @param job Job handle
  * @param timeout_ms Timeout in milliseconds (0 for infinite)
- * @return AI_SUCCESS on completion, AI_ERROR_TIMEOUT on timeout
+ * @return The job's result once complete, as ai_get_job_result(), or
+ *         AI_ERROR_TIMEOUT on timeout
  */
 ai_error_t ai_wait_job(ai_job_t job, uint32_t timeout_ms);
 
+/**
+ * Wait for any or all of several jobs of one device in a single call
+ * @param jobs Job handles
+ * @param num_jobs Number of jobs (at most 64)
+ * @param wait_all Non-zero to wait for every job rather than any
+ * @param timeout_ms Timeout in milliseconds (0 for infinite)
+ * @param index Lowest index of a completed job, -1 if none (optional)
+ * @return AI_SUCCESS once the condition holds, AI_ERROR_TIMEOUT on timeout;
+ *         each job's outcome is left to ai_get_job_result()
+ */
+ai_error_t ai_wait_jobs(ai_job_t* jobs, int num_jobs, int wait_all,
+                        uint32_t timeout_ms, int* index);
+
 /**
  * Check if job is complete
  * @param job Job handle
@@ -350,7 +407,8 @@ ai_error_t ai_check_job(ai_job_t job, int* complete);
 /**
  * Get job result/status
  * @param job Job handle
- * @param latency_ns Pointer to store latency (optional, can be NULL)
+ * @param latency_ns Pointer to store the time from submission until the
+ *        library saw the job complete (optional, can be NULL)
  * @return AI_SUCCESS if job succeeded, error code if job failed
  */
 ai_error_t ai_get_job_result(ai_job_t job, uint64_t* latency_ns);
@@ -361,6 +419,40 @@ ai_error_t ai_get_job_result(ai_job_t job, uint64_t* latency_ns);
  */
 void ai_release_job(ai_job_t job);
 
+/*
+ * Timeline Semaphores
+ */
+
+/**
+ * Create a timeline semaphore, shareable with other processes as an fd
+ * (fork, SCM_RIGHTS); close() the fd when done
+ * @param device Device handle
+ * @param initial_value Starting value
+ * @param fd Pointer to store the timeline fd
+ * @return AI_SUCCESS on success
+ */
+ai_error_t ai_create_timeline(ai_device_t device, uint64_t initial_value, int* fd);
+
+/**
+ * Advance a timeline
+ * @param device Device handle
+ * @param fd Timeline fd
+ * @param value New value, greater than the current one
+ * @return AI_SUCCESS on success, AI_ERROR_INVALID_PARAM if not greater
+ */
+ai_error_t ai_signal_timeline(ai_device_t device, int fd, uint64_t value);
+
+/**
+ * Wait until a timeline reaches a value
+ * @param device Device handle
+ * @param fd Timeline fd
+ * @param value Value to wait for
+ * @param timeout_ms Timeout in milliseconds (0 for infinite)
+ * @return AI_SUCCESS once reached, AI_ERROR_TIMEOUT on timeout
+ */
+ai_error_t ai_wait_timeline(ai_device_t device, int fd, uint64_t value,
+                            uint32_t timeout_ms);
+
 /*
  * Profiling
  */